@@ -0,0 +1,106 @@
+#pragma once
+
+#include "math.h"
+#include "scheduler.h"
+
+#include <cfloat>
+#include <cstring>
+#include <vector>
+#include <mutex>
+
+number_t luminance(const Vec3& c) {
+	return c.x * 0.2126f + c.y * 0.7152f + c.z * 0.0722f;
+}
+
+/*
+Running statistics of one pixel's samples (Welford's algorithm).
+Tracks the color sum and the variance of the sample luminance, which is
+what the adaptive sampler uses as its noise estimate.
+*/
+struct PixelAccumulator {
+	u32 count = 0;
+	// Sum rather than mean, so the resolved color is the same sum / count a plain average gives
+	Vec3 sum{ 0.f, 0.f, 0.f };
+	number_t m2 = 0.f;
+
+	void add(const Vec3& sample) {
+		number_t old_lum = count > 0 ? luminance(sum) / count : 0.f;
+		count++;
+		sum = sum + sample;
+		number_t lum = luminance(sample);
+		m2 += (lum - old_lum) * (lum - luminance(sum) / count);
+	}
+	Vec3 mean() const {
+		return count > 0 ? sum * (1.f / count) : Vec3{ 0.f, 0.f, 0.f };
+	}
+	number_t variance() const {
+		return count > 1 ? m2 / (count - 1) : 0.f;
+	}
+	// Standard error of the mean luminance relative to the luminance itself
+	number_t relative_error() const {
+		if (count < 2)
+			return FLT_MAX;
+		// Dark pixels would otherwise never converge in relative terms
+		const number_t DARK = 0.01f;
+		return std::sqrt(variance() / count) / std::max(luminance(mean()), DARK);
+	}
+};
+
+/*
+Per pixel sample statistics of a whole render. Tiles read their pixels,
+add samples to a local copy and commit it back, the lock only guards commits
+against a concurrent snapshot for a checkpoint.
+*/
+class AccumulationBuffer {
+public:
+	void reset(u32 width, u32 height) {
+		w = width;
+		h = height;
+		pixels.assign((size_t)w * h, PixelAccumulator{});
+	}
+	u32 width() const { return w; }
+	u32 height() const { return h; }
+	bool empty() const { return pixels.empty(); }
+
+	// Only safe while no tile covering the pixel is being committed
+	const PixelAccumulator& get(u32 x, u32 y) const { return pixels[x + (size_t)y * w]; }
+
+	void load_tile(TileRange ti, PixelAccumulator* out) const {
+		for (u32 k = 0; k < ti.h; k++)
+			for (u32 i = 0; i < ti.w; i++)
+				out[i + k * ti.w] = get(ti.x + i, ti.y + k);
+	}
+	void commit_tile(TileRange ti, const PixelAccumulator* in) {
+		std::lock_guard l(mutex);
+		for (u32 k = 0; k < ti.h; k++)
+			for (u32 i = 0; i < ti.w; i++)
+				pixels[ti.x + i + (size_t)(ti.y + k) * w] = in[i + k * ti.w];
+	}
+
+	// Root mean square of the pixels' relative_error, FLT_MAX until every pixel has two samples
+	number_t rms_relative_error() const {
+		double sum = 0.0;
+		for (const PixelAccumulator& p : pixels) {
+			if (p.count < 2)
+				return FLT_MAX;
+			number_t e = p.relative_error();
+			sum += (double)e * e;
+		}
+		return pixels.empty() ? 0.f : (number_t)std::sqrt(sum / pixels.size());
+	}
+
+	// Raw pixel data for checkpoints
+	size_t size_bytes() const { return pixels.size() * sizeof(PixelAccumulator); }
+	void snapshot(void* out) const {
+		std::lock_guard l(mutex);
+		memcpy(out, pixels.data(), size_bytes());
+	}
+	void restore(u32 width, u32 height, const void* in) {
+		reset(width, height);
+		memcpy(pixels.data(), in, size_bytes());
+	}
+private:
+	std::vector<PixelAccumulator> pixels;
+	u32 w = 0, h = 0;
+	mutable std::mutex mutex;
+};
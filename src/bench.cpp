@@ -0,0 +1,1415 @@
+#include "math.h"
+#include "scene.h"
+#include "scenes.h"
+#include "image.h"
+#include "renderer.h"
+#include "image_io.h"
+#include "scene_io.h"
+#include "perf_counters.h"
+#include "resample.h"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+#include <type_traits>
+
+template<typename F>
+double time_seconds(F&& f) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+	f();
+	auto t1 = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double>(t1 - t0).count();
+}
+
+/*
+One benchmark result, the case name and its fields in order. Printed as a tab
+separated key=value line as soon as it is reported and kept for the --json
+report, which is meant to be diffed between commits.
+*/
+class BenchResult {
+public:
+	explicit BenchResult(const std::string& name)
+		:
+		name(name) {
+	}
+	template<typename T>
+	BenchResult& add(const std::string& key, const T& value) {
+		std::ostringstream ss;
+		ss << value;
+		fields.push_back(Field{ key, ss.str(), !std::is_arithmetic_v<T> });
+		return *this;
+	}
+	std::string text() const {
+		std::string line = name;
+		for (const Field& f : fields)
+			line += "\t" + f.key + "=" + f.value;
+		return line;
+	}
+	std::string json() const {
+		std::string obj = "{\"name\": \"" + name + "\"";
+		for (const Field& f : fields) {
+			obj += ", \"" + f.key + "\": ";
+			if (f.quoted)
+				obj += "\"" + f.value + "\"";
+			// JSON has no infinities or NaN
+			else if (f.value.find_first_of("ia") != std::string::npos)
+				obj += "null";
+			else
+				obj += f.value;
+		}
+		return obj + "}";
+	}
+private:
+	struct Field {
+		std::string key;
+		std::string value;
+		bool quoted;
+	};
+	std::string name;
+	std::vector<Field> fields;
+};
+
+std::vector<BenchResult>& bench_results() {
+	static std::vector<BenchResult> results;
+	return results;
+}
+
+void report(const BenchResult& r) {
+	std::cout << r.text() << std::endl;
+	bench_results().push_back(r);
+}
+
+// Results with the build configuration, so reports from different machines and builds are told apart
+bool write_json_report(const std::string& filepath) {
+	std::ofstream fs(filepath, std::ios::trunc);
+	if (!fs)
+		return false;
+	fs << "{\n"
+		<< "\t\"precision\": \"" << (sizeof(number_t) == 4 ? "f32" : "f64") << "\",\n"
+		<< "\t\"simd\": \"" << simd_level_name(detect_simd_level()) << "\",\n"
+		<< "\t\"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+		<< "\t\"results\": [\n";
+	const auto& results = bench_results();
+	for (size_t i = 0; i < results.size(); i++)
+		fs << "\t\t" << results[i].json() << (i + 1 < results.size() ? ",\n" : "\n");
+	fs << "\t]\n}\n";
+	return (bool)fs;
+}
+
+std::string accelerator_name(SceneAccelerator a) {
+	return a == SceneAccelerator::BVH ? "bvh" : "linear";
+}
+
+// Random query points in the region the demo camera looks at
+std::vector<Vec3> query_points(u32 n) {
+	RandomDevice rd(1234);
+	std::vector<Vec3> points(n);
+	for (auto& p : points)
+		p = Vec3{ rd.random_num(-10.f, 10.f), rd.random_num(0.f, 5.f), rd.random_num(-10.f, 10.f) };
+	return points;
+}
+
+void bench_scene_distance(u32 ball_count, SceneAccelerator accel, SimdLevel simd) {
+	set_simd_level(simd);
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.set_accelerator(accel);
+	double build_s = time_seconds([&]() { scene.build(); });
+
+	// Keep the linear reference path from running for minutes on big scenes
+	u32 query_count = (u32)std::max<u64>(1000, min<u64>(200000, 200000000ull / scene.sphere_count()));
+	auto points = query_points(query_count);
+
+	number_t checksum = 0.f;
+	double query_s = time_seconds([&]() {
+		for (auto& p : points)
+			checksum += scene.distance(p);
+	});
+
+	report(BenchResult("scene_distance")
+		.add("accel", accelerator_name(accel))
+		.add("simd", simd_level_name(simd_level()))
+		.add("spheres", scene.sphere_count())
+		.add("build_ms", build_s * 1000.0)
+		.add("queries", query_count)
+		.add("ns_per_query", query_s * 1e9 / query_count)
+		.add("mqueries_per_s", query_count / query_s / 1e6)
+		.add("checksum", checksum));
+}
+
+// Distance queries Scene::ray makes for 'r', the same loop counting steps instead of returning the hit
+u32 march_steps(const Scene& scene, Ray r, u32 max_steps, number_t epsilon) {
+	for (u32 i = 0; i < max_steps; i++) {
+		number_t dist = scene.distance(r.origin());
+		if (dist < robust_epsilon(r.origin(), epsilon))
+			return i + 1;
+		r = r.advance(dist);
+	}
+	return max_steps;
+}
+
+void bench_scene_ray(u32 ball_count, bool analytic) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 ray_count = 20000;
+	const u32 max_steps = 300;
+	const number_t epsilon = 0.000001;
+	RandomDevice rd(4321);
+	std::vector<Ray> rays;
+	rays.reserve(ray_count);
+	for (u32 i = 0; i < ray_count; i++)
+		rays.push_back(cam.get_ray(rd.random_num(0.f, 1024.f), rd.random_num(0.f, 1024.f), 1024.f, 1024.f, 1.f));
+
+	u32 hits = 0;
+	double s = time_seconds([&]() {
+		for (auto& r : rays) {
+			if (analytic)
+				hits += scene.intersect(r, epsilon).has_value();
+			else
+				hits += scene.ray(r, max_steps, epsilon).has_value();
+		}
+	});
+
+	BenchResult result("scene_ray");
+	result
+		.add("mode", analytic ? "analytic" : "march")
+		.add("spheres", scene.sphere_count())
+		.add("rays", ray_count)
+		.add("hits", hits)
+		.add("ns_per_ray", s * 1e9 / ray_count)
+		.add("mrays_per_s", ray_count / s / 1e6);
+	if (!analytic) {
+		u64 steps = 0;
+		for (auto& r : rays)
+			steps += march_steps(scene, r, max_steps, epsilon);
+		result
+			.add("steps_per_ray", (double)steps / ray_count)
+			.add("ns_per_step", s * 1e9 / steps);
+	}
+	report(result);
+}
+
+template<u32 N>
+u32 trace_packets(const Scene& scene, const std::vector<Ray>& rays, bool analytic, u32 max_steps, number_t epsilon) {
+	u32 hits = 0;
+	for (u32 i = 0; i < (u32)rays.size(); i += N) {
+		RayPacket<N> packet;
+		for (u32 l = 0; l < N && i + l < (u32)rays.size(); l++)
+			packet.set(l, rays[i + l]);
+		if (analytic) {
+			Scene::Hit h[N];
+			hits += std::popcount(scene.intersect_packet(packet, epsilon, h));
+		}
+		else {
+			hits += std::popcount(scene.ray_packet(packet, max_steps, epsilon));
+		}
+	}
+	return hits;
+}
+
+// Primary rays of the demo camera, traced one by one or in packets of 2x2/4x2/4x4 pixels
+void bench_packet_trace(u32 ball_count, bool analytic, u32 packet_size) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 256, h = 256;
+	const u32 max_steps = 300;
+	const number_t epsilon = 0.000001;
+	u32 bw = packet_size == 4 ? 2 : 4;
+	u32 bh = packet_size <= 1 ? 1 : packet_size / bw;
+	if (packet_size <= 1)
+		bw = 1;
+	// Order rays block by block so consecutive rays form one packet
+	std::vector<Ray> rays;
+	rays.reserve(w * h);
+	for (u32 by = 0; by < h; by += bh)
+		for (u32 bx = 0; bx < w; bx += bw)
+			for (u32 l = 0; l < bw * bh; l++)
+				rays.push_back(cam.get_ray(bx + l % bw + 0.5f, by + l / bw + 0.5f, (number_t)w, (number_t)h, 1.f));
+
+	u32 hits = 0;
+	double s = time_seconds([&]() {
+		switch (packet_size) {
+		case 4: hits = trace_packets<4>(scene, rays, analytic, max_steps, epsilon); break;
+		case 8: hits = trace_packets<8>(scene, rays, analytic, max_steps, epsilon); break;
+		case 16: hits = trace_packets<16>(scene, rays, analytic, max_steps, epsilon); break;
+		default:
+			for (auto& r : rays) {
+				if (analytic)
+					hits += scene.intersect(r, epsilon).has_value();
+				else
+					hits += scene.ray(r, max_steps, epsilon).has_value();
+			}
+		}
+	});
+
+	report(BenchResult("packet_trace")
+		.add("mode", analytic ? "analytic" : "march")
+		.add("packet", std::max<u32>(packet_size, 1))
+		.add("spheres", scene.sphere_count())
+		.add("hits", hits)
+		.add("mrays_per_s", rays.size() / s / 1e6));
+}
+
+std::string counter_string(const PerfCounters& counters, PerfCounters::Event e) {
+	return counters.available(e) ? std::to_string(counters.value(e)) : std::string("n/a");
+}
+
+// Megakernel against wavefront on the random material scene, with branch miss counts where perf events are allowed
+void bench_engine(u32 ball_count, RenderEngine engine) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 256, h = 256, samples = 4;
+	Image img(w, h);
+	PerfCounters counters;
+	counters.start();
+	double s;
+	{
+		Renderer renderer;
+		renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+		renderer.set_samples(samples);
+		renderer.set_bounces(8);
+		renderer.set_epsilon(0.000001);
+		renderer.set_intersection_mode(IntersectionMode::Analytic);
+		renderer.set_engine(engine);
+		s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+	}
+	counters.stop();
+
+	report(BenchResult("engine")
+		.add("engine", engine == RenderEngine::Wavefront ? "wavefront" : "megakernel")
+		.add("spheres", scene.sphere_count())
+		.add("ms", s * 1000.0)
+		.add("mpaths_per_s", (double)w * h * samples / s / 1e6)
+		.add("branches", counter_string(counters, PerfCounters::Event::Branches))
+		.add("branch_misses", counter_string(counters, PerfCounters::Event::BranchMisses)));
+}
+
+/*
+Render throughput at the precision this binary was built with. Compare the
+output of pathtracer_bench against pathtracer_bench_f32 for the speedup.
+*/
+void bench_precision(u32 ball_count, IntersectionMode mode) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 256, h = 256, samples = 4;
+	Image img(w, h);
+	Renderer renderer;
+	renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+	renderer.set_samples(samples);
+	renderer.set_bounces(8);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(mode);
+	double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+
+	report(BenchResult("precision")
+		.add("precision", sizeof(number_t) == 4 ? "f32" : "f64")
+		.add("intersect", mode == IntersectionMode::Analytic ? "analytic" : "march")
+		.add("spheres", scene.sphere_count())
+		.add("ms", s * 1000.0)
+		.add("mpaths_per_s", (double)w * h * samples / s / 1e6));
+}
+
+// Megakernel paths (raycast_scene) through the demo scene with every ball given one material type
+void bench_raycast_material(u32 ball_count, MaterialType type) {
+	Scene source;
+	generate_scene_1(source, ball_count);
+	source.build();
+	Material m;
+	m.type = type;
+	if (type == MaterialType::Lambertian)
+		m.l = Lambertian{ .reflectance = .5f, .albedo = { .6f, .6f, .6f }, .emissive = { 0.f, 0.f, 0.f } };
+	else if (type == MaterialType::Metallic)
+		m.m = Metallic{ .shininess = .8f, .emissive = { 0.f, 0.f, 0.f } };
+	else
+		m.d = Dielectric{ .refractive_index = 1.3f, .emissive = { 0.f, 0.f, 0.f } };
+
+	// Ground and sky keep their materials so light still reaches the balls
+	const u32 KEEP = 2;
+	Scene scene;
+	for (u32 i = 0; i < source.sphere_count(); i++) {
+		Sphere sphere = source.sphere(i);
+		sphere.material = scene.add_material(i < KEEP ? source.get_material(sphere.material) : m);
+		scene.add_sphere(sphere);
+	}
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 128, h = 128, samples = 4;
+	Image img(w, h);
+	Renderer renderer;
+	renderer.set_thread_count(1);
+	renderer.set_samples(samples);
+	renderer.set_bounces(8);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(IntersectionMode::Analytic);
+	double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+
+	const char* names[] = { "lambertian", "metallic", "dielectric" };
+	report(BenchResult("raycast_material")
+		.add("material", names[(u32)type])
+		.add("spheres", scene.sphere_count())
+		.add("ms", s * 1000.0)
+		.add("ns_per_path", s * 1e9 / ((double)w * h * samples))
+		.add("mpaths_per_s", (double)w * h * samples / s / 1e6));
+}
+
+// Primary ray generation alone
+void bench_camera_ray() {
+	Camera cam;
+	setup_camera_1(cam);
+	const u32 w = 1024, h = 1024;
+	number_t checksum = 0.f;
+	double s = time_seconds([&]() {
+		for (u32 y = 0; y < h; y++)
+			for (u32 x = 0; x < w; x++)
+				checksum += cam.get_ray(x + 0.5f, y + 0.5f, (number_t)w, (number_t)h, 1.f).direction().x;
+	});
+	report(BenchResult("camera_ray")
+		.add("rays", w * h)
+		.add("ns_per_ray", s * 1e9 / ((double)w * h))
+		.add("mrays_per_s", (double)w * h / s / 1e6)
+		.add("checksum", checksum));
+}
+
+// FNV-1a of the 8 bit image, identical renders hash the same so reports show when output changed
+u64 image_hash(const Image& img) {
+	u64 hash = 14695981039346656037ull;
+	std::vector<u8> row((size_t)img.width() * 3);
+	for (u32 y = 0; y < img.height(); y++) {
+		convert_row_rgb8(img, y, row.data());
+		for (u8 b : row)
+			hash = (hash ^ b) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Full render_mt at fixed seeds, the hash pins the output so a diff between commits shows speed and image changes together
+void bench_render(u32 ball_count, u32 seed) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 256, h = 256, samples = 4;
+	Image img(w, h);
+	Renderer renderer;
+	renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+	renderer.set_samples(samples);
+	renderer.set_bounces(8);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(IntersectionMode::Analytic);
+	renderer.set_seed(seed);
+	double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+
+	std::ostringstream hash;
+	hash << std::hex << image_hash(img);
+	report(BenchResult("render")
+		.add("spheres", scene.sphere_count())
+		.add("seed", seed)
+		.add("width", w)
+		.add("height", h)
+		.add("spp", samples)
+		.add("ms", s * 1000.0)
+		.add("mpaths_per_s", (double)w * h * samples / s / 1e6)
+		.add("image_hash", hash.str()));
+}
+
+/*
+Next event estimation against bounce only light transport: error of both
+against a 1024 spp reference (with its own seed) at increasing sample
+counts. Noise falls with the square root of the samples, so the time to
+reach the bounce only error at 64 spp is extrapolated from each mode's own
+error. The reference's noise is in every error, which understates the gain.
+*/
+void bench_light_sampling(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 64, h = 64;
+	auto render = [&](bool light_sampling, u32 samples, u32 seed, Image& img) {
+		Renderer renderer;
+		renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+		renderer.set_samples(samples);
+		renderer.set_bounces(4);
+		renderer.set_epsilon(0.000001);
+		renderer.set_intersection_mode(IntersectionMode::Analytic);
+		renderer.set_light_sampling(light_sampling);
+		renderer.set_seed(seed);
+		return time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+	};
+	Image reference(w, h);
+	render(true, 1024, 1, reference);
+
+	struct Run {
+		bool light_sampling;
+		u32 samples;
+		double ms;
+		number_t rmse;
+	};
+	std::vector<Run> runs;
+	for (bool light_sampling : { false, true }) {
+		for (u32 samples : { 4u, 16u, 64u }) {
+			Image img(w, h);
+			double s = render(light_sampling, samples, 0, img);
+			runs.push_back(Run{ light_sampling, samples, s * 1000.0, image_diff(img, reference).rmse });
+		}
+	}
+	// Bounce only at 64 spp
+	number_t target = runs[2].rmse;
+	double equal_noise_ms[2] = {};
+	for (const Run& r : runs) {
+		double ms_at_target = r.ms * (r.rmse / target) * (r.rmse / target);
+		report(BenchResult("light_sampling")
+			.add("balls", ball_count)
+			.add("mode", r.light_sampling ? "nee_mis" : "bounce_only")
+			.add("spp", r.samples)
+			.add("ms", r.ms)
+			.add("rmse", r.rmse)
+			.add("ms_at_equal_noise", ms_at_target));
+		if (r.samples == 64)
+			equal_noise_ms[r.light_sampling] = ms_at_target;
+	}
+	report(BenchResult("light_sampling_speedup")
+		.add("balls", ball_count)
+		.add("noise", target)
+		.add("speedup", equal_noise_ms[0] / equal_noise_ms[1]));
+}
+
+/*
+Russian roulette and the contribution early out against following every
+path to the bounce limit, sphere tracing at 26 bounces like pathtracer.
+Noise is the accumulation buffer's own RMS relative error, it falls with
+the square root of the samples, so the time every mode needs to match the
+noise of the full paths is extrapolated from it. The mean luminance shows
+that stopping paths early does not change the image. Builds with
+PATHTRACER_STATS also report how many surfaces the paths hit.
+*/
+void bench_roulette(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	const u32 w = 64, h = 64, samples = 16;
+	struct Mode {
+		const char* name;
+		u32 roulette_depth;
+		number_t min_contribution;
+	};
+	double target = 0.0, full_ms = 0.0;
+	for (Mode mode : { Mode{ "full", 0, 0.f }, Mode{ "early_out", 0, 1e-6f }, Mode{ "roulette", 3, 0.f }, Mode{ "both", 3, 1e-6f } }) {
+		Renderer renderer;
+		renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+		renderer.set_samples(samples);
+		renderer.set_bounces(26);
+		renderer.set_roulette_depth(mode.roulette_depth);
+		renderer.set_min_contribution(mode.min_contribution);
+		Image img(w, h);
+		double ms = time_seconds([&]() { renderer.render_mt(scene, cam, img); }) * 1000.0;
+
+		const AccumulationBuffer& acc = renderer.get_accumulation();
+		double noise = acc.rms_relative_error(), mean = 0.0;
+		for (u32 y = 0; y < h; y++)
+			for (u32 x = 0; x < w; x++)
+				mean += luminance(acc.get(x, y).mean());
+		mean /= (double)w * h;
+		if (target == 0.0) {
+			target = noise;
+			full_ms = ms;
+		}
+		double ms_at_target = ms * (noise / target) * (noise / target);
+		report(BenchResult("roulette")
+			.add("balls", ball_count)
+			.add("mode", mode.name)
+			.add("spp", samples)
+			.add("ms", ms)
+			.add("noise", noise)
+			.add("mean", mean)
+			.add("ms_at_equal_noise", ms_at_target)
+			.add("speedup", full_ms / ms_at_target));
+#if defined(PATHTRACER_STATS)
+		const RenderStats& stats = renderer.get_render_stats();
+		std::string histogram;
+		for (u32 i = 0; i < RenderStats::DEPTH_BUCKETS; i++)
+			if (stats.path_depth[i])
+				histogram += (histogram.empty() ? "" : ",") + std::to_string(i) + ":" + std::to_string(stats.path_depth[i]);
+		report(BenchResult("roulette_depths")
+			.add("mode", mode.name)
+			.add("rays_per_sample", (double)stats.rays / stats.samples)
+			.add("histogram", histogram));
+#endif
+	}
+}
+
+// encode_ppm plus the file write, the path render output takes by default
+void bench_write_ppm(u32 w, u32 h) {
+	Image img(w, h);
+	for (u32 y = 0; y < h; y++)
+		for (u32 x = 0; x < w; x++)
+			img.get(x, y) = Vec3{ (number_t)x / w, (number_t)y / h, .5f };
+	const std::string path = "bench_write.ppm";
+	const u32 runs = 3;
+	double s = time_seconds([&]() {
+		for (u32 i = 0; i < runs; i++)
+			write_ppm(path, img);
+	}) / runs;
+	std::remove(path.c_str());
+	report(BenchResult("write_ppm")
+		.add("width", w)
+		.add("height", h)
+		.add("ms", s * 1000.0)
+		.add("mpix_per_s", (double)w * h / s / 1e6));
+}
+
+// The resampling Image constructor, down and up by a factor of two
+void bench_resample(u32 w, u32 h) {
+	Image src(w, h);
+	for (u32 y = 0; y < h; y++)
+		for (u32 x = 0; x < w; x++)
+			src.get(x, y) = Vec3{ (number_t)x / w, (number_t)y / h, (number_t)((x ^ y) & 255) / 255.f };
+	for (auto [dw, dh] : { std::pair{ w / 2, h / 2 }, std::pair{ w * 2, h * 2 } }) {
+		double s = time_seconds([&]() { Image dst(dw, dh, src); });
+		report(BenchResult("resample")
+			.add("src_width", w)
+			.add("src_height", h)
+			.add("dst_width", dw)
+			.add("dst_height", dh)
+			.add("ms", s * 1000.0)
+			.add("mpix_per_s", (double)dw * dh / s / 1e6));
+	}
+}
+
+/*
+Churn of short lived TaskGroups: one index groups waited on and destroyed
+right away from outside the pool, and from inside tasks with wait_helping
+the way tail splitting does. Every group is gone the moment it reports
+done, so this is the case to run under -fsanitize=thread. 'ok' checks
+that every index ran exactly once.
+*/
+void bench_task_groups(u32 rounds) {
+	// More workers than cores so finishing and waiting threads interleave
+	u32 threads = std::max<u32>(std::thread::hardware_concurrency(), 4);
+	TaskScheduler tp(threads);
+	std::atomic<u64> ran = 0;
+	double outside_s = time_seconds([&]() {
+		for (u32 i = 0; i < rounds; i++) {
+			TaskGroup group;
+			tp.parallel_for(group, 1, [&](u32) { ran++; });
+			group.wait();
+		}
+	});
+	const u32 NESTED = 16;
+	double nested_s = time_seconds([&]() {
+		tp.parallel_for(rounds / NESTED, [&](u32) {
+			for (u32 k = 0; k < NESTED; k++) {
+				TaskGroup group;
+				tp.parallel_for(group, 1, [&](u32) { ran++; });
+				tp.wait_helping(group);
+			}
+		});
+	});
+	u64 expected = rounds + (u64)rounds / NESTED * NESTED;
+	report(BenchResult("task_groups")
+		.add("threads", threads)
+		.add("groups", expected)
+		.add("outside_us_per_group", outside_s * 1e6 / rounds)
+		.add("nested_us_per_group", nested_s * 1e6 / (rounds / NESTED * NESTED))
+		.add("ok", ran.load() == expected ? "yes" : "no"));
+}
+
+const char* resample_filter_name(ResampleFilter f) {
+	switch (f) {
+	case ResampleFilter::Box: return "box";
+	case ResampleFilter::Tent: return "tent";
+	default: return "lanczos3";
+	}
+}
+
+/*
+Resampling engine throughput: half size (supersampled finals) and a 1/8
+thumbnail per filter on one thread and on the pool, next to the old
+constructor. The checksum is the center pixel, identical across thread
+counts.
+*/
+void bench_resample_engine(u32 w, u32 h) {
+	Image src(w, h);
+	for (u32 y = 0; y < h; y++)
+		for (u32 x = 0; x < w; x++)
+			src.get(x, y) = Vec3{ (number_t)x / w, (number_t)y / h, (number_t)((x ^ y) & 255) / 255.f };
+	u32 hardware_threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+	TaskScheduler tp(hardware_threads);
+	for (auto [dw, dh] : { std::pair{ w / 2, h / 2 }, std::pair{ w / 8, h / 8 } }) {
+		double legacy_s = time_seconds([&]() { Image dst(dw, dh, src); });
+		report(BenchResult("resample_engine")
+			.add("src_width", w)
+			.add("dst_width", dw)
+			.add("dst_height", dh)
+			.add("filter", "constructor")
+			.add("threads", 1)
+			.add("ms", legacy_s * 1000.0)
+			.add("src_mpix_per_s", (double)w * h / legacy_s / 1e6));
+		for (ResampleFilter filter : { ResampleFilter::Box, ResampleFilter::Tent, ResampleFilter::Lanczos3 }) {
+			for (u32 threads : { 1u, hardware_threads }) {
+				number_t checksum = 0.f;
+				double s = time_seconds([&]() {
+					Image dst = resample(src, dw, dh, filter, threads > 1 ? &tp : nullptr);
+					checksum = dst.get(dw / 2, dh / 2).z;
+				});
+				report(BenchResult("resample_engine")
+					.add("src_width", w)
+					.add("dst_width", dw)
+					.add("dst_height", dh)
+					.add("filter", resample_filter_name(filter))
+					.add("threads", threads)
+					.add("ms", s * 1000.0)
+					.add("src_mpix_per_s", (double)w * h / s / 1e6)
+					.add("checksum", checksum));
+				if (hardware_threads == 1)
+					break;
+			}
+		}
+	}
+}
+
+/*
+Full mip chain in one tiled pass over the base against halving it level by
+level with the box resampler.
+*/
+void bench_mip_pyramid(u32 w, u32 h) {
+	Image src(w, h);
+	for (u32 y = 0; y < h; y++)
+		for (u32 x = 0; x < w; x++)
+			src.get(x, y) = Vec3{ (number_t)x / w, (number_t)y / h, (number_t)((x ^ y) & 255) / 255.f };
+	u32 hardware_threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+	TaskScheduler tp(hardware_threads);
+	u32 levels = 0;
+	double chained_s = time_seconds([&]() {
+		const Image* level = &src;
+		std::vector<Image> chain;
+		chain.reserve(32);
+		while (level->width() > 1 || level->height() > 1) {
+			chain.push_back(resample(*level, std::max<u32>(level->width() / 2, 1), std::max<u32>(level->height() / 2, 1), ResampleFilter::Box, &tp));
+			level = &chain.back();
+		}
+	});
+	for (u32 threads : { 1u, hardware_threads }) {
+		Vec3 top{};
+		double s = time_seconds([&]() {
+			std::vector<Image> chain = build_mip_pyramid(src, threads > 1 ? &tp : nullptr);
+			levels = (u32)chain.size();
+			top = chain.back().get(0, 0);
+		});
+		report(BenchResult("mip_pyramid")
+			.add("width", w)
+			.add("height", h)
+			.add("levels", levels)
+			.add("threads", threads)
+			.add("ms", s * 1000.0)
+			.add("chained_ms", chained_s * 1000.0)
+			.add("src_mpix_per_s", (double)w * h / s / 1e6)
+			.add("top_x", top.x));
+		if (hardware_threads == 1)
+			break;
+	}
+}
+
+/*
+One framebuffer format and layout: bytes per megapixel, write bandwidth of
+workers filling 64x64 tiles the way commit_tile does, the conversion to a
+linear image for the encoders and a small render_mt into it.
+*/
+template<typename ImageT>
+void bench_framebuffer(const char* format, const char* layout) {
+	const u32 w = 4096, h = 4096, passes = 4;
+	u32 threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+	TaskScheduler tp(threads);
+	ImageT img(w, h);
+	double write_s = time_seconds([&]() {
+		for (u32 pass = 0; pass < passes; pass++)
+			tp.parallel_for_2d(w, h, 64, 64, [&](TileRange ti) {
+				for (u32 k = 0; k < ti.h; k++)
+					for (u32 i = 0; i < ti.w; i++)
+						img.set(ti.x + i, ti.y + k, Vec3{ (number_t)i / 64, (number_t)k / 64, (number_t)pass / passes });
+			});
+	});
+	number_t checksum = 0.f;
+	double convert_s = time_seconds([&]() {
+		Image linear = to_image(img, &tp);
+		checksum = linear.get(w / 2 + 1, h / 2 + 1).x;
+	});
+
+	Scene scene;
+	generate_scene_1(scene, 1000);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+	Renderer renderer;
+	renderer.set_thread_count(threads);
+	renderer.set_samples(4);
+	renderer.set_bounces(4);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(IntersectionMode::Analytic);
+	ImageT target(256, 256);
+	double render_s = time_seconds([&]() { renderer.render_mt(scene, cam, target); });
+
+	report(BenchResult("framebuffer")
+		.add("format", format)
+		.add("layout", layout)
+		.add("mb_per_mp", img.storage_bytes() / (1024.0 * 1024.0) / ((double)w * h / 1e6))
+		.add("write_gb_per_s", (double)img.storage_bytes() * passes / write_s / 1e9)
+		.add("mpixels_per_s", (double)w * h * passes / write_s / 1e6)
+		.add("to_linear_ms", convert_s * 1000.0)
+		.add("render_ms", render_s * 1000.0)
+		.add("checksum", checksum));
+}
+
+/*
+A render held in memory and written afterwards against the same render
+streamed strip by strip into the file. Peak RSS is measured above what the
+process held before each run, where the peak can not be reset it only
+bounds the first run.
+*/
+void bench_streamed_output(u32 w, u32 h) {
+	Scene scene;
+	generate_scene_1(scene, 1000);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	for (bool stream : { false, true }) {
+		Renderer renderer;
+		renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+		renderer.set_samples(1);
+		renderer.set_bounces(2);
+		renderer.set_epsilon(0.000001);
+		renderer.set_intersection_mode(IntersectionMode::Analytic);
+		const std::string path = "bench_stream.ppm";
+		reset_peak_rss();
+		u64 baseline = peak_rss_bytes();
+		bool ok = true;
+		double s = time_seconds([&]() {
+			if (stream) {
+				auto writer = StripWriter::open(path, w, h);
+				ok = writer && renderer.render_streamed(scene, cam, w, h, [&](u32, u32 rows, const u8* rgb) { return writer->write_strip(rgb, rows); })
+					&& writer->close();
+			}
+			else {
+				Image img(w, h);
+				renderer.render_mt(scene, cam, img);
+				ok = write_image(path, img, &renderer.scheduler());
+			}
+		});
+		u64 peak = peak_rss_bytes();
+		std::remove(path.c_str());
+		report(BenchResult("streamed_output")
+			.add("mode", stream ? "streamed" : "in_memory")
+			.add("width", w)
+			.add("height", h)
+			.add("ms", s * 1000.0)
+			.add("mp_per_s", (double)w * h / s / 1e6)
+			.add("peak_rss_mb", (peak - std::min(peak, baseline)) / (1024.0 * 1024.0))
+			.add("ok", ok ? "yes" : "no"));
+	}
+}
+
+/*
+Time to the first full frame pass of a progressive render against one
+render_mt at the final sample count, and what the passes cost in total.
+*/
+void bench_progressive(u32 ball_count, u32 samples) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	auto make_renderer = [&]() {
+		auto r = std::make_unique<Renderer>();
+		r->set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+		r->set_samples(samples);
+		r->set_bounces(4);
+		r->set_epsilon(0.000001);
+		r->set_intersection_mode(IntersectionMode::Analytic);
+		return r;
+	};
+	Image img(256, 256);
+	auto single = make_renderer();
+	double single_s = time_seconds([&]() { single->render_mt(scene, cam, img); });
+	u64 single_hash = image_hash(img);
+
+	auto progressive = make_renderer();
+	double first_pass_s = 0.0;
+	auto start = std::chrono::steady_clock::now();
+	double total_s = time_seconds([&]() {
+		progressive->render_progressive(scene, cam, img, [&](u32 spp, number_t) {
+			if (spp == 1)
+				first_pass_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		});
+	});
+	report(BenchResult("progressive")
+		.add("spp", samples)
+		.add("single_ms", single_s * 1000.0)
+		.add("first_pass_ms", first_pass_s * 1000.0)
+		.add("progressive_ms", total_s * 1000.0)
+		.add("overhead_pct", (total_s / single_s - 1.0) * 100.0)
+		.add("identical", image_hash(img) == single_hash ? "yes" : "no"));
+}
+
+/*
+Small interactive sized frames: how long render_mt takes to return after
+its last tile finished, measured from the progress callback.
+*/
+void bench_render_latency(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	Renderer renderer;
+	renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+	renderer.set_samples(1);
+	renderer.set_bounces(4);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(IntersectionMode::Analytic);
+	std::chrono::steady_clock::time_point last_tile;
+	u32 events = 0;
+	renderer.set_progress_callback([&](const RenderProgress& p) {
+		events++;
+		if (p.tiles_done == p.tiles_total)
+			last_tile = std::chrono::steady_clock::now();
+	});
+	const u32 frames = 20;
+	Image img(128, 128);
+	double total_s = 0.0, return_us = 0.0;
+	for (u32 i = 0; i < frames; i++) {
+		total_s += time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+		return_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - last_tile).count();
+	}
+	report(BenchResult("render_latency")
+		.add("width", img.width())
+		.add("height", img.height())
+		.add("frames", frames)
+		.add("ms_per_frame", total_s * 1000.0 / frames)
+		.add("tile_events", events)
+		.add("return_after_last_tile_us", return_us / frames));
+}
+
+/*
+Renders the same frame twice per tile order, the second frame with the cost
+order already has the first frame's timings. The idle share is the worker
+time spent without a tile, mostly at the end of the frame.
+*/
+void bench_tile_order(u32 ball_count, TileOrder order, bool split_tail) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	Renderer renderer;
+	renderer.set_thread_count(std::max<u32>(std::thread::hardware_concurrency(), 1));
+	renderer.set_samples(4);
+	renderer.set_bounces(4);
+	renderer.set_epsilon(0.000001);
+	renderer.set_intersection_mode(IntersectionMode::Analytic);
+	renderer.set_tile_order(order);
+	renderer.set_split_tail(split_tail);
+	const char* names[] = { "rows", "cost", "hilbert", "spiral" };
+	Image img(512, 512);
+	for (u32 frame = 0; frame < 2; frame++) {
+		double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+		report(BenchResult("tile_order")
+			.add("order", names[(u32)order])
+			.add("tail_split", split_tail ? "yes" : "no")
+			.add("frame", frame)
+			.add("ms", s * 1000.0)
+			.add("idle_pct", renderer.get_idle_fraction() * 100.0));
+	}
+}
+
+// Renders the same frame with 1..N workers and reports parallel efficiency
+void bench_render_scaling(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	std::vector<u32> thread_counts;
+	u32 max_threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+	for (u32 n = 1; n < max_threads; n *= 2)
+		thread_counts.push_back(n);
+	thread_counts.push_back(max_threads);
+
+	double single_thread_s = 0.0;
+	for (u32 n : thread_counts) {
+		Renderer renderer;
+		renderer.set_thread_count(n);
+		renderer.set_samples(4);
+		renderer.set_bounces(4);
+		renderer.set_epsilon(0.000001);
+		renderer.set_intersection_mode(IntersectionMode::Analytic);
+		Image img(256, 256);
+		double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+		if (n == 1)
+			single_thread_s = s;
+		double speedup = single_thread_s / s;
+		report(BenchResult("render_scaling")
+			.add("threads", n)
+			.add("ms", s * 1000.0)
+			.add("speedup", speedup)
+			.add("efficiency", speedup / n));
+	}
+}
+
+// Fixed sample count against adaptive sampling with the same maximum, reports samples spent and time
+void bench_adaptive(u32 ball_count, number_t noise_threshold) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	Camera cam;
+	setup_camera_1(cam);
+
+	for (bool adaptive : { false, true }) {
+		Renderer renderer;
+		renderer.set_samples(adaptive ? 4 : 64);
+		renderer.set_max_samples(adaptive ? 64 : 0);
+		renderer.set_noise_threshold(noise_threshold);
+		renderer.set_bounces(4);
+		renderer.set_epsilon(0.000001);
+		renderer.set_intersection_mode(IntersectionMode::Analytic);
+		Image img(128, 128);
+		double s = time_seconds([&]() { renderer.render_mt(scene, cam, img); });
+		report(BenchResult("adaptive")
+			.add("balls", ball_count)
+			.add("mode", adaptive ? "adaptive" : "fixed")
+			.add("noise", noise_threshold)
+			.add("spp", renderer.get_average_samples())
+			.add("ms", s * 1000.0));
+	}
+}
+
+// Encode throughput of every output format, pixels are a smooth gradient so no format gets trivial input
+void bench_image_encode(u32 w, u32 h, ImageFormat format, u32 thread_count) {
+	Image img(w, h);
+	for (u32 y = 0; y < h; y++)
+		for (u32 x = 0; x < w; x++)
+			img.get(x, y) = Vec3{ (number_t)x / w, (number_t)y / h, (number_t)((x ^ y) & 255) / 255.f };
+
+	TaskScheduler scheduler(thread_count);
+	size_t bytes = 0;
+	const u32 runs = 3;
+	double s = time_seconds([&]() {
+		for (u32 i = 0; i < runs; i++)
+			bytes = encode_image(format, img, &scheduler).size();
+	}) / runs;
+	report(BenchResult("image_encode")
+		.add("format", image_format_name(format))
+		.add("width", w)
+		.add("height", h)
+		.add("threads", thread_count)
+		.add("ms", s * 1000.0)
+		.add("mpix_per_s", (double)w * h / s / 1e6)
+		.add("mb_per_s", (double)bytes / s / 1e6));
+}
+
+// Time to write a checkpoint of a w x h accumulation buffer, the render stalls for the snapshot part of it
+void bench_checkpoint(u32 w, u32 h) {
+	AccumulationBuffer buffer;
+	buffer.reset(w, h);
+	const std::string path = "bench_checkpoint.bin";
+	const u32 runs = 3;
+	double s = time_seconds([&]() {
+		for (u32 i = 0; i < runs; i++)
+			save_checkpoint(path, buffer, 0);
+	}) / runs;
+	std::vector<u8> snapshot(buffer.size_bytes());
+	double snapshot_s = time_seconds([&]() { buffer.snapshot(snapshot.data()); });
+	std::remove(path.c_str());
+	report(BenchResult("checkpoint")
+		.add("width", w)
+		.add("height", h)
+		.add("mb", (double)buffer.size_bytes() / 1e6)
+		.add("ms", s * 1000.0)
+		.add("locked_ms", snapshot_s * 1000.0));
+}
+
+/*
+Memory taken by the scene arrays, against the old layout that embedded a
+whole Material in every sphere record, and the cost of looking up a hit's
+position and material in both layouts at random sphere indices.
+*/
+void bench_scene_footprint(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	SceneData d = scene.data();
+
+	struct EmbeddedSphere {
+		Vec3 pos;
+		number_t radius;
+		Material material;
+	};
+	std::vector<EmbeddedSphere> embedded(d.sphere_count);
+	for (u32 i = 0; i < d.sphere_count; i++)
+		embedded[i] = EmbeddedSphere{ Vec3{ d.x[i], d.y[i], d.z[i] }, d.r[i], d.materials[d.material_index[i]] };
+
+	size_t geometry_bytes = ((size_t)d.sphere_count + SphereSoA::PADDING) * 4 * sizeof(number_t);
+	size_t table_bytes = (size_t)d.sphere_count * sizeof(u32) + (size_t)d.material_count * sizeof(Material);
+	size_t record_bytes = (size_t)scene.sphere_count() * sizeof(Sphere);
+	size_t embedded_bytes = embedded.size() * sizeof(EmbeddedSphere);
+
+	RandomDevice rd(99);
+	const u32 lookups = 4000000;
+	std::vector<u32> indices(lookups);
+	for (auto& i : indices)
+		i = min<u32>((u32)(rd.random_num() * d.sphere_count), d.sphere_count - 1);
+
+	number_t checksum = 0.f;
+	auto measure = [&](auto&& fetch, u64& misses, bool& counted) {
+		PerfCounters counters;
+		counters.start();
+		double s = time_seconds([&]() {
+			for (u32 i : indices)
+				checksum += fetch(i);
+		});
+		counters.stop();
+		misses = counters.value(PerfCounters::Event::CacheMisses);
+		counted = counters.available(PerfCounters::Event::CacheMisses);
+		return s;
+	};
+	u64 embedded_misses, table_misses;
+	bool counted;
+	double embedded_s = measure([&](u32 i) {
+		const EmbeddedSphere& e = embedded[i];
+		return e.pos.x + (e.material.type == MaterialType::Lambertian ? e.material.l.reflectance : (number_t)1.f);
+	}, embedded_misses, counted);
+	double table_s = measure([&](u32 i) {
+		const Material& m = d.materials[d.material_index[i]];
+		return d.x[i] + (m.type == MaterialType::Lambertian ? m.l.reflectance : (number_t)1.f);
+	}, table_misses, counted);
+
+	report(BenchResult("scene_footprint")
+		.add("spheres", d.sphere_count)
+		.add("materials", d.material_count)
+		.add("sphere_bytes", sizeof(Sphere))
+		.add("embedded_sphere_bytes", sizeof(EmbeddedSphere))
+		.add("records_mb", record_bytes / 1e6)
+		.add("geometry_mb", geometry_bytes / 1e6)
+		.add("material_table_mb", table_bytes / 1e6)
+		.add("embedded_mb", embedded_bytes / 1e6)
+		.add("embedded_ns_per_hit", embedded_s * 1e9 / lookups)
+		.add("table_ns_per_hit", table_s * 1e9 / lookups)
+		.add("embedded_cache_misses", counted ? std::to_string(embedded_misses) : "n/a")
+		.add("table_cache_misses", counted ? std::to_string(table_misses) : "n/a")
+		.add("checksum", checksum));
+}
+
+// Load time of the text and mapped binary scene files, per million spheres so sizes compare
+void bench_scene_load(u32 ball_count) {
+	Scene scene;
+	generate_scene_1(scene, ball_count);
+	scene.build();
+	for (const std::string path : { "bench_scene.scene", "bench_scene.sceneb" }) {
+		save_scene(path, scene);
+		Scene loaded;
+		double s = time_seconds([&]() {
+			load_scene(path, loaded);
+			loaded.build();
+		});
+		std::remove(path.c_str());
+		report(BenchResult("scene_load")
+			.add("format", scene_format_from_path(path) == SceneFormat::Text ? "text" : "binary")
+			.add("spheres", loaded.sphere_count())
+			.add("ms", s * 1000.0)
+			.add("ms_per_million", s * 1000.0 / (loaded.sphere_count() / 1e6)));
+	}
+}
+
+/*
+Scalar Vec3 functions against their Vec3N<SIMD_WIDTH> versions on the same
+inputs. The wide results are checked to be bit identical to the scalar ones.
+*/
+template<typename Scalar, typename Wide>
+void bench_vector_op(const char* name, Scalar&& scalar, Wide&& wide) {
+	constexpr u32 W = SIMD_WIDTH;
+	const u32 n = 1 << 14, repeats = 200;
+	RandomDevice rd(99);
+	std::vector<Vec3> a(n), b(n), out(n);
+	for (u32 i = 0; i < n; i++) {
+		a[i] = Vec3{ rd.random_num(-1.f, 1.f), rd.random_num(-1.f, 1.f), rd.random_num(-1.f, 1.f) };
+		b[i] = Vec3{ rd.random_num(-1.f, 1.f), rd.random_num(-1.f, 1.f), rd.random_num(-1.f, 1.f) }.normalize();
+	}
+	using Array = std::vector<number_t, AlignedAllocator<number_t>>;
+	Array ax(n), ay(n), az(n), bx(n), by(n), bz(n), ox(n), oy(n), oz(n);
+	for (u32 i = 0; i < n; i++) {
+		ax[i] = a[i].x; ay[i] = a[i].y; az[i] = a[i].z;
+		bx[i] = b[i].x; by[i] = b[i].y; bz[i] = b[i].z;
+	}
+
+	double scalar_s = time_seconds([&]() {
+		for (u32 r = 0; r < repeats; r++)
+			for (u32 i = 0; i < n; i++)
+				out[i] = scalar(a[i], b[i]);
+	});
+	double wide_s = time_seconds([&]() {
+		for (u32 r = 0; r < repeats; r++) {
+			for (u32 i = 0; i < n; i += W) {
+				Vec3N<W> va = Vec3N<W>::load(&ax[i], &ay[i], &az[i]);
+				Vec3N<W> vb = Vec3N<W>::load(&bx[i], &by[i], &bz[i]);
+				wide(va, vb).store(&ox[i], &oy[i], &oz[i]);
+			}
+		}
+	});
+	bool identical = true;
+	for (u32 i = 0; i < n; i++)
+		identical &= memcmp(&out[i].x, &ox[i], sizeof(number_t)) == 0 && memcmp(&out[i].y, &oy[i], sizeof(number_t)) == 0 &&
+			memcmp(&out[i].z, &oz[i], sizeof(number_t)) == 0;
+
+	double ops = (double)n * repeats;
+	report(BenchResult("vector_op")
+		.add("op", name)
+		.add("width", W)
+		.add("scalar_ns", scalar_s / ops * 1e9)
+		.add("wide_ns", wide_s / ops * 1e9)
+		.add("speedup", scalar_s / wide_s)
+		.add("identical", identical ? "yes" : "no"));
+}
+
+void bench_vector_ops() {
+	using V = Vec3N<SIMD_WIDTH>;
+	// Ops returning a scalar write it to x
+	auto zero = VecN<SIMD_WIDTH>::broadcast(0.f);
+	bench_vector_op("dot",
+		[](Vec3 a, Vec3 b) { return Vec3{ dot(a, b), 0.f, 0.f }; },
+		[&](const V& a, const V& b) { return V{ dot(a, b), zero, zero }; });
+	bench_vector_op("distance",
+		[](Vec3 a, Vec3 b) { return Vec3{ distance(a, b), 0.f, 0.f }; },
+		[&](const V& a, const V& b) { return V{ distance(a, b), zero, zero }; });
+	bench_vector_op("normalize",
+		[](Vec3 a, Vec3) { return a.normalize(); },
+		[](const V& a, const V&) { return a.normalize(); });
+	bench_vector_op("reflect",
+		[](Vec3 a, Vec3 b) { return reflect(a, b); },
+		[](const V& a, const V& b) { return reflect(a, b); });
+	bench_vector_op("refract",
+		[](Vec3 a, Vec3 b) { return refract(a, b, 0.75f); },
+		[](const V& a, const V& b) { return refract(a, b, 0.75f); });
+	bench_vector_op("rotate_y",
+		[](Vec3 a, Vec3) { return rotate_y(a, 0.3f); },
+		[](const V& a, const V&) { return rotate_y(a, 0.3f); });
+}
+
+// Throughput of the C library rand() against per thread samplers with n threads drawing at once
+void bench_rng(u32 thread_count) {
+	const u32 draws_per_thread = 4000000;
+	for (bool use_sampler : { false, true }) {
+		std::vector<std::thread> threads;
+		std::vector<number_t> sums(thread_count, 0.f);
+		double s = time_seconds([&]() {
+			for (u32 t = 0; t < thread_count; t++) {
+				threads.push_back(std::thread([&, t]() {
+					number_t sum = 0.f;
+					if (use_sampler) {
+						Sampler sampler = Sampler::for_pixel(t, 0, 0);
+						for (u32 i = 0; i < draws_per_thread; i++)
+							sum += sampler.next();
+					}
+					else {
+						for (u32 i = 0; i < draws_per_thread; i++)
+							sum += (number_t)rand() / (number_t)RAND_MAX;
+					}
+					sums[t] = sum;
+				}));
+			}
+			for (auto& t : threads)
+				t.join();
+		});
+		report(BenchResult("rng")
+			.add("generator", use_sampler ? "pcg32" : "rand")
+			.add("threads", thread_count)
+			.add("mdraws_per_s", (double)draws_per_thread * thread_count / s / 1e6));
+	}
+}
+
+struct BenchCase {
+	const char* name;
+	std::function<void()> run;
+	// Too big to run by default, only selected by a filter naming it exactly
+	bool opt_in = false;
+};
+
+int main(int argc, const char* argv[]) {
+	std::string json_path;
+	std::vector<std::string> filters;
+	bool list = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg.substr(0, 7) == "--json=")
+			json_path = arg.substr(7);
+		else if (arg.substr(0, 9) == "--filter=") {
+			std::stringstream ss(arg.substr(9));
+			for (std::string f; std::getline(ss, f, ',');)
+				filters.push_back(f);
+		}
+		else if (arg == "--list")
+			list = true;
+		else {
+			std::cout << "--json=FILE [also write the results as JSON to FILE]" << std::endl;
+			std::cout << "--filter=A,B [only run cases whose name contains A or B]" << std::endl;
+			std::cout << "--list [print the case names]" << std::endl;
+			return arg == "-h" ? 0 : -1;
+		}
+	}
+
+	u32 hardware_threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+	std::vector<BenchCase> cases = {
+		{ "scene_distance", [] {
+			// Every kernel up to the widest one the cpu supports
+			for (u32 balls : { 10u, 1000u, 10000u, 100000u, 1000000u }) {
+				for (u32 l = 0; l <= (u32)detect_simd_level(); l++) {
+					bench_scene_distance(balls, SceneAccelerator::Linear, (SimdLevel)l);
+					bench_scene_distance(balls, SceneAccelerator::BVH, (SimdLevel)l);
+				}
+			}
+			set_simd_level(detect_simd_level());
+		} },
+		{ "scene_ray", [] {
+			for (u32 balls : { 10u, 1000u, 100000u }) {
+				bench_scene_ray(balls, false);
+				bench_scene_ray(balls, true);
+			}
+		} },
+		{ "camera_ray", [] { bench_camera_ray(); } },
+		{ "raycast_material", [] {
+			for (MaterialType type : { MaterialType::Lambertian, MaterialType::Metallic, MaterialType::Dielectric })
+				bench_raycast_material(1000, type);
+		} },
+		{ "vector_op", [] { bench_vector_ops(); } },
+		{ "rng", [=] {
+			bench_rng(1);
+			if (hardware_threads > 1)
+				bench_rng(hardware_threads);
+		} },
+		{ "packet_trace", [] {
+			for (u32 balls : { 4u, 1000u, 100000u }) {
+				for (bool analytic : { false, true }) {
+					for (u32 n : { 1u, 4u, 8u, 16u })
+						bench_packet_trace(balls, analytic, n);
+				}
+			}
+		} },
+		{ "engine", [] {
+			for (u32 balls : { 1000u, 100000u }) {
+				bench_engine(balls, RenderEngine::Megakernel);
+				bench_engine(balls, RenderEngine::Wavefront);
+			}
+		} },
+		{ "precision", [] {
+			// Marching is too slow for the large scene at this resolution
+			bench_precision(1000, IntersectionMode::SphereTracing);
+			for (u32 balls : { 1000u, 100000u })
+				bench_precision(balls, IntersectionMode::Analytic);
+		} },
+		{ "render", [] {
+			for (u32 seed : { 1u, 2u })
+				bench_render(1000, seed);
+		} },
+		{ "render_scaling", [] { bench_render_scaling(1000); } },
+		{ "render_latency", [] { bench_render_latency(1000); } },
+		{ "task_groups", [] { bench_task_groups(100000); } },
+		{ "progressive", [] { bench_progressive(1000, 16); } },
+		{ "framebuffer", [] {
+			bench_framebuffer<Image>("vec3", "linear");
+			bench_framebuffer<ImageRGB32F>("rgb32f", "linear");
+			bench_framebuffer<ImageRGBA16F>("rgba16f", "linear");
+			bench_framebuffer<ImageRGBA8>("rgba8", "linear");
+			bench_framebuffer<BasicImage<PixelVec3, ImageLayout::Tiled>>("vec3", "tiled");
+			bench_framebuffer<BasicImage<PixelRGBA16F, ImageLayout::Tiled>>("rgba16f", "tiled");
+			bench_framebuffer<BasicImage<PixelRGBA8, ImageLayout::Tiled>>("rgba8", "tiled");
+		} },
+		{ "streamed_output", [] { bench_streamed_output(2048, 2048); } },
+		{ "tile_order", [] {
+			for (TileOrder order : { TileOrder::RowMajor, TileOrder::Cost, TileOrder::Hilbert, TileOrder::Spiral })
+				bench_tile_order(1000, order, true);
+			bench_tile_order(1000, TileOrder::RowMajor, false);
+		} },
+		{ "adaptive", [] { bench_adaptive(1000, 0.05f); } },
+		{ "light_sampling", [] { bench_light_sampling(1000); } },
+		{ "roulette", [] { bench_roulette(1000); } },
+		{ "scene_load", [] {
+			for (u32 balls : { 10000u, 100000u, 1000000u })
+				bench_scene_load(balls);
+		} },
+		{ "scene_footprint", [] {
+			for (u32 balls : { 100000u, 1000000u })
+				bench_scene_footprint(balls);
+		} },
+		{ "checkpoint", [] {
+			bench_checkpoint(1024, 1024);
+			bench_checkpoint(3840, 2160);
+		} },
+		{ "image_encode", [=] {
+			for (ImageFormat format : { ImageFormat::PPM, ImageFormat::PFM, ImageFormat::PNG }) {
+				for (auto [w, h] : { std::pair{ 1024u, 1024u }, std::pair{ 7680u, 4320u } }) {
+					bench_image_encode(w, h, format, 1);
+					if (hardware_threads > 1)
+						bench_image_encode(w, h, format, hardware_threads);
+				}
+			}
+		} },
+		{ "write_ppm", [] { bench_write_ppm(1024, 1024); } },
+		{ "resample", [] { bench_resample(1024, 1024); } },
+		{ "resample_engine", [] { bench_resample_engine(3840, 2160); } },
+		{ "mip_pyramid", [] { bench_mip_pyramid(3840, 2160); } },
+		{ "resample_16k", [] {
+			bench_resample_engine(15360, 8640);
+			bench_mip_pyramid(15360, 8640);
+		}, true },
+	};
+
+	for (const BenchCase& c : cases) {
+		bool selected = filters.empty() && (!c.opt_in || list);
+		for (const std::string& f : filters)
+			selected |= c.opt_in ? f == c.name : std::string(c.name).find(f) != std::string::npos;
+		if (!selected)
+			continue;
+		if (list)
+			std::cout << c.name << std::endl;
+		else
+			c.run();
+	}
+
+	if (!json_path.empty() && !list && !write_json_report(json_path)) {
+		std::cerr << "Failed to write " << json_path << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "math.h"
+#include "primitives.h"
+#include "sphere_soa.h"
+#include "packet.h"
+
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+
+struct AABB {
+	Vec3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+	Vec3 max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+	void grow(const Vec3& p) {
+		min = Vec3{ std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+		max = Vec3{ std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+	}
+	void grow(const AABB& b) {
+		grow(b.min);
+		grow(b.max);
+	}
+	bool empty() const {
+		return min.x > max.x;
+	}
+	number_t surface_area() const {
+		if (empty())
+			return 0.f;
+		Vec3 e = max - min;
+		return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+	// Distance from p to the box, zero if p is inside
+	number_t distance(const Vec3& p) const {
+		number_t dx = std::max(std::max(min.x - p.x, p.x - max.x), (number_t)0.f);
+		number_t dy = std::max(std::max(min.y - p.y, p.y - max.y), (number_t)0.f);
+		number_t dz = std::max(std::max(min.z - p.z, p.z - max.z), (number_t)0.f);
+		return std::sqrt(dx * dx + dy * dy + dz * dz);
+	}
+	// Slab test, returns the entry distance or FLT_MAX if the box is missed before t_max
+	number_t intersect(const Vec3& origin, const Vec3& inv_dir, number_t t_max) const {
+		number_t tx0 = (min.x - origin.x) * inv_dir.x, tx1 = (max.x - origin.x) * inv_dir.x;
+		number_t ty0 = (min.y - origin.y) * inv_dir.y, ty1 = (max.y - origin.y) * inv_dir.y;
+		number_t tz0 = (min.z - origin.z) * inv_dir.z, tz1 = (max.z - origin.z) * inv_dir.z;
+		number_t t_enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), (number_t)0.f));
+		number_t t_exit = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max));
+		return t_enter <= t_exit ? t_enter : FLT_MAX;
+	}
+};
+
+AABB bounds(const Sphere& s) {
+	Vec3 r{ s.radius, s.radius, s.radius };
+	return AABB{ s.pos - r, s.pos + r };
+}
+
+/*
+Bounding volume hierarchy over the scene spheres.
+
+Nodes are stored depth first in a single array, the left child of an interior
+node is always the next node and the right child is at 'offset'. Leaves
+reference the range [offset, offset + count) of the sphere array, which is
+reordered during the build so every leaf is contiguous.
+*/
+class BVH {
+public:
+	struct Node {
+		AABB bounds;
+		u32 offset;
+		u32 count;
+
+		bool is_leaf() const { return count > 0; }
+	};
+
+	BVH() = default;
+	~BVH() = default;
+
+	// Builds the hierarchy and reorders spheres into leaf order
+	void build(std::vector<Sphere>& spheres) {
+		nodes.clear();
+		node_data = nullptr;
+		node_total = 0;
+		if (spheres.empty())
+			return;
+
+		std::vector<BuildPrim> prims(spheres.size());
+		for (u32 i = 0; i < (u32)spheres.size(); i++) {
+			prims[i].bounds = ::bounds(spheres[i]);
+			prims[i].centroid = spheres[i].pos;
+			prims[i].index = i;
+		}
+		nodes.reserve(spheres.size() * 2 / LEAF_SIZE + 1);
+		build_recursive(prims, 0, (u32)prims.size(), 0);
+
+		std::vector<Sphere> ordered;
+		ordered.reserve(spheres.size());
+		for (auto& p : prims)
+			ordered.push_back(spheres[p.index]);
+		spheres = std::move(ordered);
+		node_data = nodes.data();
+		node_total = (u32)nodes.size();
+	}
+
+	// Uses an external node array that outlives this object instead of building one, e.g. from a mapped scene file
+	void borrow(const Node* data, u32 count) {
+		nodes = std::vector<Node>{};
+		node_data = data;
+		node_total = count;
+	}
+	bool empty() const { return node_total == 0; }
+	u32 node_count() const { return node_total; }
+	const Node* data() const { return node_data; }
+
+	/*
+	Whether 'data' is laid out the way build() writes it, so traversal stays
+	inside the nodes and 'sphere_count' spheres: every node comes right after
+	its parent's left subtree, no deeper than MAX_DEPTH, and leaves reference
+	spheres that exist. Looks at every node once.
+	*/
+	static bool valid(const Node* data, u32 count, u32 sphere_count) {
+		if (count == 0)
+			return true;
+		struct Entry {
+			u32 node, depth;
+		};
+		Entry stack[MAX_DEPTH + 1];
+		u32 stack_size = 0;
+		stack[stack_size++] = { 0, 0 };
+		// Depth first order visits the nodes in array order, anything else is a bad offset or a cycle
+		u32 next = 0;
+		while (stack_size) {
+			Entry e = stack[--stack_size];
+			if (e.node != next++)
+				return false;
+			const Node& node = data[e.node];
+			if (node.is_leaf()) {
+				if (node.offset > sphere_count || node.count > sphere_count - node.offset)
+					return false;
+				continue;
+			}
+			if (e.depth + 1 >= MAX_DEPTH || node.offset <= e.node + 1 || node.offset >= count)
+				return false;
+			stack[stack_size++] = { node.offset, e.depth + 1 };
+			stack[stack_size++] = { e.node + 1, e.depth + 1 };
+		}
+		return next == count;
+	}
+
+	/*
+	Finds the sphere with the smallest unsigned surface distance to p.
+	Subtrees whose box is further away than the best hit so far are pruned,
+	children are visited nearest first so the bound tightens quickly.
+	*/
+	number_t nearest(const SphereSoA& geometry, Vec3 p, u32* index = nullptr) const {
+		number_t best = FLT_MAX;
+		u32 best_index = 0;
+		if (empty()) {
+			if (index) *index = best_index;
+			return best;
+		}
+
+		u32 stack[MAX_DEPTH + 1];
+		u32 stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size) {
+			const Node& node = node_data[stack[--stack_size]];
+			if (node.is_leaf()) {
+				u32 i;
+				number_t d = geometry.nearest(p, node.offset, node.offset + node.count, i);
+				if (d < best) {
+					best = d;
+					best_index = i;
+				}
+				continue;
+			}
+			u32 left = (u32)(&node - node_data) + 1;
+			u32 right = node.offset;
+			number_t dl = node_data[left].bounds.distance(p);
+			number_t dr = node_data[right].bounds.distance(p);
+			if (dl > dr) {
+				std::swap(left, right);
+				std::swap(dl, dr);
+			}
+			// Push the far child first so the near child is popped next
+			if (dr < best) stack[stack_size++] = right;
+			if (dl < best) stack[stack_size++] = left;
+		}
+		if (index) *index = best_index;
+		return best;
+	}
+
+	/*
+	Packet traversal for nearest, lanes in 'mask' share one walk of the tree.
+	A node is entered while any lane could still find something closer in it
+	and leaves are evaluated for the whole packet at once.
+	*/
+	template<u32 N>
+	void nearest_packet(const SphereSoA& geometry, const RayPacket<N>& p, u32 mask, number_t* best) const {
+		for (u32 l = 0; l < N; l++)
+			best[l] = FLT_MAX;
+		if (empty())
+			return;
+
+		u32 stack[MAX_DEPTH + 1];
+		u32 stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size) {
+			const Node& node = node_data[stack[--stack_size]];
+			u32 needed = 0;
+			for_each_lane(mask, [&](u32 l) {
+				if (node.bounds.distance(p.origin(l)) < best[l])
+					needed |= 1u << l;
+			});
+			if (!needed)
+				continue;
+			if (node.is_leaf()) {
+				geometry.nearest_packet<N>(p.ox, p.oy, p.oz, node.offset, node.offset + node.count, best);
+				continue;
+			}
+			// Near child first, judged by the first lane that still needs the node
+			u32 lead = (u32)std::countr_zero(needed);
+			u32 left = (u32)(&node - node_data) + 1;
+			u32 right = node.offset;
+			if (node_data[left].bounds.distance(p.origin(lead)) > node_data[right].bounds.distance(p.origin(lead)))
+				std::swap(left, right);
+			stack[stack_size++] = right;
+			stack[stack_size++] = left;
+		}
+	}
+
+	// Closest analytic ray hit, same traversal order as nearest but pruned by ray distance
+	bool intersect(const SphereSoA& spheres, const Ray& r, number_t t_min, number_t& t, u32& index) const {
+		if (empty())
+			return false;
+
+		Vec3 origin = r.origin();
+		Vec3 dir = r.direction();
+		Vec3 inv_dir{ 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+		number_t best = FLT_MAX;
+		bool hit = false;
+
+		u32 stack[MAX_DEPTH + 1];
+		u32 stack_size = 0;
+		if (node_data[0].bounds.intersect(origin, inv_dir, best) < best)
+			stack[stack_size++] = 0;
+
+		while (stack_size) {
+			const Node& node = node_data[stack[--stack_size]];
+			if (node.is_leaf()) {
+				for (u32 i = node.offset; i < node.offset + node.count; i++) {
+					number_t ti;
+					if (intersect_sphere(spheres.center(i), spheres.radius(i), origin, dir, t_min, ti) && ti < best) {
+						best = ti;
+						index = i;
+						hit = true;
+					}
+				}
+				continue;
+			}
+			u32 left = (u32)(&node - node_data) + 1;
+			u32 right = node.offset;
+			number_t tl = node_data[left].bounds.intersect(origin, inv_dir, best);
+			number_t tr = node_data[right].bounds.intersect(origin, inv_dir, best);
+			if (tl > tr) {
+				std::swap(left, right);
+				std::swap(tl, tr);
+			}
+			if (tr < best) stack[stack_size++] = right;
+			if (tl < best) stack[stack_size++] = left;
+		}
+		t = best;
+		return hit;
+	}
+
+	// Packet version of intersect with a t_min per lane, returns the mask of lanes that hit something
+	template<u32 N>
+	u32 intersect_packet(const SphereSoA& spheres, const RayPacket<N>& p, u32 mask, const number_t* t_min, number_t* t, u32* index) const {
+		for (u32 l = 0; l < N; l++)
+			t[l] = FLT_MAX;
+		if (empty())
+			return 0;
+
+		Vec3 inv_dir[N];
+		for_each_lane(mask, [&](u32 l) {
+			inv_dir[l] = Vec3{ 1.f / p.dx[l], 1.f / p.dy[l], 1.f / p.dz[l] };
+		});
+		u32 hit = 0;
+
+		u32 stack[MAX_DEPTH + 1];
+		u32 stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size) {
+			const Node& node = node_data[stack[--stack_size]];
+			u32 needed = 0;
+			for_each_lane(mask, [&](u32 l) {
+				if (node.bounds.intersect(p.origin(l), inv_dir[l], t[l]) < t[l])
+					needed |= 1u << l;
+			});
+			if (!needed)
+				continue;
+			if (node.is_leaf()) {
+				for (u32 i = node.offset; i < node.offset + node.count; i++) {
+					for_each_lane(needed, [&](u32 l) {
+						number_t ti;
+						if (intersect_sphere(spheres.center(i), spheres.radius(i), p.origin(l), p.direction(l), t_min[l], ti) && ti < t[l]) {
+							t[l] = ti;
+							index[l] = i;
+							hit |= 1u << l;
+						}
+					});
+				}
+				continue;
+			}
+			u32 lead = (u32)std::countr_zero(needed);
+			u32 left = (u32)(&node - node_data) + 1;
+			u32 right = node.offset;
+			if (node_data[left].bounds.intersect(p.origin(lead), inv_dir[lead], t[lead]) > node_data[right].bounds.intersect(p.origin(lead), inv_dir[lead], t[lead]))
+				std::swap(left, right);
+			stack[stack_size++] = right;
+			stack[stack_size++] = left;
+		}
+		return hit;
+	}
+private:
+	struct BuildPrim {
+		AABB bounds;
+		Vec3 centroid;
+		u32 index;
+	};
+
+	static constexpr u32 LEAF_SIZE = 4;
+	static constexpr u32 BIN_COUNT = 16;
+	// Deeper subtrees are collapsed into leaves so traversal fits a fixed stack
+	static constexpr u32 MAX_DEPTH = 64;
+
+	u32 build_recursive(std::vector<BuildPrim>& prims, u32 begin, u32 end, u32 depth) {
+		u32 node_index = (u32)nodes.size();
+		nodes.push_back({});
+
+		AABB node_bounds, centroid_bounds;
+		for (u32 i = begin; i < end; i++) {
+			node_bounds.grow(prims[i].bounds);
+			centroid_bounds.grow(prims[i].centroid);
+		}
+		nodes[node_index].bounds = node_bounds;
+
+		u32 count = end - begin;
+		auto make_leaf = [&]() {
+			nodes[node_index].offset = begin;
+			nodes[node_index].count = count;
+			return node_index;
+		};
+		if (count <= LEAF_SIZE || depth + 1 >= MAX_DEPTH)
+			return make_leaf();
+
+		// Binned surface area heuristic along the widest centroid axis
+		Vec3 extent = centroid_bounds.max - centroid_bounds.min;
+		u32 axis = 0;
+		if (extent.y > extent.x) axis = 1;
+		if (extent.z > component(extent, axis)) axis = 2;
+		number_t axis_min = component(centroid_bounds.min, axis);
+		number_t axis_extent = component(extent, axis);
+		if (axis_extent <= 0.f)
+			return make_leaf();
+
+		struct Bin {
+			AABB bounds;
+			u32 count = 0;
+		};
+		Bin bins[BIN_COUNT];
+		auto bin_of = [&](const BuildPrim& p) {
+			u32 b = (u32)(((component(p.centroid, axis) - axis_min) / axis_extent) * BIN_COUNT);
+			return min<u32>(b, BIN_COUNT - 1);
+		};
+		for (u32 i = begin; i < end; i++) {
+			Bin& b = bins[bin_of(prims[i])];
+			b.bounds.grow(prims[i].bounds);
+			b.count++;
+		}
+
+		number_t right_area[BIN_COUNT];
+		u32 right_count[BIN_COUNT];
+		AABB acc;
+		u32 acc_count = 0;
+		for (u32 i = BIN_COUNT - 1; i > 0; i--) {
+			acc.grow(bins[i].bounds);
+			acc_count += bins[i].count;
+			right_area[i] = acc.surface_area();
+			right_count[i] = acc_count;
+		}
+
+		number_t best_cost = FLT_MAX;
+		u32 best_split = 0;
+		acc = AABB{};
+		acc_count = 0;
+		for (u32 i = 1; i < BIN_COUNT; i++) {
+			acc.grow(bins[i - 1].bounds);
+			acc_count += bins[i - 1].count;
+			if (acc_count == 0 || right_count[i] == 0)
+				continue;
+			number_t cost = acc.surface_area() * acc_count + right_area[i] * right_count[i];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_split = i;
+			}
+		}
+
+		u32 mid;
+		number_t leaf_cost = node_bounds.surface_area() * count;
+		if (best_split == 0) {
+			// All centroids landed in one bin, fall back to a median split
+			mid = begin + count / 2;
+			std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end, [axis](const BuildPrim& a, const BuildPrim& b) {
+				return component(a.centroid, axis) < component(b.centroid, axis);
+			});
+		}
+		else {
+			if (best_cost >= leaf_cost && count <= LEAF_SIZE * 4)
+				return make_leaf();
+			auto it = std::partition(prims.begin() + begin, prims.begin() + end, [&](const BuildPrim& p) {
+				return bin_of(p) < best_split;
+			});
+			mid = (u32)(it - prims.begin());
+		}
+
+		build_recursive(prims, begin, mid, depth + 1);
+		u32 right = build_recursive(prims, mid, end, depth + 1);
+		nodes[node_index].offset = right;
+		nodes[node_index].count = 0;
+		return node_index;
+	}
+
+	static number_t component(const Vec3& v, u32 axis) {
+		return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+	}
+
+	// Built nodes, node_data points into them or to borrowed memory
+	std::vector<Node> nodes;
+	const Node* node_data = nullptr;
+	u32 node_total = 0;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "math.h"
+#include "accumulator.h"
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PATHTRACER_MMAP 1
+#endif
+
+/*
+Checkpoint file: this header followed by the raw AccumulationBuffer pixels.
+The seed is stored so a resumed render continues the same sample sequences,
+the pixel size guards against loading a file from a build with another number_t.
+*/
+struct CheckpointHeader {
+	char magic[4] = { 'P', 'T', 'C', 'K' };
+	u32 version = 1;
+	u32 width = 0;
+	u32 height = 0;
+	u32 seed = 0;
+	u32 pixel_size = sizeof(PixelAccumulator);
+};
+
+/*
+Writes the buffer to 'filepath' atomically: the data goes to a temporary file
+next to it which then replaces the old checkpoint with a rename, so a crash
+leaves either the previous or the new checkpoint, never a torn one.
+The buffer lock is only held while the pixels are copied out.
+*/
+bool save_checkpoint(const std::string& filepath, const AccumulationBuffer& buffer, u32 seed) {
+	CheckpointHeader header;
+	header.width = buffer.width();
+	header.height = buffer.height();
+	header.seed = seed;
+	size_t size = sizeof(header) + buffer.size_bytes();
+	std::string tmp_path = filepath + ".tmp";
+
+#if defined(PATHTRACER_MMAP)
+	int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	memcpy(map, &header, sizeof(header));
+	buffer.snapshot((u8*)map + sizeof(header));
+	// No msync, the page cache survives the process being killed and a synchronous flush would stall the render
+	munmap(map, size);
+	bool ok = close(fd) == 0;
+#else
+	std::vector<u8> data(size);
+	memcpy(data.data(), &header, sizeof(header));
+	buffer.snapshot(data.data() + sizeof(header));
+	std::ofstream fs(tmp_path, std::ios::binary | std::ios::trunc);
+	fs.write((const char*)data.data(), data.size());
+	fs.close();
+	bool ok = (bool)fs;
+#endif
+	if (!ok) {
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+	return std::rename(tmp_path.c_str(), filepath.c_str()) == 0;
+}
+
+bool load_checkpoint(const std::string& filepath, AccumulationBuffer& buffer, u32& seed) {
+	std::ifstream fs(filepath, std::ios::binary);
+	if (!fs)
+		return false;
+	CheckpointHeader header, expected;
+	if (!fs.read((char*)&header, sizeof(header)))
+		return false;
+	if (memcmp(header.magic, expected.magic, 4) != 0 || header.version != expected.version || header.pixel_size != expected.pixel_size)
+		return false;
+
+	std::vector<u8> data((size_t)header.width * header.height * sizeof(PixelAccumulator));
+	if (!fs.read((char*)data.data(), data.size()))
+		return false;
+	buffer.restore(header.width, header.height, data.data());
+	seed = header.seed;
+	return true;
+}
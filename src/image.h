@@ -3,27 +3,137 @@
 #include "math.h"
 
 #include <vector>
-#include <sstream>
-#include <fstream>
+#include <cstring>
+#include <type_traits>
 
-class Image {
+// Quantizes a display value in [0, 1] to 8 bits
+u8 to_u8(number_t c) {
+	return (u8)(clamp(c, 0.f, 1.f) * 255.f);
+}
+
+/*
+IEEE half precision conversion, round to nearest even. Values too large
+for a half become infinity, too small ones flush to zero or a subnormal.
+*/
+u16 float_to_half(float f) {
+	u32 b;
+	memcpy(&b, &f, 4);
+	u32 sign = (b >> 16) & 0x8000;
+	u32 abs = b & 0x7fffffff;
+	if (abs >= 0x7f800000)
+		return (u16)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+	// Rounds up to infinity
+	if (abs >= 0x477ff000)
+		return (u16)(sign | 0x7c00);
+	if (abs < 0x38800000) {
+		// Subnormal half, shift the mantissa with its implicit bit into place
+		if (abs < 0x33000000)
+			return (u16)sign;
+		u32 e = abs >> 23;
+		u32 m = (abs & 0x7fffff) | 0x800000;
+		u32 shift = 126 - e;
+		u32 half = m >> shift;
+		u32 rest = m & ((1u << shift) - 1);
+		u32 mid = 1u << (shift - 1);
+		if (rest > mid || (rest == mid && (half & 1)))
+			half++;
+		return (u16)(sign | half);
+	}
+	// Rebias the exponent and round the mantissa to 10 bits
+	u32 v = abs - 0x38000000;
+	u32 rest = v & 0x1fff;
+	v >>= 13;
+	if (rest > 0x1000 || (rest == 0x1000 && (v & 1)))
+		v++;
+	return (u16)(sign | v);
+}
+
+float half_to_float(u16 h) {
+	u32 sign = (u32)(h & 0x8000) << 16;
+	u32 e = (h >> 10) & 0x1f;
+	u32 m = h & 0x3ff;
+	u32 b;
+	if (e == 0x1f)
+		b = sign | 0x7f800000 | (m << 13);
+	else if (e != 0)
+		b = sign | ((e + 112) << 23) | (m << 13);
+	else if (m == 0)
+		b = sign;
+	else {
+		// Subnormal half, normalize it
+		e = 113;
+		while ((m & 0x400) == 0) {
+			m <<= 1;
+			e--;
+		}
+		b = sign | (e << 23) | ((m & 0x3ff) << 13);
+	}
+	float f;
+	memcpy(&f, &b, 4);
+	return f;
+}
+
+/*
+Pixel formats of BasicImage: the stored type and the conversion from and to
+a color. Images hold display values, the square rooted mean the renderer
+resolves, so RGBA8 quantizes the same way the 8 bit encoders do.
+*/
+struct PixelVec3 {
+	using Storage = Vec3;
+	static Storage encode(const Vec3& c) { return c; }
+	static Vec3 decode(const Storage& s) { return s; }
+};
+struct PixelRGB32F {
+	struct Storage { float r, g, b; };
+	static Storage encode(const Vec3& c) { return { (float)c.x, (float)c.y, (float)c.z }; }
+	static Vec3 decode(const Storage& s) { return { s.r, s.g, s.b }; }
+};
+struct PixelRGBA16F {
+	struct Storage { u16 r, g, b, a; };
+	static Storage encode(const Vec3& c) {
+		return { float_to_half((float)c.x), float_to_half((float)c.y), float_to_half((float)c.z), 0x3c00 };
+	}
+	static Vec3 decode(const Storage& s) { return { half_to_float(s.r), half_to_float(s.g), half_to_float(s.b) }; }
+};
+struct PixelRGBA8 {
+	struct Storage { u8 r, g, b, a; };
+	static Storage encode(const Vec3& c) { return { to_u8(c.x), to_u8(c.y), to_u8(c.z), 255 }; }
+	static Vec3 decode(const Storage& s) { return { s.r / 255.f, s.g / 255.f, s.b / 255.f }; }
+};
+
+/*
+Linear is row major. Tiled stores IMAGE_BLOCK x IMAGE_BLOCK blocks
+contiguously, pixels inside a block in Morton order, so a render tile
+writes whole cache lines of its own instead of a slice of every row it
+covers. Tiled images are padded to whole blocks.
+*/
+enum struct ImageLayout {
+	Linear,
+	Tiled
+};
+const u32 IMAGE_BLOCK = 8;
+
+template<typename Format, ImageLayout Layout = ImageLayout::Linear>
+class BasicImage {
 public:
-	Image(u32 w, u32 h)
+	using Storage = typename Format::Storage;
+
+	BasicImage(u32 w, u32 h)
 		:
 		w(w), h(h) {
 		// Init to black image
-		data.resize(w * h, Vec3{ 0.f, 0.f, 0.f });
+		data.resize(storage_size(), Format::encode(Vec3{ 0.f, 0.f, 0.f }));
 	}
-	Image(u32 w, u32 h, const Image& img) :
+	BasicImage(u32 w, u32 h, const BasicImage& img) :
 		w(w), h(h) {
-		data.resize(w * h, Vec3{ 0.f, 0.f, 0.f });
+		data.resize(storage_size(), Format::encode(Vec3{ 0.f, 0.f, 0.f }));
 
 		auto read_color = [img = &img](number_t x, number_t y) {
 			// Clamp x and y to image size
 			if(x < 0) x = 0.f;
 			if(y < 0) y = 0.f;
-			if(x > img->width()) x = (number_t)img->width();
-			if(y > img->height()) y = (number_t)img->height();
+			if(x > img->width() - 1) x = (number_t)(img->width() - 1);
+			if(y > img->height() - 1) y = (number_t)(img->height() - 1);
 			// Sample from image
 			return img->get((u32)x, (u32)y);
 		};
@@ -56,14 +166,14 @@ public:
 				read_color(target_x - 0.5f, target_y + 0.5f) + 
 				read_color(target_x + 0.5f, target_y + 0.5f) +
 				read_color(target_x - 0.5f, target_y - 0.5f) + 
-				read_color(target_x + 0.5f, target_y + 0.5f)
+				read_color(target_x + 0.5f, target_y - 0.5f)
 			) * (1.f / 4.f);
 		};
 
 		for (u32 i = 0; i < w; i++) {
 			for (u32 k = 0; k < h; k++) {
 				// For each pixel calculate the resulting pixel
-				get(i, k) = sample(i, k);
+				set(i, k, sample(i, k));
 			}
 		}
 	}
@@ -72,44 +182,45 @@ public:
 	u32 width() const { return w; }
 	u32 height() const { return h; }
 
-	Vec3& get(u32 x, u32 y) { return data[x + y * w]; }
-	const Vec3& get(u32 x, u32 y) const { return data[x + y * w]; }
-private:
-	std::vector<Vec3> data;
-	u32 w, h;
-};
-
-void write_ppm(const std::string& filepath, const Image& img) {
-	std::stringstream ss;
-
-	u32
-		w = img.width(),
-		h = img.height();
-
-
-	ss << "P3\n";
-	ss << w << " " << h << "\n";
-
-	ss << "255\n";
-
-	for (u32 y = 0; y < h; y++) {
-		for (u32 x = 0; x < w; x++) {
-			ss
-				<< (u32)(clamp(img.get(x, y).x, 0.f, 1.f) * 255.f) << " "
-				<< (u32)(clamp(img.get(x, y).y, 0.f, 1.f) * 255.f) << " "
-				<< (u32)(clamp(img.get(x, y).z, 0.f, 1.f) * 255.f) << "\n";
+	// Only Vec3 pixels can be referenced, compact formats go through set()
+	Vec3& get(u32 x, u32 y) requires std::is_same_v<Storage, Vec3> { return data[index(x, y)]; }
+	decltype(auto) get(u32 x, u32 y) const {
+		if constexpr (std::is_same_v<Storage, Vec3>)
+			return (const Vec3&)data[index(x, y)];
+		else
+			return Format::decode(data[index(x, y)]);
+	}
+	void set(u32 x, u32 y, const Vec3& c) { data[index(x, y)] = Format::encode(c); }
+
+	// Raw pixels, in the layout's order
+	const Storage* storage() const { return data.data(); }
+	size_t storage_bytes() const { return data.size() * sizeof(Storage); }
+
+	size_t index(u32 x, u32 y) const {
+		if constexpr (Layout == ImageLayout::Linear)
+			return x + (size_t)y * w;
+		else {
+			// Interleave the bits of the position inside the block
+			u32 bx = x & (IMAGE_BLOCK - 1), by = y & (IMAGE_BLOCK - 1);
+			u32 morton = (bx & 1) | (by & 1) << 1 | (bx & 2) << 1 | (by & 2) << 2 | (bx & 4) << 2 | (by & 4) << 3;
+			return ((size_t)(y / IMAGE_BLOCK) * blocks_x() + x / IMAGE_BLOCK) * IMAGE_BLOCK * IMAGE_BLOCK + morton;
 		}
-		ss << "\n";
 	}
-
-	std::ofstream fs(filepath);
-
-	if (!fs) {
-		return;
+private:
+	u32 blocks_x() const { return (w + IMAGE_BLOCK - 1) / IMAGE_BLOCK; }
+	size_t storage_size() const {
+		if constexpr (Layout == ImageLayout::Linear)
+			return (size_t)w * h;
+		else
+			return (size_t)blocks_x() * ((h + IMAGE_BLOCK - 1) / IMAGE_BLOCK) * IMAGE_BLOCK * IMAGE_BLOCK;
 	}
-	std::string img_str = ss.str();
-	fs.write(img_str.c_str(), img_str.size());
-	fs.close();
 
-}
+	std::vector<Storage> data;
+	u32 w, h;
+};
 
+// Linear Vec3 image everything renders into and encodes from by default
+using Image = BasicImage<PixelVec3>;
+using ImageRGB32F = BasicImage<PixelRGB32F>;
+using ImageRGBA16F = BasicImage<PixelRGBA16F>;
+using ImageRGBA8 = BasicImage<PixelRGBA8>;
@@ -0,0 +1,521 @@
+#pragma once
+
+#include "math.h"
+#include "image.h"
+#include "scheduler.h"
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <bit>
+
+enum struct ImageFormat {
+	PPM,
+	PFM,
+	PNG,
+	Unknown
+};
+
+ImageFormat image_format_from_path(const std::string& filepath) {
+	auto dot = filepath.find_last_of('.');
+	if (dot == std::string::npos)
+		return ImageFormat::Unknown;
+	std::string ext = filepath.substr(dot + 1);
+	for (char& c : ext)
+		c = (char)tolower(c);
+	if (ext == "ppm")
+		return ImageFormat::PPM;
+	if (ext == "pfm")
+		return ImageFormat::PFM;
+	if (ext == "png")
+		return ImageFormat::PNG;
+	return ImageFormat::Unknown;
+}
+
+const char* image_format_name(ImageFormat f) {
+	switch (f) {
+	case ImageFormat::PPM: return "ppm";
+	case ImageFormat::PFM: return "pfm";
+	case ImageFormat::PNG: return "png";
+	default: return "unknown";
+	}
+}
+
+// Rows per band for the parallel conversion, small enough to balance and large enough to amortize scheduling
+const u32 IMAGE_IO_BAND_ROWS = 32;
+
+// Runs fn(y_begin, y_end) over bands of rows, on the scheduler if there is one
+template<typename F>
+void for_each_row_band(TaskScheduler* scheduler, u32 h, F&& fn) {
+	u32 bands = (h + IMAGE_IO_BAND_ROWS - 1) / IMAGE_IO_BAND_ROWS;
+	auto band = [&](u32 i) {
+		fn(i * IMAGE_IO_BAND_ROWS, min<u32>((i + 1) * IMAGE_IO_BAND_ROWS, h));
+	};
+	if (!scheduler || bands < 2) {
+		for (u32 i = 0; i < bands; i++)
+			band(i);
+		return;
+	}
+	scheduler->parallel_for(bands, band);
+}
+
+static_assert(IMAGE_IO_BAND_ROWS % IMAGE_BLOCK == 0, "bands have to cover whole blocks of tiled images");
+
+/*
+Linear Vec3 copy of any BasicImage, what the encoders read. Tiled layouts
+are converted a block at a time so the reads stay inside one contiguous
+block.
+*/
+template<typename Format, ImageLayout Layout>
+Image to_image(const BasicImage<Format, Layout>& img, TaskScheduler* scheduler = nullptr) {
+	u32 w = img.width(), h = img.height();
+	Image out(w, h);
+	for_each_row_band(scheduler, h, [&](u32 y0, u32 y1) {
+		if constexpr (Layout == ImageLayout::Tiled) {
+			for (u32 by = y0; by < y1; by += IMAGE_BLOCK)
+				for (u32 bx = 0; bx < w; bx += IMAGE_BLOCK)
+					for (u32 y = by; y < min<u32>(by + IMAGE_BLOCK, y1); y++)
+						for (u32 x = bx; x < min<u32>(bx + IMAGE_BLOCK, w); x++)
+							out.get(x, y) = img.get(x, y);
+		}
+		else {
+			for (u32 y = y0; y < y1; y++)
+				for (u32 x = 0; x < w; x++)
+					out.get(x, y) = img.get(x, y);
+		}
+	});
+	return out;
+}
+
+// One row of 8 bit RGB
+void convert_row_rgb8(const Image& img, u32 y, u8* out) {
+	for (u32 x = 0; x < img.width(); x++) {
+		const Vec3& c = img.get(x, y);
+		out[x * 3 + 0] = to_u8(c.x);
+		out[x * 3 + 1] = to_u8(c.y);
+		out[x * 3 + 2] = to_u8(c.z);
+	}
+}
+
+// CRC-32 as used by PNG chunks
+class Crc32 {
+public:
+	static u32 update(u32 crc, const u8* data, size_t n) {
+		static const Table table;
+		crc = ~crc;
+		for (size_t i = 0; i < n; i++)
+			crc = table.v[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+private:
+	struct Table {
+		u32 v[256];
+		Table() {
+			for (u32 n = 0; n < 256; n++) {
+				u32 c = n;
+				for (u32 k = 0; k < 8; k++)
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				v[n] = c;
+			}
+		}
+	};
+};
+
+// Adler-32 as used by the zlib stream, combine() joins checksums of adjacent blocks
+class Adler32 {
+public:
+	static const u32 MOD = 65521;
+
+	static u32 update(u32 adler, const u8* data, size_t n) {
+		u32 a = adler & 0xffff, b = adler >> 16;
+		while (n > 0) {
+			// Largest run that can not overflow 32 bits before the modulo
+			size_t run = std::min<size_t>(n, 5552);
+			n -= run;
+			for (size_t i = 0; i < run; i++) {
+				a += data[i];
+				b += a;
+			}
+			data += run;
+			a %= MOD;
+			b %= MOD;
+		}
+		return (b << 16) | a;
+	}
+	// Checksum of A followed by B from the checksums of both and the length of B
+	static u32 combine(u32 adler_a, u32 adler_b, u64 length_b) {
+		u64 rem = length_b % MOD;
+		u64 a1 = adler_a & 0xffff, b1 = adler_a >> 16;
+		u64 a2 = adler_b & 0xffff, b2 = adler_b >> 16;
+		u64 a = (a1 + a2 + MOD - 1) % MOD;
+		u64 b = (b1 + b2 + rem * a1 + MOD - rem) % MOD;
+		return (u32)((b << 16) | a);
+	}
+};
+
+/*
+Dependency free PNG encoder (8 bit RGB, no filtering, stored deflate blocks).
+
+Compression is not the point, throughput is: every band of rows becomes its
+own IDAT chunk with its own CRC, so bands can be encoded concurrently and in
+any order. Only the zlib Adler-32 runs over the whole stream, bands hand back
+their partial checksum and add_band() joins them in image order.
+
+Layout: signature, IHDR, IDAT with the zlib header, one IDAT per band,
+IDAT with the final empty block and Adler-32, IEND.
+*/
+class PngEncoder {
+public:
+	PngEncoder(u32 w, u32 h) : w(w), h(h) {}
+
+	static const size_t HEADER_SIZE = 8 + (12 + 13) + (12 + 2);
+	static const size_t TRAILER_SIZE = (12 + 5 + 4) + 12;
+
+	// Bytes encode_band() writes for a band of the given number of rows
+	size_t band_size(u32 rows) const {
+		u64 raw = (u64)rows * row_bytes();
+		u64 blocks = (raw + MAX_BLOCK - 1) / MAX_BLOCK;
+		return (size_t)(12 + blocks * 5 + raw);
+	}
+	size_t encoded_size() const {
+		size_t size = HEADER_SIZE + TRAILER_SIZE;
+		for (u32 y = 0; y < h; y += IMAGE_IO_BAND_ROWS)
+			size += band_size(min<u32>(IMAGE_IO_BAND_ROWS, h - y));
+		return size;
+	}
+
+	void write_header(u8* out) const {
+		const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		memcpy(out, signature, 8);
+		u8 ihdr[13];
+		put_u32(ihdr, w);
+		put_u32(ihdr + 4, h);
+		ihdr[8] = 8;	// bit depth
+		ihdr[9] = 2;	// truecolor
+		ihdr[10] = 0;	// deflate
+		ihdr[11] = 0;	// adaptive filtering
+		ihdr[12] = 0;	// no interlace
+		out = write_chunk(out + 8, "IHDR", ihdr, 13);
+		// zlib header, deflate with a 32K window and no preset dictionary
+		const u8 zlib[2] = { 0x78, 0x01 };
+		write_chunk(out, "IDAT", zlib, 2);
+	}
+	/*
+	Encodes 'rows' rows of packed 8 bit RGB as one IDAT chunk of stored deflate
+	blocks into 'out' (band_size(rows) bytes). Returns the Adler-32 of the
+	uncompressed band for add_band().
+	*/
+	u32 encode_band(const u8* rgb, u32 rows, u8* out) const {
+		u64 raw = (u64)rows * row_bytes();
+		u8* chunk = out;
+		put_u32(out, (u32)(band_size(rows) - 12));
+		memcpy(out + 4, "IDAT", 4);
+		out += 8;
+
+		u32 adler = 1;
+		u64 written = 0;
+		u32 row = 0, row_offset = 0;
+		while (written < raw) {
+			u32 block = (u32)std::min<u64>(MAX_BLOCK, raw - written);
+			// Stored block header, never final, the trailer closes the stream
+			out[0] = 0;
+			out[1] = (u8)(block & 0xff);
+			out[2] = (u8)(block >> 8);
+			out[3] = (u8)(~block & 0xff);
+			out[4] = (u8)((~block >> 8) & 0xff);
+			out += 5;
+			// Block payload, rows are a filter type byte (none) followed by the pixels
+			u8* payload = out;
+			u32 left = block;
+			while (left > 0) {
+				if (row_offset == 0) {
+					*out++ = 0;
+					row_offset = 1;
+					left--;
+					continue;
+				}
+				u32 n = min<u32>(left, row_bytes() - row_offset);
+				memcpy(out, rgb + (size_t)row * w * 3 + (row_offset - 1), n);
+				out += n;
+				left -= n;
+				row_offset += n;
+				if (row_offset == row_bytes()) {
+					row++;
+					row_offset = 0;
+				}
+			}
+			adler = Adler32::update(adler, payload, block);
+			written += block;
+		}
+		put_u32(out, Crc32::update(0, chunk + 4, out - chunk - 4));
+		return adler;
+	}
+	// Bands have to be added in image order
+	void add_band(u32 band_adler, u32 rows) {
+		adler = Adler32::combine(adler, band_adler, (u64)rows * row_bytes());
+	}
+	void write_trailer(u8* out) const {
+		// Empty final stored block, then the checksum of everything before it
+		u8 tail[9] = { 1, 0, 0, 0xff, 0xff };
+		put_u32(tail + 5, adler);
+		out = write_chunk(out, "IDAT", tail, 9);
+		write_chunk(out, "IEND", nullptr, 0);
+	}
+private:
+	static const u32 MAX_BLOCK = 65535;
+
+	u32 row_bytes() const { return 1 + w * 3; }
+
+	static void put_u32(u8* out, u32 v) {
+		out[0] = (u8)(v >> 24);
+		out[1] = (u8)(v >> 16);
+		out[2] = (u8)(v >> 8);
+		out[3] = (u8)v;
+	}
+	static u8* write_chunk(u8* out, const char* type, const u8* data, u32 n) {
+		put_u32(out, n);
+		memcpy(out + 4, type, 4);
+		if (n > 0)
+			memcpy(out + 8, data, n);
+		put_u32(out + 8 + n, Crc32::update(0, out + 4, n + 4));
+		return out + 12 + n;
+	}
+
+	u32 w, h;
+	u32 adler = 1;
+};
+
+// Binary PPM (P6), 8 bits per channel
+std::vector<u8> encode_ppm(const Image& img, TaskScheduler* scheduler = nullptr) {
+	u32 w = img.width(), h = img.height();
+	std::string header = "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+	std::vector<u8> out(header.size() + (size_t)w * h * 3);
+	memcpy(out.data(), header.data(), header.size());
+	u8* pixels = out.data() + header.size();
+	for_each_row_band(scheduler, h, [&](u32 y0, u32 y1) {
+		for (u32 y = y0; y < y1; y++)
+			convert_row_rgb8(img, y, pixels + (size_t)y * w * 3);
+	});
+	return out;
+}
+
+// Portable float map, linear 32 bit float RGB written bottom row first
+std::vector<u8> encode_pfm(const Image& img, TaskScheduler* scheduler = nullptr) {
+	u32 w = img.width(), h = img.height();
+	// Negative scale marks little endian data
+	const bool little_endian = std::endian::native == std::endian::little;
+	std::string header = "PF\n" + std::to_string(w) + " " + std::to_string(h) + "\n" + (little_endian ? "-1.0\n" : "1.0\n");
+	std::vector<u8> out(header.size() + (size_t)w * h * 3 * sizeof(float));
+	memcpy(out.data(), header.data(), header.size());
+	u8* pixels = out.data() + header.size();
+	for_each_row_band(scheduler, h, [&](u32 y0, u32 y1) {
+		for (u32 y = y0; y < y1; y++) {
+			float* row = (float*)(pixels + (size_t)(h - 1 - y) * w * 3 * sizeof(float));
+			for (u32 x = 0; x < w; x++) {
+				const Vec3& c = img.get(x, y);
+				row[x * 3 + 0] = (float)c.x;
+				row[x * 3 + 1] = (float)c.y;
+				row[x * 3 + 2] = (float)c.z;
+			}
+		}
+	});
+	return out;
+}
+
+std::vector<u8> encode_png(const Image& img, TaskScheduler* scheduler = nullptr) {
+	u32 w = img.width(), h = img.height();
+	PngEncoder png(w, h);
+	std::vector<u8> out(png.encoded_size());
+	png.write_header(out.data());
+
+	// Band i starts at a known offset, so bands encode straight into the output
+	u32 bands = (h + IMAGE_IO_BAND_ROWS - 1) / IMAGE_IO_BAND_ROWS;
+	std::vector<u32> band_adler(bands);
+	size_t band_stride = png.band_size(IMAGE_IO_BAND_ROWS);
+	for_each_row_band(scheduler, h, [&](u32 y0, u32 y1) {
+		std::vector<u8> rgb((size_t)(y1 - y0) * w * 3);
+		for (u32 y = y0; y < y1; y++)
+			convert_row_rgb8(img, y, rgb.data() + (size_t)(y - y0) * w * 3);
+		u32 band = y0 / IMAGE_IO_BAND_ROWS;
+		band_adler[band] = png.encode_band(rgb.data(), y1 - y0, out.data() + PngEncoder::HEADER_SIZE + band * band_stride);
+	});
+	for (u32 i = 0; i < bands; i++)
+		png.add_band(band_adler[i], min<u32>(IMAGE_IO_BAND_ROWS, h - i * IMAGE_IO_BAND_ROWS));
+	png.write_trailer(out.data() + out.size() - PngEncoder::TRAILER_SIZE);
+	return out;
+}
+
+std::vector<u8> encode_image(ImageFormat format, const Image& img, TaskScheduler* scheduler = nullptr) {
+	switch (format) {
+	case ImageFormat::PPM: return encode_ppm(img, scheduler);
+	case ImageFormat::PFM: return encode_pfm(img, scheduler);
+	case ImageFormat::PNG: return encode_png(img, scheduler);
+	default: return {};
+	}
+}
+
+// Writes the whole buffer with a single write call
+bool write_file(const std::string& filepath, const std::vector<u8>& data) {
+	std::ofstream fs(filepath, std::ios::binary | std::ios::trunc);
+	if (!fs)
+		return false;
+	fs.write((const char*)data.data(), data.size());
+	return (bool)fs;
+}
+
+// Picks the format from the file extension (.ppm, .pfm or .png)
+bool write_image(const std::string& filepath, const Image& img, TaskScheduler* scheduler = nullptr) {
+	ImageFormat format = image_format_from_path(filepath);
+	if (format == ImageFormat::Unknown)
+		return false;
+	return write_file(filepath, encode_image(format, img, scheduler));
+}
+
+// Other formats and layouts are converted to a linear Vec3 image first
+template<typename Format, ImageLayout Layout>
+bool write_image(const std::string& filepath, const BasicImage<Format, Layout>& img, TaskScheduler* scheduler = nullptr) {
+	return write_image(filepath, to_image(img, scheduler), scheduler);
+}
+
+bool write_ppm(const std::string& filepath, const Image& img, TaskScheduler* scheduler = nullptr) {
+	return write_file(filepath, encode_ppm(img, scheduler));
+}
+
+/*
+Writes an image strip by strip as it is produced, for images too large to
+hold in memory. Strips of packed 8 bit RGB have to arrive top to bottom.
+PPM rows go straight to the file, PNG strips each become IDAT bands of the
+same PngEncoder layout encode_png() writes. PFM stores the bottom row
+first and is not supported.
+*/
+class StripWriter {
+public:
+	// Returns nullptr for a file that can not be created or a format that can not be streamed
+	static std::unique_ptr<StripWriter> open(const std::string& filepath, u32 w, u32 h) {
+		ImageFormat format = image_format_from_path(filepath);
+		if (format != ImageFormat::PPM && format != ImageFormat::PNG)
+			return nullptr;
+		auto writer = std::unique_ptr<StripWriter>(new StripWriter(format, w, h));
+		writer->fs.open(filepath, std::ios::binary | std::ios::trunc);
+		if (!writer->fs)
+			return nullptr;
+		if (format == ImageFormat::PPM) {
+			std::string header = "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+			writer->fs.write(header.data(), header.size());
+		}
+		else {
+			writer->band.resize(PngEncoder::HEADER_SIZE);
+			writer->png.write_header(writer->band.data());
+			writer->fs.write((const char*)writer->band.data(), writer->band.size());
+		}
+		return writer;
+	}
+
+	bool write_strip(const u8* rgb, u32 rows) {
+		rows = min<u32>(rows, h - rows_written);
+		if (format == ImageFormat::PPM)
+			fs.write((const char*)rgb, (size_t)w * rows * 3);
+		else {
+			band.resize(png.band_size(rows));
+			png.add_band(png.encode_band(rgb, rows, band.data()), rows);
+			fs.write((const char*)band.data(), band.size());
+		}
+		rows_written += rows;
+		return (bool)fs;
+	}
+	// False if not every row was written or the file could not be completed
+	bool close() {
+		if (format == ImageFormat::PNG) {
+			band.resize(PngEncoder::TRAILER_SIZE);
+			png.write_trailer(band.data());
+			fs.write((const char*)band.data(), band.size());
+		}
+		fs.close();
+		return (bool)fs && rows_written == h;
+	}
+private:
+	StripWriter(ImageFormat format, u32 w, u32 h) : format(format), w(w), h(h), png(w, h) {}
+
+	ImageFormat format;
+	u32 w, h;
+	u32 rows_written = 0;
+	PngEncoder png;
+	std::vector<u8> band;
+	std::ofstream fs;
+};
+
+/*
+Reads a binary PPM (8 bit, P6) or a PFM back into 'img', the inverse of
+the encoders above. PNG is write only.
+*/
+bool read_image(const std::string& filepath, Image& img) {
+	std::ifstream fs(filepath, std::ios::binary);
+	if (!fs)
+		return false;
+	std::string magic;
+	u32 w = 0, h = 0;
+	double scale = 0.0;
+	fs >> magic >> w >> h >> scale;
+	// Exactly one whitespace character separates the header from the pixels
+	fs.get();
+	if (!fs || w == 0 || h == 0)
+		return false;
+
+	img = Image(w, h);
+	if (magic == "P6") {
+		if (scale != 255.0)
+			return false;
+		std::vector<u8> row((size_t)w * 3);
+		for (u32 y = 0; y < h; y++) {
+			if (!fs.read((char*)row.data(), row.size()))
+				return false;
+			for (u32 x = 0; x < w; x++)
+				img.get(x, y) = Vec3{ row[x * 3 + 0] / 255.f, row[x * 3 + 1] / 255.f, row[x * 3 + 2] / 255.f };
+		}
+		return true;
+	}
+	if (magic == "PF") {
+		const bool little_endian = std::endian::native == std::endian::little;
+		bool swap = (scale < 0.0) != little_endian;
+		std::vector<u32> row((size_t)w * 3);
+		for (u32 y = 0; y < h; y++) {
+			if (!fs.read((char*)row.data(), row.size() * sizeof(u32)))
+				return false;
+			for (u32& v : row)
+				if (swap)
+					v = std::byteswap(v);
+			const float* f = (const float*)row.data();
+			for (u32 x = 0; x < w; x++)
+				img.get(x, h - 1 - y) = Vec3{ f[x * 3 + 0], f[x * 3 + 1], f[x * 3 + 2] };
+		}
+		return true;
+	}
+	return false;
+}
+
+struct ImageDiff {
+	number_t rmse = 0.f;
+	// Peak signal to noise ratio in dB for a peak of 1, infinite for identical images
+	number_t psnr = 0.f;
+	number_t max_error = 0.f;
+};
+
+// Per channel error between two images of the same size
+ImageDiff image_diff(const Image& a, const Image& b) {
+	ImageDiff d;
+	double sum = 0.0;
+	for (u32 y = 0; y < a.height(); y++) {
+		for (u32 x = 0; x < a.width(); x++) {
+			Vec3 e = a.get(x, y) - b.get(x, y);
+			sum += (double)e.x * e.x + (double)e.y * e.y + (double)e.z * e.z;
+			d.max_error = max(d.max_error, max(std::abs(e.x), std::abs(e.y), std::abs(e.z)));
+		}
+	}
+	double mse = sum / ((double)a.width() * a.height() * 3.0);
+	d.rmse = (number_t)std::sqrt(mse);
+	d.psnr = mse > 0.0 ? (number_t)(10.0 * std::log10(1.0 / mse)) : std::numeric_limits<number_t>::infinity();
+	return d;
+}
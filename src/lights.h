@@ -0,0 +1,164 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <vector>
+
+// Direction towards a point on a light, 'pdf' is per solid angle and includes picking the light
+struct LightSample {
+	Vec3 direction;
+	u32 light;
+	number_t pdf;
+};
+
+/*
+Spheres with a non zero emissive material, for next event estimation.
+
+A light is picked in proportion to its power (emitted luminance times
+surface area), then a direction uniformly inside the cone it subtends from
+the shading point. Cone sampling never wastes samples on the far side of
+the sphere, its pdf is 1 / (2 pi (1 - cos theta_max)).
+
+Lights are kept in sphere order as the index of their sphere, position and
+emission are read from the scene arrays. A sphere's light is found by
+binary search, so nothing here is sized by the sphere count.
+*/
+class LightList {
+public:
+	// Takes the SceneData of a built scene, looks at every sphere
+	template<typename SceneDataT>
+	void build(const SceneDataT& d) {
+		sphere_storage.clear();
+		cdf_storage.clear();
+		brightest = 0.f;
+		number_t total = 0.f;
+		for (u32 i = 0; i < d.sphere_count; i++) {
+			Vec3 e = material_emissive(d.materials[d.material_index[i]]);
+			number_t luminance = 0.2126f * e.x + 0.7152f * e.y + 0.0722f * e.z;
+			if (luminance <= 0.f)
+				continue;
+			sphere_storage.push_back(i);
+			total += luminance * d.r[i] * d.r[i];
+			cdf_storage.push_back(total);
+			brightest = std::max(brightest, max(e.x, e.y, e.z));
+		}
+		for (number_t& c : cdf_storage)
+			c /= total;
+		use(d, sphere_storage.data(), cdf_storage.data(), (u32)sphere_storage.size(), brightest);
+	}
+	/*
+	Uses the lights of a saved scene without copying them: 'light_spheres'
+	in ascending order, 'light_cdf' and 'max_emission' as sphere_data(),
+	cdf_data() and max_emission() gave them. The arrays have to outlive the
+	list, like the scene arrays.
+	*/
+	template<typename SceneDataT>
+	void borrow(const SceneDataT& d, const u32* light_spheres, const number_t* light_cdf, u32 count, number_t max_emission) {
+		sphere_storage.clear();
+		cdf_storage.clear();
+		use(d, light_spheres, light_cdf, count, max_emission);
+	}
+
+	u32 size() const { return count; }
+	bool empty() const { return count == 0; }
+	// Light index of a sphere of the built scene, ~0u if it does not emit
+	u32 find(u32 sphere) const {
+		const u32* it = std::lower_bound(spheres, spheres + count, sphere);
+		return it != spheres + count && *it == sphere ? (u32)(it - spheres) : ~0u;
+	}
+	u32 sphere(u32 light) const { return spheres[light]; }
+	Vec3 emissive(u32 light) const { return material_emissive(materials[material_index[spheres[light]]]); }
+	// Largest emissive channel of any light
+	number_t max_emission() const { return brightest; }
+	// Sphere of every light and the cumulative selection weights, size() entries each
+	const u32* sphere_data() const { return spheres; }
+	const number_t* cdf_data() const { return cdf; }
+
+	/*
+	Always draws three numbers from 'sampler', so paths stay in step whether
+	or not a sample is usable. Returns false when 'pos' is on or inside the
+	picked light.
+	*/
+	bool sample(const Vec3& pos, Sampler& sampler, LightSample& out) const {
+		number_t u = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+		if (count == 0)
+			return false;
+		u32 i = min<u32>((u32)(std::upper_bound(cdf, cdf + count, u) - cdf), count - 1);
+		number_t one_minus_cos_max;
+		if (!cone(pos, i, one_minus_cos_max))
+			return false;
+		Vec3 axis = (center(i) - pos).normalize();
+		number_t one_minus_cos = u1 * one_minus_cos_max;
+		number_t cos_theta = 1.f - one_minus_cos;
+		number_t sin_theta = std::sqrt(std::max<number_t>(0.f, one_minus_cos * (2.f - one_minus_cos)));
+		number_t phi = 2.f * PI * u2;
+		// Any basis around the axis will do
+		Vec3 helper = std::abs(axis.x) > 0.9f ? Vec3{ 0.f, 1.f, 0.f } : Vec3{ 1.f, 0.f, 0.f };
+		Vec3 t = cross(axis, helper).normalize();
+		Vec3 b = cross(axis, t);
+		out.direction = (t * (std::cos(phi) * sin_theta) + b * (std::sin(phi) * sin_theta) + axis * cos_theta).normalize();
+		out.light = i;
+		out.pdf = select_pdf(i) / (2.f * PI * one_minus_cos_max);
+		return true;
+	}
+	// Density sample() gives the direction from 'pos' towards any point of light 'i', 0 if it cannot sample it from there
+	number_t pdf(const Vec3& pos, u32 i) const {
+		number_t one_minus_cos_max;
+		if (!cone(pos, i, one_minus_cos_max))
+			return 0.f;
+		return select_pdf(i) / (2.f * PI * one_minus_cos_max);
+	}
+	number_t select_pdf(u32 i) const { return cdf[i] - (i ? cdf[i - 1] : 0.f); }
+private:
+	template<typename SceneDataT>
+	void use(const SceneDataT& d, const u32* light_spheres, const number_t* light_cdf, u32 n, number_t max_emission) {
+		x = d.x;
+		y = d.y;
+		z = d.z;
+		r = d.r;
+		material_index = d.material_index;
+		materials = d.materials;
+		spheres = light_spheres;
+		cdf = light_cdf;
+		count = n;
+		brightest = max_emission;
+	}
+	Vec3 center(u32 i) const {
+		u32 s = spheres[i];
+		return Vec3{ x[s], y[s], z[s] };
+	}
+	// 1 - cos of the cone half angle, written so tiny far lights do not cancel to 0
+	bool cone(const Vec3& pos, u32 i, number_t& one_minus_cos_max) const {
+		number_t radius = r[spheres[i]];
+		number_t d2 = square_length(center(i) - pos);
+		number_t sin2 = radius * radius / d2;
+		// Points on the surface count as inside, hits are never exactly on it
+		if (sin2 >= 1.f - 1e-4f)
+			return false;
+		one_minus_cos_max = sin2 / (1.f + std::sqrt(1.f - sin2));
+		return true;
+	}
+
+	// Arrays of the scene the lights are in
+	const number_t* x = nullptr;
+	const number_t* y = nullptr;
+	const number_t* z = nullptr;
+	const number_t* r = nullptr;
+	const u32* material_index = nullptr;
+	const Material* materials = nullptr;
+	// Owned by the list after build(), borrowed otherwise
+	const u32* spheres = nullptr;
+	const number_t* cdf = nullptr;
+	u32 count = 0;
+	std::vector<u32> sphere_storage;
+	std::vector<number_t> cdf_storage;
+	number_t brightest = 0.f;
+};
+
+// Power heuristic weight of a strategy with density 'a' against one with density 'b'
+number_t mis_weight(number_t a, number_t b) {
+	return a * a / (a * a + b * b);
+}
@@ -1,132 +1,15 @@
 #include "math.h"
 #include "image.h"
+#include "image_io.h"
 #include "renderer.h"
 #include "material.h"
 #include "primitives.h"
+#include "scenes.h"
+#include "scene_io.h"
+#include "preview.h"
+#include "perf_counters.h"
 
 
-void generate_scene_1(Scene& scene, u32 ball_count) {
-	Material red_mat{
-		.type = MaterialType::Lambertian,
-		.l = {
-			.reflectance = .3f,
-			.albedo = {.7f, .4f, .4f}
-		}
-	};
-
-	Material reflective_mat{
-		.type = MaterialType::Metallic,
-		.m = {
-			.shininess = 1.f
-		}
-	};
-
-	Material glass_mat{
-		.type = MaterialType::Dielectric,
-		.d = {
-			.refractive_index = 1.3f
-		}
-	};
-
-	Material blue_mat{
-		.type = MaterialType::Lambertian,
-		.l = {
-			.reflectance = .5f,
-			.albedo = {0.f, 0.f, 1.f}
-		}
-	};
-	// Ground sphere
-	scene.add_sphere(Sphere{
-		.pos = {0.f, -100.f, 0.f},
-		.radius = 100.f,
-		.material = red_mat
-					 });
-	/*scene.add_sphere(Sphere{
-		.pos = {-.5f, 0.5f, 0.f},
-		.radius = .5f,
-		.material = reflective_mat
-					 });
-	scene.add_sphere(Sphere{
-		.pos = {.75f, 0.75f, 0.f},
-		.radius = .75f,
-		.material = blue_mat
-					 });
-	scene.add_sphere(Sphere{
-		.pos = {0.f, 0.7f, -3.f},
-		.radius = 0.7f,
-		.material = glass_mat
-	});*/
-	// Sky sphere
-	scene.add_sphere(Sphere{
-		.pos = {0.f, 5000.f, 0.f},
-		.radius = 4000.f,
-		.material = {
-			.type = MaterialType::Lambertian,
-			.l = {
-				.reflectance = 0.f,
-				.albedo = {1.f, 1.f, 1.f},
-				.emissive = {.7f, .7f, .7f},
-			}
-		}
-	});
-
-	RandomDevice rd(5000);
-
-	auto random_ball = [rd = &rd]() -> Sphere {
-		auto random_mat = [rd = rd]() -> Material {
-			MaterialType mats[]{MaterialType::Lambertian, MaterialType::Dielectric, MaterialType::Metallic};
-			MaterialType selected_mat = (MaterialType)((u32)(rd->random_num() * 2.999));
-			if (selected_mat == MaterialType::Lambertian) {
-				return Material{
-					.type = MaterialType::Lambertian,
-					.l = {
-						.reflectance = rd->random_num(),
-						.albedo = {rd->random_num(), rd->random_num(), rd->random_num()},
-						.emissive = {rd->random_num() * 0.2f, rd->random_num() * 0.2f, rd->random_num() * 0.2f}
-					}
-				};
-			}
-			else if (selected_mat == MaterialType::Metallic) {
-				return Material{
-					.type = MaterialType::Metallic,
-					.m = {
-						.shininess = 0.5f + 0.5f * rd->random_num(),
-						.emissive = {0.f, 0.f, 0.f}
-					}
-				};
-			}
-			else if(selected_mat == MaterialType::Dielectric) {
-				return Material{
-					.type = MaterialType::Dielectric,
-					.d = {
-						.refractive_index = 1.3f,
-						.emissive = {0.f, 0.f, 0.f}
-					}
-				};
-			}
-			else {
-				throw;
-			}
-		};
-		number_t rad = .1f + rd->random_num() * .5f;
-
-		return Sphere{
-			.pos = Vec3{rd->random_num(-.1f, .1f), 1.f, rd->random_num(-.1f, .1f)}.normalize() * (100.f + rad) + Vec3{0.f, -100.f, 0.f},
-			.radius = rad,
-			.material = random_mat()
-		};
-	};
-	number_t cur_dist = 0.f;
-	for (u32 i = 0; i < ball_count; i++) {
-		auto ball = random_ball();
-		number_t ang = rd.random_num() * 3.14145f * 2.f;
-		cur_dist += rd.random_num() * 0.01;
-		ball.pos = Vec3{sin(ang) * cur_dist, 1.f, cos(ang) * cur_dist}.normalize() * (100.f + ball.radius) + Vec3{0.f, -100.f, 0.f};
-		scene.add_sphere(ball);
-	}
-
-}
-
 class Args {
 public:
 	Args(int argc, const char* argv[]) {
@@ -155,17 +38,259 @@ bool update_renderer_settings(Renderer& renderer, const Args& args) {
 			renderer.set_thread_count(::atoi(nthreads.c_str()));
 		}
 		else if (arg.substr(0, 2) == "-s") {
+			// -sN for a fixed count or -sMIN:MAX for adaptive sampling
 			std::string samplec = arg.substr(2);
-			renderer.set_samples(::atoi(samplec.c_str()));
+			auto sep = samplec.find(':');
+			renderer.set_samples(::atoi(samplec.substr(0, sep).c_str()));
+			renderer.set_max_samples(sep == std::string::npos ? 0 : ::atoi(samplec.substr(sep + 1).c_str()));
+		}
+		else if (arg.substr(0, 8) == "--noise=") {
+			std::string noise = arg.substr(8);
+			renderer.set_noise_threshold(::atof(noise.c_str()));
+		}
+		else if (arg.substr(0, 15) == "--target-noise=") {
+			std::string noise = arg.substr(15);
+			renderer.set_target_noise(::atof(noise.c_str()));
 		}
 		else if (arg.substr(0, 2) == "-b") {
 			std::string bouncec = arg.substr(2);
 			renderer.set_bounces(::atoi(bouncec.c_str()));
 		}
+		else if (arg.substr(0, 2) == "-p") {
+			std::string packetc = arg.substr(2);
+			renderer.set_packet_size(::atoi(packetc.c_str()));
+		}
+		else if (arg.substr(0, 7) == "--seed=") {
+			std::string seed = arg.substr(7);
+			renderer.set_seed(::atoi(seed.c_str()));
+		}
+		else if (arg.substr(0, 9) == "--engine=") {
+			std::string engine = arg.substr(9);
+			if (engine == "megakernel")
+				renderer.set_engine(RenderEngine::Megakernel);
+			else if (engine == "wavefront")
+				renderer.set_engine(RenderEngine::Wavefront);
+			else {
+				std::cerr << "Unknown engine: " << engine << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--no-light-sampling") {
+			renderer.set_light_sampling(false);
+		}
+		else if (arg.substr(0, 11) == "--roulette=") {
+			std::string depth = arg.substr(11);
+			renderer.set_roulette_depth(::atoi(depth.c_str()));
+		}
+		else if (arg.substr(0, 19) == "--min-contribution=") {
+			std::string contribution = arg.substr(19);
+			renderer.set_min_contribution((number_t)::atof(contribution.c_str()));
+		}
+		else if (arg.substr(0, 12) == "--intersect=") {
+			std::string mode = arg.substr(12);
+			if (mode == "march")
+				renderer.set_intersection_mode(IntersectionMode::SphereTracing);
+			else if (mode == "analytic")
+				renderer.set_intersection_mode(IntersectionMode::Analytic);
+			else {
+				std::cerr << "Unknown intersection mode: " << mode << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 13) == "--checkpoint=") {
+			renderer.set_checkpoint_path(arg.substr(13));
+		}
+		else if (arg.substr(0, 22) == "--checkpoint-interval=") {
+			std::string interval = arg.substr(22);
+			renderer.set_checkpoint_interval(::atoi(interval.c_str()));
+		}
+		else if (arg == "--resume") {
+			if (renderer.get_checkpoint_path().empty()) {
+				std::cerr << "--resume needs --checkpoint=FILE before it" << std::endl;
+				return false;
+			}
+			if (!renderer.resume(renderer.get_checkpoint_path())) {
+				std::cerr << "Failed to load checkpoint " << renderer.get_checkpoint_path() << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 13) == "--tile-order=") {
+			std::string order = arg.substr(13);
+			if (order == "rows")
+				renderer.set_tile_order(TileOrder::RowMajor);
+			else if (order == "cost")
+				renderer.set_tile_order(TileOrder::Cost);
+			else if (order == "hilbert")
+				renderer.set_tile_order(TileOrder::Hilbert);
+			else if (order == "spiral")
+				renderer.set_tile_order(TileOrder::Spiral);
+			else {
+				std::cerr << "Unknown tile order: " << order << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 12) == "--tile-size=") {
+			std::string size = arg.substr(12);
+			renderer.set_tile_size(::atoi(size.c_str()));
+		}
+		else if (arg == "--no-tail-split") {
+			renderer.set_split_tail(false);
+		}
+		else if (arg.substr(0, 7) == "--cost=") {
+#if defined(PATHTRACER_STATS)
+			std::string metric = arg.substr(7);
+			if (metric == "steps")
+				renderer.set_cost_metric(CostMetric::Steps);
+			else if (metric == "time")
+				renderer.set_cost_metric(CostMetric::Time);
+			else {
+				std::cerr << "Unknown cost metric: " << metric << std::endl;
+				return false;
+			}
+#else
+			std::cerr << "--cost needs a build with PATHTRACER_STATS" << std::endl;
+			return false;
+#endif
+		}
 		else if (arg == "-h") {
 			std::cout << "-jN [N threads]" << std::endl;
 			std::cout << "-sN [N samples]" << std::endl;
+			std::cout << "-sMIN:MAX [adaptive sampling between MIN and MAX samples]" << std::endl;
+			std::cout << "--noise=T [adaptive sampling stops once relative noise is below T, default 0.05]" << std::endl;
+			std::cout << "--progressive [render in passes of 1, 2, 4, ... samples up to -s]" << std::endl;
+			std::cout << "--target-noise=T [stop the progressive passes once the image's RMS relative noise is below T]" << std::endl;
+			std::cout << "--preview=FILE [progressive render that writes FILE every --preview-interval=S seconds, default 1]" << std::endl;
 			std::cout << "-bN [N bounces]" << std::endl;
+			std::cout << "-nN [N balls]" << std::endl;
+			std::cout << "-pN [trace primary rays in packets of N = 4, 8 or 16]" << std::endl;
+			std::cout << "--accel=bvh|linear [scene acceleration structure]" << std::endl;
+			std::cout << "--intersect=march|analytic [sphere tracing or closed form ray/sphere hits]" << std::endl;
+			std::cout << "--seed=N [base seed of the per pixel samplers]" << std::endl;
+			std::cout << "--engine=megakernel|wavefront [per path loop or batched, material sorted stages]" << std::endl;
+			std::cout << "--no-light-sampling [find lights only by bouncing into them, no shadow rays]" << std::endl;
+			std::cout << "--roulette=N [russian roulette on path throughput after N bounces, off by default]" << std::endl;
+			std::cout << "--min-contribution=T [stop paths that could add less light than T, default 1e-6, 0 never stops them]" << std::endl;
+			std::cout << "--checkpoint=FILE [periodically save the accumulated samples to FILE]" << std::endl;
+			std::cout << "--checkpoint-interval=N [seconds between checkpoints, default 60]" << std::endl;
+			std::cout << "--resume [continue from the --checkpoint file, adding the missing samples]" << std::endl;
+			std::cout << "--scene=FILE [load a .scene text or .sceneb binary scene instead of the demo scene]" << std::endl;
+			std::cout << "--output=FILE [render/rt.ppm, format from the extension: .ppm, .pfm or .png]" << std::endl;
+			std::cout << "--size=WxH [image size, default 1024x1024]" << std::endl;
+			std::cout << "--stream [write finished strips of tiles straight to a .ppm or .png output instead of holding the image]" << std::endl;
+			std::cout << "--compare=FILE [print the error against a .ppm or .pfm reference render]" << std::endl;
+			std::cout << "--tile-order=rows|cost|hilbert|spiral [tile dispatch order, cost runs a cheap pre-pass to estimate tile times]" << std::endl;
+			std::cout << "--tile-size=N [tile edge in pixels, default 64]" << std::endl;
+			std::cout << "--no-tail-split [do not quarter the last tiles for idle workers]" << std::endl;
+			std::cout << "--trace=FILE [write a Chrome trace of the tiles each worker rendered and its idle time to FILE]" << std::endl;
+			std::cout << "--cost=steps|time [write the march steps or nanoseconds per pixel to OUTPUT_cost.pfm, needs PATHTRACER_STATS]" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+struct SceneSettings {
+	u32 ball_count = 4;
+	SceneAccelerator accelerator = SceneAccelerator::BVH;
+	// Loaded instead of the generated demo scene when set
+	std::string path;
+};
+
+bool update_scene_settings(SceneSettings& settings, const Args& args) {
+	for (const auto& arg : args) {
+		if (arg.substr(0, 2) == "-n") {
+			std::string ballc = arg.substr(2);
+			settings.ball_count = ::atoi(ballc.c_str());
+		}
+		else if (arg.substr(0, 8) == "--scene=") {
+			settings.path = arg.substr(8);
+			if (scene_format_from_path(settings.path) == SceneFormat::Unknown) {
+				std::cerr << "Unknown scene format: " << settings.path << " (use .scene or .sceneb)" << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 8) == "--accel=") {
+			std::string accel = arg.substr(8);
+			if (accel == "bvh")
+				settings.accelerator = SceneAccelerator::BVH;
+			else if (accel == "linear")
+				settings.accelerator = SceneAccelerator::Linear;
+			else {
+				std::cerr << "Unknown accelerator: " << accel << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+struct OutputSettings {
+	std::string path = "render/rt.ppm";
+	// Reference image the render is compared against, e.g. a double precision render of the same scene
+	std::string compare;
+	// Chrome trace of the render's tiles and scheduler idle time
+	std::string trace;
+	// Render in passes of increasing sample counts, optionally writing previews in between
+	bool progressive = false;
+	std::string preview;
+	double preview_interval = 1.0;
+	u32 width = 1024, height = 1024;
+	// Write finished strips of tiles straight to the output instead of holding the image
+	bool stream = false;
+};
+
+bool update_output_settings(OutputSettings& settings, const Args& args) {
+	for (const auto& arg : args) {
+		if (arg.substr(0, 9) == "--output=") {
+			settings.path = arg.substr(9);
+			if (image_format_from_path(settings.path) == ImageFormat::Unknown) {
+				std::cerr << "Unknown image format: " << settings.path << " (use .ppm, .pfm or .png)" << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 10) == "--compare=") {
+			settings.compare = arg.substr(10);
+		}
+		else if (arg.substr(0, 8) == "--trace=") {
+			settings.trace = arg.substr(8);
+		}
+		else if (arg.substr(0, 7) == "--size=") {
+			std::string size = arg.substr(7);
+			auto sep = size.find('x');
+			settings.width = ::atoi(size.substr(0, sep).c_str());
+			settings.height = sep == std::string::npos ? 0 : ::atoi(size.substr(sep + 1).c_str());
+			if (settings.width == 0 || settings.height == 0) {
+				std::cerr << "Bad size: " << size << " (use WxH)" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--stream") {
+			settings.stream = true;
+		}
+		else if (arg == "--progressive") {
+			settings.progressive = true;
+		}
+		else if (arg.substr(0, 10) == "--preview=") {
+			settings.preview = arg.substr(10);
+			settings.progressive = true;
+			if (image_format_from_path(settings.preview) == ImageFormat::Unknown) {
+				std::cerr << "Unknown image format: " << settings.preview << " (use .ppm, .pfm or .png)" << std::endl;
+				return false;
+			}
+		}
+		else if (arg.substr(0, 19) == "--preview-interval=") {
+			std::string interval = arg.substr(19);
+			settings.preview_interval = std::max(::atof(interval.c_str()), 0.01);
+		}
+	}
+	if (settings.stream) {
+		ImageFormat format = image_format_from_path(settings.path);
+		if (format != ImageFormat::PPM && format != ImageFormat::PNG) {
+			std::cerr << "--stream writes .ppm or .png" << std::endl;
+			return false;
+		}
+		if (settings.progressive || (!settings.compare.empty() && format != ImageFormat::PPM)) {
+			std::cerr << "--stream can not be combined with progressive rendering, or --compare with a .png output" << std::endl;
 			return false;
 		}
 	}
@@ -175,9 +300,37 @@ bool update_renderer_settings(Renderer& renderer, const Args& args) {
 int main(int argc, const char* argv[]) {
 	Args args(argc, argv);
 
+	SceneSettings scene_settings;
+	if (!update_scene_settings(scene_settings, args))
+		return -1;
+	OutputSettings output_settings;
+	if (!update_output_settings(output_settings, args))
+		return -1;
+
 	Scene scene;
-	generate_scene_1(scene, 4);
+	if (scene_settings.path.empty())
+		generate_scene_1(scene, scene_settings.ball_count);
+	else {
+		auto load_start = std::chrono::high_resolution_clock::now();
+		if (!load_scene(scene_settings.path, scene)) {
+			std::cerr << "Failed to load scene " << scene_settings.path << std::endl;
+			return -1;
+		}
+		auto load_end = std::chrono::high_resolution_clock::now();
+		double load_ms = std::chrono::duration<double, std::milli>(load_end - load_start).count();
+		std::cerr << "Loaded " << scene_settings.path << " in " << load_ms << "ms, "
+			<< load_ms / std::max(scene.sphere_count() / 1e6, 1e-6) << "ms per million spheres" << std::endl;
+	}
+	scene.set_accelerator(scene_settings.accelerator);
+
+	auto build_start = std::chrono::high_resolution_clock::now();
+	scene.build();
+	auto build_end = std::chrono::high_resolution_clock::now();
+	std::cerr << "Scene: " << scene.sphere_count() << " spheres, " << scene.bvh_node_count() << " bvh nodes, built in "
+		<< std::chrono::duration<double, std::milli>(build_end - build_start).count() << "ms" << std::endl;
 	
+	// Declared before the renderer so it outlives the workers recording into it
+	std::unique_ptr<Tracer> tracer;
 	Renderer renderer;
 	renderer.set_thread_count(std::thread::hardware_concurrency() - 1);
 	renderer.set_samples(10);
@@ -185,24 +338,119 @@ int main(int argc, const char* argv[]) {
 	renderer.set_max_path_steps(300);
 	renderer.set_epsilon(0.000001);
 
-	u32 w = 1024, h = 1024;
+	u32 w = output_settings.width, h = output_settings.height;
 
-	Image render_target(w, h);
+	// A streamed render never holds the image
+	Image render_target(output_settings.stream ? 0 : w, output_settings.stream ? 0 : h);
 
 	Camera cam;
-	cam.set_focal_distance(50.f);
-	cam.set_position({ 0.f, 50.f, -150.f });
-	cam.set_rotation(3.1415 / 10, 0.f, 0.f);
+	setup_camera_1(cam);
 
 	if (!update_renderer_settings(renderer, args))
 		return -1;
+	const AccumulationBuffer& resumed = renderer.get_accumulation();
+	if (!resumed.empty() && (resumed.width() != w || resumed.height() != h)) {
+		std::cerr << "Checkpoint is " << resumed.width() << "x" << resumed.height() << ", render is " << w << "x" << h << std::endl;
+		return -1;
+	}
 
-	std::cerr << "total min: " << renderer.get_samples() * render_target.width() * render_target.height() << std::endl;
-	std::cerr << "total max: " << renderer.get_bounces() * renderer.get_samples() * render_target.width() * render_target.height() << std::endl;
+	if (!output_settings.trace.empty()) {
+		tracer = std::make_unique<Tracer>(std::max<u32>(renderer.get_thread_count(), 1));
+		renderer.set_tracer(tracer.get());
+	}
 
-	renderer.render_mt(scene, cam, render_target);
+	if (output_settings.stream && (!renderer.get_checkpoint_path().empty() || !resumed.empty())) {
+		std::cerr << "--stream does not keep the samples a checkpoint needs" << std::endl;
+		return -1;
+	}
+#if defined(PATHTRACER_STATS)
+	if (output_settings.stream && renderer.get_cost_metric() != CostMetric::None) {
+		std::cerr << "--stream does not record a cost image" << std::endl;
+		return -1;
+	}
+#endif
+
+	std::cerr << "total min: " << (u64)renderer.get_samples() * w * h << std::endl;
+	std::cerr << "total max: " << (u64)renderer.get_bounces() * renderer.get_samples() * w * h << std::endl;
+
+	auto render_start = std::chrono::high_resolution_clock::now();
+	if (output_settings.progressive) {
+		std::unique_ptr<PreviewWriter> preview;
+		if (!output_settings.preview.empty())
+			preview = std::make_unique<PreviewWriter>(renderer.get_accumulation(), output_settings.preview, output_settings.preview_interval);
+		renderer.render_progressive(scene, cam, render_target, [&](u32, number_t) {
+			if (preview)
+				preview->pass_done();
+		});
+		if (preview)
+			std::cerr << "First preview after " << preview->first_preview_seconds() << "s, " << preview->written() << " previews" << std::endl;
+	}
+	else if (output_settings.stream) {
+		auto writer = StripWriter::open(output_settings.path, w, h);
+		if (!writer || !renderer.render_streamed(scene, cam, w, h, [&](u32, u32 rows, const u8* rgb) { return writer->write_strip(rgb, rows); })
+			|| !writer->close()) {
+			std::cerr << "Failed to write " << output_settings.path << std::endl;
+			return -1;
+		}
+	}
+	else
+		renderer.render_mt(scene, cam, render_target);
+	auto render_end = std::chrono::high_resolution_clock::now();
+	double render_seconds = std::chrono::duration<double>(render_end - render_start).count();
+	std::cerr << "Rendered " << (double)w * h / 1e6 << " MP in " << render_seconds << "s, " << (double)w * h / 1e6 / render_seconds
+		<< " MP/s, peak RSS " << peak_rss_bytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+
+	if (tracer) {
+		if (!tracer->write_json(output_settings.trace)) {
+			std::cerr << "Failed to write " << output_settings.trace << std::endl;
+			return -1;
+		}
+		std::cerr << "Wrote " << output_settings.trace << ", " << tracer->event_count() << " events";
+		if (tracer->dropped() > 0)
+			std::cerr << ", " << tracer->dropped() << " overwritten";
+		std::cerr << std::endl;
+	}
+
+	if (!output_settings.stream) {
+		auto write_start = std::chrono::high_resolution_clock::now();
+		if (!write_image(output_settings.path, render_target, &renderer.scheduler())) {
+			std::cerr << "Failed to write " << output_settings.path << std::endl;
+			return -1;
+		}
+		auto write_end = std::chrono::high_resolution_clock::now();
+		std::cerr << "Wrote " << output_settings.path << " in "
+			<< std::chrono::duration<double, std::milli>(write_end - write_start).count() << "ms, peak RSS "
+			<< peak_rss_bytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+	}
+
+#if defined(PATHTRACER_STATS)
+	if (renderer.get_cost_metric() != CostMetric::None) {
+		// Next to the render, pfm keeps the raw counts
+		std::string cost_path = output_settings.path.substr(0, output_settings.path.find_last_of('.')) + "_cost.pfm";
+		if (!write_image(cost_path, renderer.get_cost_image())) {
+			std::cerr << "Failed to write " << cost_path << std::endl;
+			return -1;
+		}
+		std::cerr << "Wrote " << cost_path << std::endl;
+	}
+#endif
+
+	if (!output_settings.compare.empty()) {
+		Image reference(1, 1);
+		if (!read_image(output_settings.compare, reference) || reference.width() != w || reference.height() != h) {
+			std::cerr << "Failed to read a " << w << "x" << h << " reference from " << output_settings.compare << std::endl;
+			return -1;
+		}
+		// Compare what was written, so an 8 bit output is compared after quantization
+		Image written(1, 1);
+		const Image* result = &render_target;
+		if (image_format_from_path(output_settings.path) != ImageFormat::PNG && read_image(output_settings.path, written))
+			result = &written;
+		ImageDiff diff = image_diff(*result, reference);
+		std::cout << "precision=" << (sizeof(number_t) == 4 ? "f32" : "f64")
+			<< " render_ms=" << std::chrono::duration<double, std::milli>(render_end - render_start).count()
+			<< " rmse=" << diff.rmse << " psnr=" << diff.psnr << "dB max_error=" << diff.max_error << std::endl;
+	}
 
-	write_ppm("render/rt.ppm", render_target);
-	
 	return 0;
 }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "math.h"
+#include "simd.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PATHTRACER_MMAP 1
+#endif
+
+/*
+Read only view of a whole file. Mapped where the platform supports it, so
+pages are only read in when touched, otherwise read into a cache line
+aligned buffer. The data is at least 64 byte aligned either way.
+*/
+class MappedFile {
+public:
+	// Returns nullptr if the file can not be opened
+	static std::shared_ptr<MappedFile> open(const std::string& filepath) {
+		auto file = std::shared_ptr<MappedFile>(new MappedFile());
+#if defined(PATHTRACER_MMAP)
+		int fd = ::open(filepath.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return nullptr;
+		}
+		file->length = (size_t)st.st_size;
+		if (file->length > 0) {
+			void* map = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				close(fd);
+				return nullptr;
+			}
+			file->map = (const u8*)map;
+		}
+		close(fd);
+#else
+		std::ifstream fs(filepath, std::ios::binary | std::ios::ate);
+		if (!fs)
+			return nullptr;
+		file->length = (size_t)fs.tellg();
+		file->buffer.resize(file->length);
+		fs.seekg(0);
+		if (!fs.read((char*)file->buffer.data(), file->length))
+			return nullptr;
+		file->map = file->buffer.data();
+#endif
+		return file;
+	}
+	~MappedFile() {
+#if defined(PATHTRACER_MMAP)
+		if (map)
+			munmap((void*)map, length);
+#endif
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const u8* data() const { return map; }
+	size_t size() const { return length; }
+private:
+	MappedFile() = default;
+
+	const u8* map = nullptr;
+	size_t length = 0;
+#if !defined(PATHTRACER_MMAP)
+	std::vector<u8, AlignedAllocator<u8>> buffer;
+#endif
+};
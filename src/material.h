@@ -2,6 +2,8 @@
 
 #include "math.h"
 
+#include <functional>
+
 enum struct MaterialType {
 	Lambertian,
 	Metallic,
@@ -35,3 +37,52 @@ struct Material {
 	};
 };
 
+// Light emitted by a surface of this material
+Vec3 material_emissive(const Material& m) {
+	switch (m.type) {
+	case MaterialType::Lambertian: return m.l.emissive;
+	case MaterialType::Metallic: return m.m.emissive;
+	case MaterialType::Dielectric: return m.d.emissive;
+	}
+	return Vec3{ 0.f, 0.f, 0.f };
+}
+
+// Compares the type and the fields of the active member only
+bool operator==(const Material& a, const Material& b) {
+	if (a.type != b.type)
+		return false;
+	auto eq = [](const Vec3& u, const Vec3& v) { return u.x == v.x && u.y == v.y && u.z == v.z; };
+	switch (a.type) {
+	case MaterialType::Lambertian:
+		return a.l.reflectance == b.l.reflectance && eq(a.l.albedo, b.l.albedo) && eq(a.l.emissive, b.l.emissive);
+	case MaterialType::Metallic:
+		return a.m.shininess == b.m.shininess && eq(a.m.emissive, b.m.emissive);
+	case MaterialType::Dielectric:
+		return a.d.refractive_index == b.d.refractive_index && eq(a.d.emissive, b.d.emissive);
+	}
+	return false;
+}
+
+struct MaterialHash {
+	size_t operator()(const Material& m) const {
+		auto mix = [](size_t h, number_t v) { return h * 31 + std::hash<number_t>{}(v); };
+		size_t h = (size_t)m.type;
+		switch (m.type) {
+		case MaterialType::Lambertian:
+			h = mix(h, m.l.reflectance);
+			for (number_t v : { m.l.albedo.x, m.l.albedo.y, m.l.albedo.z, m.l.emissive.x, m.l.emissive.y, m.l.emissive.z })
+				h = mix(h, v);
+			break;
+		case MaterialType::Metallic:
+			for (number_t v : { m.m.shininess, m.m.emissive.x, m.m.emissive.y, m.m.emissive.z })
+				h = mix(h, v);
+			break;
+		case MaterialType::Dielectric:
+			for (number_t v : { m.d.refractive_index, m.d.emissive.x, m.d.emissive.y, m.d.emissive.z })
+				h = mix(h, v);
+			break;
+		}
+		return h;
+	}
+};
+
@@ -3,19 +3,27 @@
 #include <stdint.h>
 #include <cmath>
 #include <random>
-#include <intrin.h>
+#include <limits>
 
 using u8 = uint8_t;
 using u16 = uint16_t;
 using u32 = uint32_t;
+using u64 = uint64_t;
 using i32 = int32_t;
+// Scalar precision of the whole renderer, the float build trades accuracy for twice the SIMD lanes
+#if defined(PATHTRACER_FLOAT)
+using number_t = float;
+#else
 using number_t = double;
+#endif
+
+const number_t PI = (number_t)3.14159265358979323846;
 
 struct Vec3 {
 	number_t x, y, z;
 
 	Vec3 normalize() const {
-		number_t len = sqrt(x * x + y * y + z * z);
+		number_t len = std::sqrt(x * x + y * y + z * z);
 		return Vec3{ x / len, y / len, z / len };
 	}
 	Vec3 operator-() {
@@ -39,6 +47,10 @@ number_t dot(Vec3 a, Vec3 b) {
 	return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
+Vec3 cross(const Vec3& a, const Vec3& b) {
+	return Vec3{ a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
 number_t clamp(number_t val, number_t min, number_t max) {
 	if (val < min)
 		return min;
@@ -51,13 +63,24 @@ number_t distance(const Vec3& a, const Vec3& b) {
 	number_t abx = (a.x - b.x);
 	number_t aby = (a.y - b.y);
 	number_t abz = (a.z - b.z);
-	return sqrt(abx * abx + aby * aby + abz * abz);
+	return std::sqrt(abx * abx + aby * aby + abz * abz);
 }
 
 number_t max(number_t a, number_t b, number_t c) {
 	return std::max(a, std::max(b, c));
 }
 
+/*
+Self intersection epsilon for rays leaving 'p'. A fixed epsilon is smaller
+than the rounding error of hit points far from the origin, especially in
+float, so it is raised to a few ulps of the largest coordinate there.
+*/
+number_t robust_epsilon(const Vec3& p, number_t eps) {
+	const number_t ULPS = 64;
+	number_t scale = max(std::abs(p.x), std::abs(p.y), std::abs(p.z));
+	return std::max(eps, scale * ULPS * std::numeric_limits<number_t>::epsilon());
+}
+
 class Ray {
 public:
 	Ray(Vec3 origin, Vec3 dir)
@@ -82,7 +105,7 @@ private:
 };
 
 Vec3 sqrt(Vec3 v) {
-	return Vec3{ sqrt(v.x), sqrt(v.y), sqrt(v.z) };
+	return Vec3{ std::sqrt(v.x), std::sqrt(v.y), std::sqrt(v.z) };
 }
 
 
@@ -91,11 +114,11 @@ Vec3 reflect(const Vec3& v, const Vec3& n) {
 }
 
 Vec3 refract(const Vec3& v, const Vec3& n, number_t eta) {
-	number_t k = 1.0 - eta * eta * (1.0 - dot(n, v) * dot(n, v));
-    if (k < 0.0)
+	number_t k = 1.f - eta * eta * (1.f - dot(n, v) * dot(n, v));
+    if (k < 0.f)
 		return Vec3{0.f, 0.f, 0.f};
     else
-        return v * eta - n * (eta * dot(n, v) + sqrt(k));
+        return v * eta - n * (eta * dot(n, v) + std::sqrt(k));
 }
 
 Vec3 lerp(const Vec3& a, const Vec3& b, number_t t) {
@@ -138,45 +161,30 @@ private:
 	std::uniform_int_distribution<u32> id;
 };
 
-number_t random_f32(number_t min = 0.f, number_t max = 1.f) {
-	return min + ((number_t)rand() / (number_t)RAND_MAX) * (max - min);
-}
-
-Vec3 random_vec3(number_t min, number_t max) {
-	return Vec3{ random_f32(min,max),random_f32(min,max),random_f32(min,max) };
-}
-
 number_t square_length(const Vec3& v) {
 	return v.x * v.x + v.y * v.y + v.z * v.z;
 }
 
-Vec3 random_in_unit_sphere() {
-	while (true) {
-		Vec3 r = random_vec3(-1.f, 1.f);
-		if (square_length(r) < 1.f) return r;
-	}
-}
-
 Vec3 rotate_z(Vec3 p, number_t ang) {
 	return Vec3{
-		p.x * cos(ang) - p.y * sin(ang),
-		p.x * sin(ang) + p.y * cos(ang),
+		p.x * std::cos(ang) - p.y * std::sin(ang),
+		p.x * std::sin(ang) + p.y * std::cos(ang),
 		p.z
 	};
 }
 
 Vec3 rotate_y(Vec3 p, number_t ang) {
 	return Vec3{
-		p.x * cos(ang) + p.z * sin(ang),
+		p.x * std::cos(ang) + p.z * std::sin(ang),
 		p.y,
-		-p.x * sin(ang) + p.z * cos(ang)
+		-p.x * std::sin(ang) + p.z * std::cos(ang)
 	};
 }
 
 Vec3 rotate_x(Vec3 p, number_t ang) {
 	return Vec3{
 		p.x,
-		p.y * cos(ang) - p.z * sin(ang),
-		p.y * sin(ang) + p.z * cos(ang)
+		p.y * std::cos(ang) - p.z * std::sin(ang),
+		p.y * std::sin(ang) + p.z * std::cos(ang)
 	};
 }
\ No newline at end of file
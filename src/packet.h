@@ -0,0 +1,56 @@
+#pragma once
+
+#include "math.h"
+
+#include <bit>
+
+/*
+A bundle of N rays stored lane by lane so per lane loops vectorize.
+Bit l of 'active' is set when lane l carries a ray.
+*/
+template<u32 N>
+struct RayPacket {
+	static_assert(N > 0 && N <= 32, "packet lanes are tracked in a 32 bit mask");
+	static constexpr u32 size = N;
+
+	number_t ox[N], oy[N], oz[N];
+	number_t dx[N], dy[N], dz[N];
+	u32 active = 0;
+
+	void set(u32 lane, const Ray& r) {
+		Vec3 o = r.origin(), d = r.direction();
+		ox[lane] = o.x; oy[lane] = o.y; oz[lane] = o.z;
+		dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+		active |= 1u << lane;
+	}
+	Vec3 origin(u32 lane) const {
+		return Vec3{ ox[lane], oy[lane], oz[lane] };
+	}
+	Vec3 direction(u32 lane) const {
+		return Vec3{ dx[lane], dy[lane], dz[lane] };
+	}
+	// Same ray as was set, the direction is not normalized a second time
+	Ray get(u32 lane) const {
+		Ray r(origin(lane), direction(lane));
+		r.set_direction(direction(lane));
+		return r;
+	}
+	// Matches Ray::advance so a lane follows exactly the same steps as a single ray
+	void advance(u32 lane, number_t distance) {
+		Vec3 d = direction(lane);
+		Vec3 o = origin(lane) + d * distance;
+		d = d.normalize();
+		ox[lane] = o.x; oy[lane] = o.y; oz[lane] = o.z;
+		dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+	}
+};
+
+// Iterates the set bits of a lane mask
+template<typename F>
+void for_each_lane(u32 mask, F&& f) {
+	while (mask) {
+		u32 lane = (u32)std::countr_zero(mask);
+		f(lane);
+		mask &= mask - 1;
+	}
+}
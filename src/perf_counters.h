@@ -0,0 +1,139 @@
+#pragma once
+
+#include "math.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include <cstdio>
+
+/*
+Hardware event counters for the benchmarks (Linux perf_event_open).
+
+Counters follow threads created after start(), but events of a thread are
+only added to the totals once it exits, so stop the workers (destroy the
+Renderer) before calling stop(). Where the kernel refuses access every
+counter reports as unavailable.
+*/
+class PerfCounters {
+public:
+	enum struct Event {
+		Instructions,
+		Branches,
+		BranchMisses,
+		CacheReferences,
+		CacheMisses,
+		Count
+	};
+
+	PerfCounters() {
+#if defined(__linux__)
+		const u64 configs[] = {
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_REFERENCES,
+			PERF_COUNT_HW_CACHE_MISSES
+		};
+		for (u32 i = 0; i < EVENT_COUNT; i++) {
+			perf_event_attr attr{};
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	}
+	~PerfCounters() {
+#if defined(__linux__)
+		for (int fd : fds)
+			if (fd >= 0)
+				close(fd);
+#endif
+	}
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	void start() {
+#if defined(__linux__)
+		for (int fd : fds) {
+			if (fd < 0)
+				continue;
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+	void stop() {
+#if defined(__linux__)
+		for (u32 i = 0; i < EVENT_COUNT; i++) {
+			values[i] = 0;
+			if (fds[i] < 0)
+				continue;
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fds[i], &values[i], sizeof(u64)) != sizeof(u64))
+				values[i] = 0;
+		}
+#endif
+	}
+	bool available(Event e) const { return fds[(u32)e] >= 0; }
+	u64 value(Event e) const { return values[(u32)e]; }
+private:
+	static constexpr u32 EVENT_COUNT = (u32)Event::Count;
+	int fds[EVENT_COUNT]{ -1, -1, -1, -1, -1 };
+	u64 values[EVENT_COUNT]{};
+};
+
+/*
+Peak resident set size of the process in bytes, 0 where unknown. On Linux
+reset_peak_rss() lowers the peak to the current size (kernel 4.0 and
+later) so one process can measure several phases, elsewhere the peak only
+grows.
+*/
+u64 peak_rss_bytes() {
+#if defined(__linux__)
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f) {
+		char line[256];
+		unsigned long long kb = 0;
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "VmHWM: %llu kB", &kb) == 1)
+				break;
+		fclose(f);
+		if (kb)
+			return (u64)kb * 1024;
+	}
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+	rusage usage{};
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+		return (u64)usage.ru_maxrss;
+#else
+		return (u64)usage.ru_maxrss * 1024;
+#endif
+	}
+#endif
+	return 0;
+}
+
+void reset_peak_rss() {
+#if defined(__linux__)
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if (f) {
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "math.h"
+#include "image.h"
+#include "image_io.h"
+#include "accumulator.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+/*
+Writes preview images of a progressive render from its own thread.
+
+Every interval the writer copies the accumulation buffer, resolves it and
+writes it to a temporary file that then replaces the preview, so a viewer
+never sees a half written image. Workers only wait for the copy, which
+holds the buffer's commit lock; resolving and encoding happen off it.
+The first preview is written as soon as the first pass is done, before
+that the buffer may still be resized.
+*/
+class PreviewWriter {
+public:
+	PreviewWriter(const AccumulationBuffer& buffer, const std::string& filepath, double interval_seconds)
+		: buffer(buffer), path(filepath), interval(interval_seconds), start(std::chrono::steady_clock::now()) {
+		thread = std::thread([this]() { run(); });
+	}
+	~PreviewWriter() {
+		{
+			std::lock_guard l(mutex);
+			terminate = true;
+		}
+		cv.notify_all();
+		thread.join();
+	}
+	PreviewWriter(const PreviewWriter&) = delete;
+	PreviewWriter& operator=(const PreviewWriter&) = delete;
+
+	// Called after every pass, the first one triggers a preview right away
+	void pass_done() {
+		{
+			std::lock_guard l(mutex);
+			if (!started)
+				pending = true;
+			started = true;
+		}
+		cv.notify_all();
+	}
+
+	u32 written() const {
+		std::lock_guard l(mutex);
+		return write_count;
+	}
+	// Seconds from construction to the first preview on disk, negative if none was written
+	double first_preview_seconds() const {
+		std::lock_guard l(mutex);
+		return first_seconds;
+	}
+private:
+	void run() {
+		std::vector<PixelAccumulator> pixels;
+		std::unique_lock l(mutex);
+		while (true) {
+			if (started)
+				cv.wait_for(l, std::chrono::duration<double>(interval), [this]() { return terminate || pending; });
+			else
+				cv.wait(l, [this]() { return terminate || started; });
+			if (terminate)
+				return;
+			if (!started)
+				continue;
+			pending = false;
+			l.unlock();
+			u32 w = buffer.width(), h = buffer.height();
+			pixels.resize((size_t)w * h);
+			buffer.snapshot(pixels.data());
+			Image img(w, h);
+			for (u32 y = 0; y < h; y++)
+				for (u32 x = 0; x < w; x++)
+					img.get(x, y) = sqrt(pixels[x + (size_t)y * w].mean());
+			auto dot = path.find_last_of('.');
+			std::string tmp_path = path.substr(0, dot) + ".tmp" + (dot == std::string::npos ? "" : path.substr(dot));
+			bool ok = write_image(tmp_path, img) && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+			if (!ok)
+				std::cerr << "Failed to write preview " << path << std::endl;
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			l.lock();
+			if (ok && write_count++ == 0)
+				first_seconds = seconds;
+		}
+	}
+
+	const AccumulationBuffer& buffer;
+	std::string path;
+	double interval;
+	std::chrono::steady_clock::time_point start;
+	std::thread thread;
+	mutable std::mutex mutex;
+	std::condition_variable cv;
+	bool started = false;
+	bool pending = false;
+	bool terminate = false;
+	u32 write_count = 0;
+	double first_seconds = -1.0;
+};
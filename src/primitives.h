@@ -6,10 +6,42 @@
 struct Sphere {
 	Vec3 pos;
 	number_t radius;
-	Material material;
+	// Index into the material table of the scene the sphere belongs to
+	u32 material;
 };
 
 
 number_t distance(const Sphere& sphere, Vec3 p) {
 	return ::distance(p, sphere.pos) - sphere.radius;
-}
\ No newline at end of file
+}
+
+// Closest ray parameter t >= t_min where the ray hits the sphere surface, dir must be normalized
+bool intersect_sphere(const Vec3& center, number_t radius, const Vec3& origin, const Vec3& dir, number_t t_min, number_t& t) {
+	Vec3 oc = origin - center;
+	number_t b = dot(oc, dir);
+	number_t c = dot(oc, oc) - radius * radius;
+	number_t disc = b * b - c;
+	if (disc < 0.f)
+		return false;
+	number_t sq = std::sqrt(disc);
+	number_t t0 = -b - sq;
+	if (t0 >= t_min) {
+		t = t0;
+		return true;
+	}
+	// Origin is inside the sphere, the exit point is the hit
+	number_t t1 = -b + sq;
+	if (t1 >= t_min) {
+		t = t1;
+		return true;
+	}
+	return false;
+}
+
+bool intersect(const Sphere& sphere, const Vec3& origin, const Vec3& dir, number_t t_min, number_t& t) {
+	return intersect_sphere(sphere.pos, sphere.radius, origin, dir, t_min, t);
+}
+
+bool intersect(const Sphere& sphere, const Ray& r, number_t t_min, number_t& t) {
+	return intersect(sphere, r.origin(), r.direction(), t_min, t);
+}
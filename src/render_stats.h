@@ -0,0 +1,128 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <chrono>
+
+/*
+Render statistics, compiled in with PATHTRACER_STATS. Workers count into
+their own thread local RenderStats without any synchronization and
+render_mt merges them once per tile. Without the define PATHTRACER_STAT
+expands to nothing, so the counters cost nothing.
+*/
+#if defined(PATHTRACER_STATS)
+#define PATHTRACER_STAT(...) __VA_ARGS__
+#else
+#define PATHTRACER_STAT(...)
+#endif
+
+struct RenderStats {
+	// Paths traced
+	u64 samples = 0;
+	// Primary and bounce rays, and the ones that left the scene
+	u64 rays = 0;
+	u64 misses = 0;
+	// Light samples of next event estimation, not counted in rays
+	u64 shadow_rays = 0;
+	// Distance queries made by sphere tracing and rays that used up the step limit
+	u64 march_steps = 0;
+	u64 max_step_misses = 0;
+	// Surface hits shaded, by MaterialType
+	u64 bounces[3] = {};
+	// Paths by the number of surfaces they hit, the last bucket also holds longer ones
+	static constexpr u32 DEPTH_BUCKETS = 32;
+	u64 path_depth[DEPTH_BUCKETS] = {};
+	// Paths Russian roulette stopped, and paths stopped because they could not add enough light
+	u64 roulette_stops = 0;
+	u64 bound_stops = 0;
+	// Most expensive tile of the render
+	u32 slowest_tile_x = 0, slowest_tile_y = 0;
+	double slowest_tile_ms = 0.0;
+
+	void merge(const RenderStats& o) {
+		samples += o.samples;
+		rays += o.rays;
+		misses += o.misses;
+		shadow_rays += o.shadow_rays;
+		march_steps += o.march_steps;
+		max_step_misses += o.max_step_misses;
+		for (u32 i = 0; i < 3; i++)
+			bounces[i] += o.bounces[i];
+		for (u32 i = 0; i < DEPTH_BUCKETS; i++)
+			path_depth[i] += o.path_depth[i];
+		roulette_stops += o.roulette_stops;
+		bound_stops += o.bound_stops;
+		if (o.slowest_tile_ms > slowest_tile_ms) {
+			slowest_tile_x = o.slowest_tile_x;
+			slowest_tile_y = o.slowest_tile_y;
+			slowest_tile_ms = o.slowest_tile_ms;
+		}
+	}
+	u64 total_bounces() const { return bounces[0] + bounces[1] + bounces[2]; }
+	// 'paths' paths that ended at 'depth'
+	void add_path_depth(i32 depth, u64 paths = 1) { path_depth[std::min<u32>((u32)depth, DEPTH_BUCKETS - 1)] += paths; }
+};
+
+// Counters of the calling thread
+RenderStats& thread_render_stats() {
+	thread_local RenderStats stats;
+	return stats;
+}
+
+void print_render_stats(const RenderStats& s, std::ostream& os) {
+	auto per = [](u64 a, u64 b) { return b ? (double)a / (double)b : 0.0; };
+	os << "Stats: " << s.samples << " samples, " << s.rays << " rays (" << per(s.rays, s.samples) << " per sample), "
+		<< s.misses << " misses, " << s.shadow_rays << " shadow rays\n";
+	os << "Stats: " << s.march_steps << " march steps (" << per(s.march_steps, s.rays) << " per ray), "
+		<< s.max_step_misses << " rays hit the step limit (" << per(s.max_step_misses, s.rays) * 100.0 << "%)\n";
+	os << "Stats: bounces lambertian " << s.bounces[(u32)MaterialType::Lambertian]
+		<< ", metallic " << s.bounces[(u32)MaterialType::Metallic]
+		<< ", dielectric " << s.bounces[(u32)MaterialType::Dielectric]
+		<< " (" << per(s.total_bounces(), s.samples) << " per sample)\n";
+	os << "Stats: " << s.roulette_stops << " paths stopped by russian roulette, " << s.bound_stops << " below the contribution threshold\n";
+	u64 paths = 0;
+	u32 deepest = 0;
+	for (u32 i = 0; i < RenderStats::DEPTH_BUCKETS; i++) {
+		paths += s.path_depth[i];
+		if (s.path_depth[i])
+			deepest = i;
+	}
+	os << "Stats: surfaces hit per path\n";
+	for (u32 i = 0; i <= deepest && paths; i++) {
+		double share = per(s.path_depth[i], paths);
+		os << "Stats: " << std::setw(3) << i << (i + 1 == RenderStats::DEPTH_BUCKETS ? "+" : " ") << std::setw(8) << std::fixed << std::setprecision(2)
+			<< share * 100.0 << "% " << std::string((size_t)(share * 50.0 + 0.5), '#') << "\n";
+		os.unsetf(std::ios::floatfield);
+		os << std::setprecision(6);
+	}
+	os << "Stats: slowest tile at " << s.slowest_tile_x << "," << s.slowest_tile_y << " took " << s.slowest_tile_ms << "ms\n";
+}
+
+// What the per pixel cost image records
+enum struct CostMetric {
+	None,
+	// March steps of all the pixel's samples
+	Steps,
+	// Nanoseconds spent on the pixel's samples
+	Time
+};
+
+// Counter and clock readings at the start of a pixel or tile
+struct CostProbe {
+	u64 steps;
+	std::chrono::steady_clock::time_point time;
+
+	static CostProbe now() {
+		return CostProbe{ thread_render_stats().march_steps, std::chrono::steady_clock::now() };
+	}
+	number_t cost(CostMetric metric) const {
+		if (metric == CostMetric::Steps)
+			return (number_t)(thread_render_stats().march_steps - steps);
+		return (number_t)std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - time).count();
+	}
+};
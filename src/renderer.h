@@ -3,12 +3,22 @@
 #include "scene.h"
 #include "camera.h"
 #include "image.h"
+#include "scheduler.h"
+#include "sampler.h"
+#include "packet.h"
+#include "shading.h"
+#include "wavefront.h"
+#include "accumulator.h"
+#include "checkpoint.h"
+#include "render_stats.h"
+#include "tile_order.h"
 
 #include <iostream>
 #include <thread>
-#include <mutex>
 #include <chrono>
+#include <memory>
 #include <functional>
+#include <deque>
 
 std::tuple<u32, u32, u32> hours_minutes_and_seconds(u32 seconds) {
 	u32 hrs = seconds / 3600;
@@ -27,82 +37,28 @@ std::string time_string(u32 seconds) {
 	return std::to_string(sec) + "s";
 }
 
-class ThreadPool {
-public:
-	using Task = std::function<void()>;
-
-	ThreadPool(u32 n = 7) {
-		terminate = false;
-		for (u32 i = 0; i < n; i++) {
-			threads.push_back(std::thread([this]() {
-				bool should_terminate = false;
-				do {
-					if (terminate) {
-						should_terminate = true;
-						break;
-					}
-
-					if (task_mutex.try_lock()) {
-						if (task_queue.size()) {
-							Task front_task = task_queue.front();
-							task_queue.erase(task_queue.begin());
-
-							task_mutex.unlock();
-
-							front_task();
-						}
-						else {
-							task_mutex.unlock();
-						}
-					}
+enum struct IntersectionMode {
+	// March the scene distance field, works for any primitive with a distance function
+	SphereTracing,
+	// Closed form ray/sphere hits
+	Analytic
+};
 
-				} while (!should_terminate);
-			}));
-		}
-	}
-	~ThreadPool() {
-		stop();
-	}
+enum struct RenderEngine {
+	// One loop per path that branches on the material at every bounce
+	Megakernel,
+	// Batched intersection and per material shading queues over a pool of paths
+	Wavefront
+};
 
-	void submit_task(Task&& t) {
-		std::lock_guard l(task_mutex);
-		task_queue.push_back(std::move(t));
-	}
-	bool is_done() const {
-		std::lock_guard l(task_mutex);
-		bool is_done = true;
-		for (auto& t : threads) {
-			is_done &= t.joinable();
-		}
-		is_done &= (task_queue.size() == 0);
-		return is_done;
-	}
-	void stop() {
-		{
-			std::lock_guard l(task_mutex);
-			terminate = true;
-			task_queue.clear();
-		}
-		{
-			for (auto& t : threads) {
-				t.join();
-			}
-		}
-		threads.clear();
-	}
-	u32 task_queue_size() const {
-		std::lock_guard l(task_mutex);
-		return (u32)task_queue.size();
-	}
-	u32 thread_count() const {
-		std::lock_guard l(task_mutex);
-		return threads.size();
-	}
-private:
-	mutable std::mutex task_mutex;
-	std::vector<Task> task_queue;
-	std::atomic<bool> terminate;
-	std::vector<std::thread> threads;
+// Passed to the progress callback after every finished tile
+struct RenderProgress {
+	// The tile's pixels are already resolved into the render target
+	TileRange tile;
+	u32 tiles_done;
+	u32 tiles_total;
+	// Since the tiles were dispatched
+	double seconds;
 };
 
 class Renderer {
@@ -131,71 +87,322 @@ public:
 				Vec3 col{ 0.f, 0.f, 0.f };
 				// For each sample generate a ray and add some randomness to it
 				for (u32 sample = 0; sample < samples; sample++) {
-					number_t u = x + random_f32();
-					number_t v = y + random_f32();
-					col = col + raycast_scene(scene, cam.get_ray(u, v, (number_t)w, (number_t)h, ar), bounces + 1);
+					Sampler sampler = Sampler::for_pixel(x, y, sample, seed);
+					number_t u = x + sampler.next();
+					number_t v = y + sampler.next();
+					col = col + raycast_scene(scene, cam.get_ray(u, v, (number_t)w, (number_t)h, ar), bounces + 1, sampler);
 				}
 				// Blend the samples together
 				rt.get(x, y) = sqrt(col * (1.f / samples));
 			}
 		}
 	}
-	void render_mt(const Scene& scene, const Camera& cam, Image& rt) {
+	/*
+	Renders until every pixel has 'samples' samples (or meets the adaptive
+	target). Samples already in the accumulation buffer from a resumed
+	checkpoint or a previous call with set_accumulate are kept, so only the
+	missing ones are traced. Any BasicImage format and layout can be the
+	render target.
+	*/
+	template<typename ImageT>
+	void render_mt(const Scene& scene, const Camera& cam, ImageT& rt) {
 		u32 w = rt.width(), h = rt.height();
-		number_t ar = (number_t)w / (number_t)h;
-		u32 last_completion = 0;
+		if (!accumulate || accumulation.width() != w || accumulation.height() != h)
+			accumulation.reset(w, h);
 
-		struct TaskInfo {
-			u32 x, y, w, h;
-		};
+		PATHTRACER_STAT(
+			render_stats = RenderStats{};
+			if (cost_metric != CostMetric::None)
+				cost_image = Image(w, h);
+		)
 
-		ThreadPool tp(num_threads);
-		u32 total_tasks = 0;
-		for (u32 y = 0; y < h; ) {
-			u32 cons_h = min<u32>(64, h - y);
-			for (u32 x = 0; x < w; ) {
-				u32 cons_w = min<u32>(64, w - x);
-				TaskInfo ti{
-					.x = x,
-					.y = y,
-					.w = cons_w,
-					.h = cons_h
+		TaskScheduler& tp = scheduler();
+		tp.set_tracer(tracer);
+		u32 tiles_x = (w + tile_size - 1) / tile_size;
+		u32 tiles_y = (h + tile_size - 1) / tile_size;
+		if (tile_order == TileOrder::Cost && tile_costs.size() != tiles_x * tiles_y)
+			estimate_tile_costs(scene, cam, w, h, tiles_x, tiles_y);
+		std::vector<u32> order = order_tiles(tiles_x, tiles_y, tile_order, tile_costs, tp.thread_count());
+
+		// Time spent rendering per grid tile, the cost order of the next frame
+		std::vector<std::atomic<u64>> tile_ns(order.size());
+		std::atomic<u64> busy_ns = 0;
+		std::atomic<u32> split_count = 0;
+		std::atomic<u64> total_samples = 0;
+		std::function<void(TileRange)> render_range = [&](TileRange ti) {
+			// Once fewer tiles are left than workers, quarter tiles so the idle ones can steal a part
+			const u32 MIN_SPLIT_SIZE = 16;
+			if (split_tail && ti.w >= 2 * MIN_SPLIT_SIZE && ti.h >= 2 * MIN_SPLIT_SIZE && tp.pending() < tp.thread_count()) {
+				split_count++;
+				u32 hw = ti.w / 2, hh = ti.h / 2;
+				TileRange quarters[4] = {
+					{ ti.x, ti.y, hw, hh },
+					{ ti.x + hw, ti.y, ti.w - hw, hh },
+					{ ti.x, ti.y + hh, hw, ti.h - hh },
+					{ ti.x + hw, ti.y + hh, ti.w - hw, ti.h - hh }
 				};
-				tp.submit_task([this, ti, w, h, sc = samples, cam = &cam, scene = &scene, rt = &rt, ar]() {
-					for (u32 i = 0; i < ti.w; i++) {
-						for (u32 k = 0; k < ti.h; k++) {
-							Vec3 col{ 0.f, 0.f, 0.f };
-							for (u32 s = 0; s < sc; s++) {
-								number_t u = ti.x + i + random_f32();
-								number_t v = ti.y + k + random_f32();
-								col = col + raycast_scene(*scene, cam->get_ray(u, v, (number_t)w, (number_t)h, ar), bounces + 1);
-							}
-							rt->get(ti.x + i, ti.y + k) = sqrt(col * (1.f / sc));
-						}
-					}
-				});
-				total_tasks += 1;
-				x += cons_w;
+				TaskGroup group;
+				tp.parallel_for(group, 4, [&](u32 i) { render_range(quarters[i]); });
+				// Safe to let the group go out of scope now, the worker that finished it no longer touches it
+				tp.wait_helping(group);
+				return;
 			}
-			y += cons_h;
-		}
+			auto tile_start = std::chrono::steady_clock::now();
+			u64 trace_start = tracer ? tracer->now() : 0;
+			PATHTRACER_STAT(CostProbe tile_probe = CostProbe::now());
+			std::vector<PixelAccumulator> acc(ti.w * ti.h);
+			accumulation.load_tile(ti, acc.data());
+			render_tile_samples(scene, cam, w, h, ti, acc);
+			PATHTRACER_STAT(commit_tile_stats(ti, acc, tile_probe));
+			total_samples += commit_tile(rt, ti, acc);
+			if (tracer)
+				tracer->record("tile", trace_start, ti.x, ti.y);
+			u64 ns = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tile_start).count();
+			busy_ns += ns;
+			tile_ns[ti.x / tile_size + ti.y / tile_size * tiles_x] += ns;
+		};
+		auto dispatch_start = std::chrono::steady_clock::now();
+		std::atomic<u32> tiles_done = 0;
+		std::mutex progress_mutex;
+		TaskGroup tiles;
+		tp.parallel_for(tiles, (u32)order.size(), [&](u32 i) {
+			u32 tx = order[i] % tiles_x, ty = order[i] / tiles_x;
+			TileRange ti{ tx * tile_size, ty * tile_size, min<u32>(tile_size, w - tx * tile_size), min<u32>(tile_size, h - ty * tile_size) };
+			render_range(ti);
+			u32 done = ++tiles_done;
+			if (progress_callback) {
+				std::lock_guard l(progress_mutex);
+				progress_callback(RenderProgress{ ti, done, (u32)order.size(),
+					std::chrono::duration<double>(std::chrono::steady_clock::now() - dispatch_start).count() });
+			}
+		});
 
 		auto t0 = std::chrono::high_resolution_clock::now();
-		while (!tp.is_done()) {
+		auto last_checkpoint = t0;
+		double checkpoint_seconds = 0.0;
+		bool done = false;
+		while (!done) {
 			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(2s);
-			u32 num_tasks_left = tp.task_queue_size();
+			// Wakes up as soon as the last tile finishes
+			done = tiles.wait_for(checkpoint_path.empty() ? 2s : std::min<std::chrono::seconds>(2s, std::chrono::seconds(checkpoint_interval)));
+			if (!done && !checkpoint_path.empty() && std::chrono::high_resolution_clock::now() - last_checkpoint >= std::chrono::seconds(checkpoint_interval)) {
+				checkpoint_seconds += write_checkpoint();
+				last_checkpoint = std::chrono::high_resolution_clock::now();
+			}
+			u32 total_tasks = tiles.total();
 			auto t1 = std::chrono::high_resolution_clock::now();
 			auto time_since_start = (u32)std::chrono::duration_cast<std::chrono::seconds>(t1 - t0).count();
-			float completion_percentage = ((float)(total_tasks - num_tasks_left) / (float)total_tasks) * 100.f;
+			float completion_percentage = ((float)tiles.completed() / (float)total_tasks) * 100.f;
 			float time_estimate = (((float)time_since_start / (float)completion_percentage) * 100.f);
 			std::cout << "Completion: " << completion_percentage << " Runtime: " << time_string(time_since_start) << " Total runtime estimate: " << time_string(time_estimate - time_since_start) << "\n";
 		}
+		double dispatch_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - dispatch_start).count();
+		idle_fraction = std::max(0.0, 1.0 - busy_ns.load() / (dispatch_ns * tp.thread_count()));
+		tile_costs.resize(order.size());
+		for (u32 t = 0; t < order.size(); t++)
+			tile_costs[t] = tile_ns[t].load() / 1e6;
+		std::cout << "Tiles: " << order.size() << " of " << tile_size << "px, " << split_count.load() << " split at the tail, workers idle "
+			<< idle_fraction * 100.0 << "% of the render\n";
+
+		average_samples = (number_t)total_samples.load() / ((number_t)w * h);
+		if (is_adaptive())
+			std::cout << "Average samples per pixel: " << average_samples << "\n";
+		PATHTRACER_STAT(
+			render_stats.samples = total_samples.load();
+			print_render_stats(render_stats, std::cout);
+		)
+		if (!checkpoint_path.empty()) {
+			checkpoint_seconds += write_checkpoint();
+			auto render_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+			std::cout << "Checkpoints took " << checkpoint_seconds * 1000.0 << "ms, " << checkpoint_seconds / render_seconds * 100.0 << "% of the render\n";
+		}
+	}
+
+	/*
+	Progressive rendering: whole frame passes of render_mt at 1, 2, 4, ...
+	samples per pixel into the accumulation buffer, each adding only the
+	samples the previous passes have not traced, so the result is the same
+	as a single render at the final count. Stops after the pass that reaches
+	set_samples or brings the RMS relative noise of the image below the
+	target noise. on_pass is called on this thread after every pass, while
+	no tiles are in flight. Adaptive sampling is off for the passes.
+	*/
+	template<typename ImageT>
+	void render_progressive(const Scene& scene, const Camera& cam, ImageT& rt, std::function<void(u32 samples, number_t noise)> on_pass = {}) {
+		u32 target_samples = std::max<u32>(samples, 1);
+		u32 saved_max_samples = max_samples;
+		bool saved_accumulate = accumulate;
+		max_samples = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (u32 spp = 1; ; spp = std::min(spp * 2, target_samples)) {
+			samples = spp;
+			render_mt(scene, cam, rt);
+			accumulate = true;
+			number_t noise = accumulation.rms_relative_error();
+			std::cout << "Pass: " << spp << " spp after " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s";
+			if (noise != FLT_MAX)
+				std::cout << ", noise " << noise;
+			std::cout << "\n";
+			if (on_pass)
+				on_pass(spp, noise);
+			if (spp >= target_samples || noise <= target_noise)
+				break;
+		}
+		samples = target_samples;
+		max_samples = saved_max_samples;
+		accumulate = saved_accumulate;
+	}
+	// RMS relative noise at which render_progressive stops early, 0 renders all passes
+	void set_target_noise(number_t t) { target_noise = t; }
+	number_t get_target_noise() const { return target_noise; }
+
+	/*
+	Renders a w x h image without holding it: rows of tiles (strips of
+	tile_size rows) are quantized to 8 bit RGB and handed to 'sink' top to
+	bottom. At most a few strips are in flight, a strip that finishes before
+	the ones above it waits in that bounded reorder buffer, so memory grows
+	with the image width and not with its height. There is no accumulation
+	buffer, accumulate, checkpoints and the cost image do not apply and the
+	progress callback is not called. Returns false once the sink fails.
+	*/
+	bool render_streamed(const Scene& scene, const Camera& cam, u32 w, u32 h, std::function<bool(u32 y, u32 rows, const u8* rgb)> sink) {
+		TaskScheduler& tp = scheduler();
+		tp.set_tracer(tracer);
+		PATHTRACER_STAT(
+			render_stats = RenderStats{};
+			CostMetric saved_cost_metric = cost_metric;
+			cost_metric = CostMetric::None;
+		)
+		u32 tiles_x = (w + tile_size - 1) / tile_size;
+		u32 strips = (h + tile_size - 1) / tile_size;
+		// Enough strips that every worker has a tile while the oldest strip finishes
+		u32 max_strips = std::max<u32>(2, (tp.thread_count() + tiles_x - 1) / tiles_x + 1);
+
+		struct Strip {
+			u32 y, rows;
+			std::vector<u8> rgb;
+			// Declared last so it is destroyed, and waited for, before the pixels
+			std::unique_ptr<TaskGroup> tiles;
+		};
+		std::atomic<u64> total_samples = 0;
+		std::vector<std::vector<u8>> free_buffers;
+		std::deque<Strip> in_flight;
+		auto submit = [&](u32 s) {
+			Strip& strip = in_flight.emplace_back();
+			strip.y = s * tile_size;
+			strip.rows = min<u32>(tile_size, h - strip.y);
+			if (!free_buffers.empty()) {
+				strip.rgb = std::move(free_buffers.back());
+				free_buffers.pop_back();
+			}
+			strip.rgb.resize((size_t)w * strip.rows * 3);
+			strip.tiles = std::make_unique<TaskGroup>();
+			tp.parallel_for(*strip.tiles, tiles_x, [this, &scene, &cam, &total_samples, w, h, y = strip.y, rows = strip.rows, rgb = strip.rgb.data()](u32 t) {
+				TileRange ti{ t * tile_size, y, min<u32>(tile_size, w - t * tile_size), rows };
+				u64 trace_start = tracer ? tracer->now() : 0;
+				PATHTRACER_STAT(CostProbe tile_probe = CostProbe::now());
+				std::vector<PixelAccumulator> acc(ti.w * ti.h);
+				render_tile_samples(scene, cam, w, h, ti, acc);
+				u64 taken = 0;
+				for (u32 k = 0; k < ti.h; k++) {
+					u8* out = rgb + ((size_t)k * w + ti.x) * 3;
+					for (u32 i = 0; i < ti.w; i++) {
+						const PixelAccumulator& a = acc[i + k * ti.w];
+						Vec3 c = sqrt(a.mean());
+						out[i * 3 + 0] = to_u8(c.x);
+						out[i * 3 + 1] = to_u8(c.y);
+						out[i * 3 + 2] = to_u8(c.z);
+						taken += a.count;
+					}
+				}
+				total_samples += taken;
+				PATHTRACER_STAT(merge_thread_stats(ti, tile_probe));
+				if (tracer)
+					tracer->record("tile", trace_start, ti.x, ti.y);
+			});
+		};
+
+		auto start = std::chrono::steady_clock::now();
+		auto last_report = start;
+		u32 next = 0;
+		bool ok = true;
+		for (u32 written = 0; written < strips && ok; written++) {
+			while (next < strips && in_flight.size() < max_strips)
+				submit(next++);
+			Strip& oldest = in_flight.front();
+			oldest.tiles->wait();
+			ok = sink(oldest.y, oldest.rows, oldest.rgb.data());
+			free_buffers.push_back(std::move(oldest.rgb));
+			in_flight.pop_front();
+			auto now = std::chrono::steady_clock::now();
+			if (now - last_report >= std::chrono::seconds(2)) {
+				u32 elapsed = (u32)std::chrono::duration_cast<std::chrono::seconds>(now - start).count();
+				std::cout << "Completion: " << (written + 1) * 100.f / strips << " Runtime: " << time_string(elapsed) << "\n";
+				last_report = now;
+			}
+		}
+		// Strips still in flight after a failed write finish before their buffers go
+		in_flight.clear();
+
+		average_samples = (number_t)total_samples.load() / ((number_t)w * h);
+		if (is_adaptive())
+			std::cout << "Average samples per pixel: " << average_samples << "\n";
+		PATHTRACER_STAT(
+			cost_metric = saved_cost_metric;
+			render_stats.samples = total_samples.load();
+			print_render_stats(render_stats, std::cout);
+		)
+		return ok;
+	}
+
+	/*
+	Loads a checkpoint to continue from, the next render_mt only traces the
+	samples it is missing. Also restores the seed the checkpoint was rendered
+	with so the continued sample sequences match an uninterrupted render.
+	*/
+	bool resume(const std::string& filepath) {
+		u32 checkpoint_seed;
+		if (!load_checkpoint(filepath, accumulation, checkpoint_seed))
+			return false;
+		seed = checkpoint_seed;
+		accumulate = true;
+		return true;
+	}
+	const AccumulationBuffer& get_accumulation() const { return accumulation; }
+
+	// Worker threads are kept alive between renders (and shared with the image writers) and recreated when the thread count changes
+	TaskScheduler& scheduler() {
+		if (!task_scheduler || task_scheduler->thread_count() != std::max<u32>(num_threads, 1))
+			task_scheduler = std::make_unique<TaskScheduler>(num_threads);
+		return *task_scheduler;
 	}
 
 	void set_samples(u32 n) { samples = n; }
 	u32 get_samples() const { return samples; }
+	// Adaptive sampling is on when the maximum is above set_samples, which then acts as the minimum
+	void set_max_samples(u32 n) { max_samples = n; }
+	u32 get_max_samples() const { return max_samples; }
+	// Pixels stop once the standard error of their mean luminance falls below this fraction of it
+	void set_noise_threshold(number_t t) { noise_threshold = t; }
+	number_t get_noise_threshold() const { return noise_threshold; }
+	bool is_adaptive() const { return max_samples > samples; }
+	// Samples per pixel spent by the last render_mt call
+	number_t get_average_samples() const { return average_samples; }
 	void set_bounces(u32 n) { bounces = n; }
+	// Next event estimation: lambertian hits also sample the scene's emissive spheres with a shadow ray
+	void set_light_sampling(bool l) { light_sampling = l; }
+	bool get_light_sampling() const { return light_sampling; }
+	/*
+	Russian roulette on path throughput from 'depth' bounces on, 0 turns it
+	off. Off by default: in the demo scene most light arrives over low
+	throughput lambertian paths and the noise roulette adds outweighs the
+	bounces it saves.
+	*/
+	void set_roulette_depth(u32 depth) { roulette_depth = depth; }
+	u32 get_roulette_depth() const { return roulette_depth; }
+	// Paths that could add less light than this stop early, 0 never stops them
+	void set_min_contribution(number_t c) { min_contribution = c; }
+	number_t get_min_contribution() const { return min_contribution; }
 	u32 get_bounces() const { return bounces; }
 	void set_max_path_steps(u32 n) { path_step_max = n; }
 	u32 get_max_path_steps() const { return path_step_max; }
@@ -203,6 +410,60 @@ public:
 	number_t get_epsilon() const { return EPSILON; }
 	void set_thread_count(u32 n) { num_threads = n; }
 	u32 get_thread_count() const { return num_threads; }
+	// Base seed for the per pixel samplers, the image is a pure function of it
+	void set_seed(u32 s) { seed = s; }
+	u32 get_seed() const { return seed; }
+	void set_intersection_mode(IntersectionMode m) { intersection_mode = m; }
+	IntersectionMode get_intersection_mode() const { return intersection_mode; }
+	void set_engine(RenderEngine e) { engine = e; }
+	RenderEngine get_engine() const { return engine; }
+	// Primary rays are traced in packets of 4, 8 or 16, anything else traces single rays
+	void set_packet_size(u32 n) { packet_size = n; }
+	u32 get_packet_size() const { return packet_size; }
+	// Keep the samples of the accumulation buffer between render_mt calls instead of starting over
+	void set_accumulate(bool a) { accumulate = a; }
+	bool get_accumulate() const { return accumulate; }
+	// Periodically saves the accumulation buffer to this file during render_mt, empty disables it
+	void set_checkpoint_path(const std::string& path) { checkpoint_path = path; }
+	const std::string& get_checkpoint_path() const { return checkpoint_path; }
+	void set_checkpoint_interval(u32 seconds) { checkpoint_interval = std::max<u32>(seconds, 1); }
+	u32 get_checkpoint_interval() const { return checkpoint_interval; }
+	/*
+	Tiles are tile_size pixels square and dispatched in 'order'. With tail
+	splitting, tiles started while fewer tiles than workers are left are cut
+	into quarters (down to 16px) that idle workers can steal. Splitting does
+	not change the image, every pixel keeps its samplers.
+	*/
+	void set_tile_size(u32 size) { tile_size = std::max<u32>(size, 1); }
+	u32 get_tile_size() const { return tile_size; }
+	void set_tile_order(TileOrder order) { tile_order = order; }
+	TileOrder get_tile_order() const { return tile_order; }
+	void set_split_tail(bool split) { split_tail = split; }
+	bool get_split_tail() const { return split_tail; }
+	// Fraction of worker time the last render_mt spent without a tile
+	double get_idle_fraction() const { return idle_fraction; }
+	/*
+	Called after every tile of render_mt, including the last one before
+	render_mt returns. Runs on the worker that finished the tile, calls are
+	serialized so the callback needs no locking of its own but should be
+	quick, the worker renders nothing meanwhile.
+	*/
+	void set_progress_callback(std::function<void(const RenderProgress&)> callback) { progress_callback = std::move(callback); }
+	// Records tiles, checkpoints and the scheduler's idle time into t, which has to outlive the renderer or be unset
+	void set_tracer(Tracer* t) { tracer = t; }
+	Tracer* get_tracer() const { return tracer; }
+#if defined(PATHTRACER_STATS)
+	// Counters of the last render_mt call
+	const RenderStats& get_render_stats() const { return render_stats; }
+	/*
+	Records a per pixel cost image during render_mt. Megakernel and adaptive
+	renders measure every pixel, packet and wavefront tiles trace pixels
+	together and spread the tile's cost over the pixels they sampled.
+	*/
+	void set_cost_metric(CostMetric m) { cost_metric = m; }
+	CostMetric get_cost_metric() const { return cost_metric; }
+	const Image& get_cost_image() const { return cost_image; }
+#endif
 private:
 	/*
 	Vec3 raycast_scene_recurse(const Scene& scene, Ray ray, i32 depth) {
@@ -252,72 +513,519 @@ private:
 		return Vec3{ 0.f, 0.f, 0.f };
 	}
 	*/
-	Vec3 raycast_scene(const Scene& scene, Ray ray, i32 max_depth) {
-		Vec3 color{0.f, 0.f, 0.f};
-		Vec3 factor{1.f, 1.f, 1.f};
+	// Resolves the tile into the image and commits its statistics, returns the number of samples it added
+	template<typename ImageT>
+	u64 commit_tile(ImageT& rt, TileRange ti, const std::vector<PixelAccumulator>& acc) {
+		u64 taken = 0;
+		for (u32 k = 0; k < ti.h; k++) {
+			for (u32 i = 0; i < ti.w; i++) {
+				const PixelAccumulator& a = acc[i + k * ti.w];
+				taken += a.count - accumulation.get(ti.x + i, ti.y + k).count;
+				rt.set(ti.x + i, ti.y + k, sqrt(a.mean()));
+			}
+		}
+		accumulation.commit_tile(ti, acc.data());
+		return taken;
+	}
+#if defined(PATHTRACER_STATS)
+	bool measures_pixels() const {
+		return is_adaptive() || (engine == RenderEngine::Megakernel && packet_size != 4 && packet_size != 8 && packet_size != 16);
+	}
+	void record_pixel_cost(u32 x, u32 y, const CostProbe& probe) {
+		if (cost_metric != CostMetric::None)
+			cost_image.get(x, y) = cost_image.get(x, y) + Vec3{ 1.f, 1.f, 1.f } * probe.cost(cost_metric);
+	}
+	// Moves the worker's counters into the render totals, the lock is taken once per tile
+	void commit_tile_stats(TileRange ti, const std::vector<PixelAccumulator>& acc, const CostProbe& tile_probe) {
+		if (cost_metric != CostMetric::None && !measures_pixels()) {
+			u32 sampled = 0;
+			for (u32 p = 0; p < ti.w * ti.h; p++)
+				sampled += acc[p].count != accumulation.get(ti.x + p % ti.w, ti.y + p / ti.w).count;
+			number_t share = tile_probe.cost(cost_metric) / std::max<u32>(sampled, 1);
+			for (u32 p = 0; p < ti.w * ti.h; p++)
+				if (acc[p].count != accumulation.get(ti.x + p % ti.w, ti.y + p / ti.w).count)
+					cost_image.get(ti.x + p % ti.w, ti.y + p / ti.w) = Vec3{ share, share, share };
+		}
+		merge_thread_stats(ti, tile_probe);
+	}
+	void merge_thread_stats(TileRange ti, const CostProbe& tile_probe) {
+		RenderStats& local = thread_render_stats();
+		local.slowest_tile_x = ti.x;
+		local.slowest_tile_y = ti.y;
+		local.slowest_tile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tile_probe.time).count();
+		{
+			std::lock_guard l(render_stats_mutex);
+			render_stats.merge(local);
+		}
+		local = RenderStats{};
+	}
+#endif
+	/*
+	Cost order without timings of a previous frame: traces one path per
+	COST_STRIDE x COST_STRIDE block of every tile and times it. The samples
+	are thrown away and the render statistics do not count them.
+	*/
+	void estimate_tile_costs(const Scene& scene, const Camera& cam, u32 w, u32 h, u32 tiles_x, u32 tiles_y) {
+		const u32 COST_STRIDE = 8;
+		number_t ar = (number_t)w / (number_t)h;
+		auto start = std::chrono::steady_clock::now();
+		tile_costs.assign(tiles_x * tiles_y, 0.0);
+		scheduler().parallel_for(tiles_x * tiles_y, [&](u32 t) {
+			PATHTRACER_STAT(RenderStats saved = thread_render_stats());
+			u32 x0 = t % tiles_x * tile_size, y0 = t / tiles_x * tile_size;
+			auto tile_start = std::chrono::steady_clock::now();
+			for (u32 y = y0 + COST_STRIDE / 2; y < min<u32>(y0 + tile_size, h); y += COST_STRIDE) {
+				for (u32 x = x0 + COST_STRIDE / 2; x < min<u32>(x0 + tile_size, w); x += COST_STRIDE) {
+					Sampler sampler = Sampler::for_pixel(x, y, 0, seed);
+					raycast_scene(scene, cam.get_ray(x + 0.5f, y + 0.5f, (number_t)w, (number_t)h, ar), bounces + 1, sampler);
+				}
+			}
+			tile_costs[t] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tile_start).count();
+			PATHTRACER_STAT(thread_render_stats() = saved);
+		});
+		std::cout << "Tile cost pre-pass took " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms\n";
+	}
+	// Returns the time the checkpoint took in seconds
+	double write_checkpoint() {
+		u64 trace_start = tracer ? tracer->now() : 0;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		if (!save_checkpoint(checkpoint_path, accumulation, seed))
+			std::cerr << "Failed to write checkpoint " << checkpoint_path << std::endl;
+		if (tracer)
+			tracer->record("checkpoint", trace_start);
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+	}
+	// Picks the tile function for the sampling mode, engine and packet size
+	void render_tile_samples(const Scene& scene, const Camera& cam, u32 w, u32 h, TileRange ti, std::vector<PixelAccumulator>& acc) {
+		if (is_adaptive())
+			render_tile_adaptive(scene, cam, w, h, ti, acc);
+		else if (engine == RenderEngine::Wavefront)
+			render_tile_wavefront(scene, cam, w, h, ti, acc);
+		else {
+			switch (packet_size) {
+			case 4: render_tile_packet<4>(scene, cam, w, h, ti, acc); break;
+			case 8: render_tile_packet<8>(scene, cam, w, h, ti, acc); break;
+			case 16: render_tile_packet<16>(scene, cam, w, h, ti, acc); break;
+			default: render_tile(scene, cam, w, h, ti, acc); break;
+			}
+		}
+	}
+	/*
+	Tile functions add the samples each pixel of 'acc' is missing, sample
+	index s of a pixel always uses the same sampler so a tile continued from
+	a checkpoint ends up exactly like one rendered in a single go.
+	*/
+	void render_tile(const Scene& scene, const Camera& cam, u32 w, u32 h, TileRange ti, std::vector<PixelAccumulator>& acc) {
+		number_t ar = (number_t)w / (number_t)h;
+		for (u32 i = 0; i < ti.w; i++) {
+			for (u32 k = 0; k < ti.h; k++) {
+				PixelAccumulator& a = acc[i + k * ti.w];
+				PATHTRACER_STAT(CostProbe probe = CostProbe::now());
+				for (u32 s = a.count; s < samples; s++) {
+					Sampler sampler = Sampler::for_pixel(ti.x + i, ti.y + k, s, seed);
+					number_t u = ti.x + i + sampler.next();
+					number_t v = ti.y + k + sampler.next();
+					a.add(raycast_scene(scene, cam.get_ray(u, v, (number_t)w, (number_t)h, ar), bounces + 1, sampler));
+				}
+				PATHTRACER_STAT(record_pixel_cost(ti.x + i, ti.y + k, probe));
+			}
+		}
+	}
+	/*
+	Adaptive version of render_tile. Every pixel first gets 'samples' samples,
+	then further batches go only to pixels whose relative noise is still
+	above the threshold, until they reach 'max_samples'. Paths are traced
+	one at a time with the megakernel.
+	*/
+	void render_tile_adaptive(const Scene& scene, const Camera& cam, u32 w, u32 h, TileRange ti, std::vector<PixelAccumulator>& tile_acc) {
+		number_t ar = (number_t)w / (number_t)h;
+		u32 batch = std::max<u32>(samples, 1);
+		for (u32 k = 0; k < ti.h; k++) {
+			for (u32 i = 0; i < ti.w; i++) {
+				u32 x = ti.x + i, y = ti.y + k;
+				PixelAccumulator& acc = tile_acc[i + k * ti.w];
+				PATHTRACER_STAT(CostProbe probe = CostProbe::now());
+				u32 target = samples;
+				while (true) {
+					for (u32 s = acc.count; s < target; s++) {
+						Sampler sampler = Sampler::for_pixel(x, y, s, seed);
+						number_t u = x + sampler.next();
+						number_t v = y + sampler.next();
+						acc.add(raycast_scene(scene, cam.get_ray(u, v, (number_t)w, (number_t)h, ar), bounces + 1, sampler));
+					}
+					if (acc.count >= max_samples || acc.relative_error() <= noise_threshold)
+						break;
+					target = min<u32>(acc.count + batch, max_samples);
+				}
+				PATHTRACER_STAT(record_pixel_cost(x, y, probe));
+			}
+		}
+	}
+	/*
+	Traces the primary rays of a block of pixels as one packet, 2x2 pixels for
+	4 lanes, 4x2 for 8 and 4x4 for 16. Secondary rays scatter in unrelated
+	directions so every lane continues on its own after the first hit.
+	Samplers are seeded and drawn in the same order as render_tile, so the
+	result is bit identical to it.
+	*/
+	template<u32 N>
+	void render_tile_packet(const Scene& scene, const Camera& cam, u32 w, u32 h, TileRange ti, std::vector<PixelAccumulator>& acc) {
+		constexpr u32 BW = N == 4 ? 2 : 4;
+		constexpr u32 BH = N / BW;
+		number_t ar = (number_t)w / (number_t)h;
 
-		for (i32 depth = 0; depth < max_depth; depth++) {
-			// Ray march into the scene to find the ray scene intersection
-			auto pos_or = scene.ray(ray, path_step_max, EPSILON);
+		u32 first = samples;
+		for (const PixelAccumulator& a : acc)
+			first = min<u32>(first, a.count);
+		for (u32 s = first; s < samples; s++) {
+			for (u32 by = 0; by < ti.h; by += BH) {
+				for (u32 bx = 0; bx < ti.w; bx += BW) {
+					RayPacket<N> packet;
+					Sampler samplers[N];
+					for (u32 l = 0; l < N; l++) {
+						u32 i = bx + l % BW, k = by + l / BW;
+						// Lanes outside the tile or of pixels that already have sample s stay inactive
+						if (i >= ti.w || k >= ti.h || acc[i + k * ti.w].count != s)
+							continue;
+						samplers[l] = Sampler::for_pixel(ti.x + i, ti.y + k, s, seed);
+						number_t u = ti.x + i + samplers[l].next();
+						number_t v = ti.y + k + samplers[l].next();
+						packet.set(l, cam.get_ray(u, v, (number_t)w, (number_t)h, ar));
+					}
 
-			// If there is a collision do shading computations
-			if (auto pos = pos_or.value_or(Vec3{}); pos_or.has_value()) {
-				auto [distance_to_scene, normal, mat] = scene.distance_and_normal_and_material(pos);
+					Scene::Hit hits[N];
+					u32 hit = trace_packet(scene, packet, hits);
+					PATHTRACER_STAT(
+						thread_render_stats().rays += std::popcount(packet.active);
+						thread_render_stats().misses += std::popcount(packet.active & ~hit);
+					)
+					for_each_lane(packet.active, [&](u32 l) {
+						u32 i = bx + l % BW, k = by + l / BW;
+						std::optional<Scene::Hit> first;
+						if (hit & (1u << l))
+							first = hits[l];
+						acc[i + k * ti.w].add(shade_path(scene, packet.get(l), first, bounces + 1, samplers[l]));
+					});
+				}
+			}
+		}
+	}
+	/*
+	Wavefront version of render_tile. One pass per sample generates a path
+	for every pixel of the tile, then each bounce runs four stages over the
+	whole pool: intersect all active paths, sort the hits into per material
+	queues, shade each queue with a branch free loop, and trace the shadow
+	rays the lambertian queue's light samples queued. Paths draw random
+	numbers in the same order as in shade_path, so the image is identical
+	to the megakernel.
+	*/
+	void render_tile_wavefront(const Scene& scene, const Camera& cam, u32 w, u32 h, TileRange ti, std::vector<PixelAccumulator>& acc) {
+		number_t ar = (number_t)w / (number_t)h;
+		const LightList& lights = scene.get_lights();
+		number_t max_emission = lights.max_emission();
+		u32 n = ti.w * ti.h;
+		i32 max_depth = bounces + 1;
+		// Scaled per hit position like in shade_path
+		auto reflection_advance = [&](const Vec3& pos) { return robust_epsilon(pos, EPSILON) * 1.2f; };
 
-				// Advance the reflection ray a bit to reduce self intersection of the ray
-				// Different scattering if the material is a metal, lambertian or dielectric
-				number_t REFLECTION_ADVANCE = EPSILON * 1.2f;
-				if (mat->type == MaterialType::Metallic) {
-					Vec3 scatter_dir = reflect(ray.direction(), normal) + random_in_unit_sphere() * (1.f - mat->m.shininess);
-					color = color + factor * mat->m.emissive;
+		// Reused by every tile this worker renders
+		thread_local PathPool pool;
+		pool.resize(n);
+
+		u32 first = samples;
+		for (const PixelAccumulator& a : acc)
+			first = min<u32>(first, a.count);
+		for (u32 s = first; s < samples; s++) {
+			// Generate primary rays for the pixels missing sample s
+			pool.active.clear();
+			for (u32 p = 0; p < n; p++) {
+				if (acc[p].count != s)
+					continue;
+				u32 i = p % ti.w, k = p / ti.w;
+				Sampler& sampler = pool.samplers[p];
+				sampler = Sampler::for_pixel(ti.x + i, ti.y + k, s, seed);
+				number_t u = ti.x + i + sampler.next();
+				number_t v = ti.y + k + sampler.next();
+				pool.set_ray(p, cam.get_ray(u, v, (number_t)w, (number_t)h, ar));
+				pool.color[p] = Vec3{ 0.f, 0.f, 0.f };
+				pool.factor[p] = Vec3{ 1.f, 1.f, 1.f };
+				pool.bsdf_pdf[p] = 0.f;
+				pool.stopped[p] = 0;
+				pool.active.push_back(p);
+			}
 
-					factor = {1.f, 1.f, 1.f};
-					ray = Ray(pos, scatter_dir).advance(REFLECTION_ADVANCE);
+			for (i32 depth = 0; depth < max_depth && pool.active.size(); depth++) {
+				// Intersect, paths that miss are finished and drop out
+				pool.lambertian_queue.clear();
+				pool.metallic_queue.clear();
+				pool.dielectric_queue.clear();
+				u32 still_active = 0;
+				for (u32 p : pool.active) {
+					auto hit_or = trace(scene, pool.ray(p));
+					PATHTRACER_STAT(thread_render_stats().rays++);
+					if (!hit_or.has_value()) {
+						PATHTRACER_STAT(
+							thread_render_stats().misses++;
+							thread_render_stats().add_path_depth(depth);
+						)
+						continue;
+					}
+					pool.hit_pos[p] = hit_or->position;
+					pool.hit_normal[p] = hit_or->normal;
+					pool.hit_material[p] = hit_or->material;
+					pool.hit_sphere[p] = hit_or->sphere;
+					pool.active[still_active++] = p;
 				}
-				else if (mat->type == MaterialType::Lambertian) {
-					Vec3 target = pos + normal + random_in_unit_sphere();
-					Vec3 scatter_dir = target - pos;
+				pool.active.resize(still_active);
+
+				// Sort hits into queues by material
+				for (u32 p : pool.active) {
+					switch (pool.hit_material[p]->type) {
+					case MaterialType::Lambertian: pool.lambertian_queue.push_back(p); break;
+					case MaterialType::Metallic: pool.metallic_queue.push_back(p); break;
+					case MaterialType::Dielectric: pool.dielectric_queue.push_back(p); break;
+					}
+				}
+
+				PATHTRACER_STAT(
+					RenderStats& stats = thread_render_stats();
+					stats.bounces[(u32)MaterialType::Lambertian] += pool.lambertian_queue.size();
+					stats.bounces[(u32)MaterialType::Metallic] += pool.metallic_queue.size();
+					stats.bounces[(u32)MaterialType::Dielectric] += pool.dielectric_queue.size();
+				)
+
+				// Shade every queue
+				auto shade_queue = [&](const std::vector<u32>& queue, auto&& scatter) {
+					for (u32 p : queue) {
+						Scatter sc = scatter(p, *pool.hit_material[p], pool.ray(p), pool.hit_pos[p], pool.hit_normal[p], pool.samplers[p]);
+						number_t weight = emission_weight(lights, pool.hit_sphere[p], pool.bsdf_pdf[p], pool.bsdf_origin[p]);
+						pool.color[p] = pool.color[p] + pool.factor[p] * sc.emissive * weight;
+						pool.factor[p] = pool.factor[p] * sc.factor;
+						pool.bsdf_pdf[p] = sc.pdf;
+						pool.bsdf_origin[p] = pool.hit_pos[p];
+						pool.set_ray(p, sc.ray);
+						pool.stopped[p] = !continue_path(pool.factor[p], depth, max_depth, max_emission, pool.samplers[p]);
+					}
+				};
+				pool.shadow_queue.clear();
+				bool sample_lights = light_sampling && depth + 1 < max_depth;
+				shade_queue(pool.lambertian_queue, [&](u32 p, const Material& m, const Ray& r, const Vec3& pos, const Vec3& normal, Sampler& sampler) {
+					if (sample_lights) {
+						if (auto direct = sample_direct_lambertian(m.l, lights, pos, normal, reflection_advance(pos), sampler)) {
+							direct->radiance = pool.factor[p] * direct->radiance;
+							pool.shadow_queue.push_back({ p, *direct });
+						}
+					}
+					return scatter_lambertian(m.l, r, pos, normal, reflection_advance(pos), sampler);
+				});
+				shade_queue(pool.metallic_queue, [&](u32, const Material& m, const Ray& r, const Vec3& pos, const Vec3& normal, Sampler& sampler) {
+					return scatter_metallic(m.m, r, pos, normal, reflection_advance(pos), sampler);
+				});
+				shade_queue(pool.dielectric_queue, [&](u32, const Material& m, const Ray& r, const Vec3& pos, const Vec3& normal, Sampler& sampler) {
+					return scatter_dielectric(m.d, r, pos, normal, reflection_advance(pos), sampler);
+				});
 
-					color = color + factor * mat->l.emissive;
+				// Shadow rays of the whole bounce, a light sample counts if nothing is in front of its light
+				for (auto& [p, direct] : pool.shadow_queue) {
+					auto shadow_hit = trace(scene, direct.shadow_ray);
+					PATHTRACER_STAT(thread_render_stats().shadow_rays++);
+					if (shadow_hit.has_value() && shadow_hit->sphere == direct.sphere)
+						pool.color[p] = pool.color[p] + direct.radiance;
+				}
 
-					factor = mat->l.albedo * mat->l.reflectance;
-					ray = Ray(pos, scatter_dir).advance(REFLECTION_ADVANCE);
+				// Drop the paths that stopped
+				u32 kept = 0;
+				for (u32 p : pool.active) {
+					if (pool.stopped[p]) {
+						PATHTRACER_STAT(thread_render_stats().add_path_depth(depth + 1));
+						continue;
+					}
+					pool.active[kept++] = p;
 				}
-				else if (mat->type == MaterialType::Dielectric) {
-					bool is_front = dot(ray.direction(), -normal.normalize()) < 0.f;
-					number_t refraction_ratio = is_front ? mat->d.refractive_index : 1.f / mat->d.refractive_index;
-					// Check if internal or external refraction
+				pool.active.resize(kept);
+			}
+			PATHTRACER_STAT(thread_render_stats().add_path_depth(max_depth, pool.active.size()));
 
-					double cos_theta = fmin(dot(-ray.direction(), normal), 1.0);
-					double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+			for (u32 p = 0; p < n; p++)
+				if (acc[p].count == s)
+					acc[p].add(pool.color[p]);
+		}
+	}
+	std::optional<Scene::Hit> trace(const Scene& scene, const Ray& ray) const {
+		if (intersection_mode == IntersectionMode::Analytic)
+			return scene.intersect(ray, EPSILON);
+
+		// Ray march into the scene and look up the surface at the end point
+		auto pos_or = scene.ray(ray, path_step_max, EPSILON);
+		if (!pos_or.has_value())
+			return {};
+		auto [distance_to_scene, normal, mat, sphere] = scene.distance_and_normal_and_material(*pos_or);
+		return Scene::Hit{ *pos_or, normal, mat, sphere };
+	}
+	// Packet version of trace, fills hits for the returned lane mask
+	template<u32 N>
+	u32 trace_packet(const Scene& scene, const RayPacket<N>& packet, Scene::Hit* hits) const {
+		if (intersection_mode == IntersectionMode::Analytic)
+			return scene.intersect_packet(packet, EPSILON, hits);
 
-					bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+		RayPacket<N> marched = packet;
+		u32 hit = scene.ray_packet(marched, path_step_max, EPSILON);
+		for_each_lane(hit, [&](u32 l) {
+			auto [distance_to_scene, normal, mat, sphere] = scene.distance_and_normal_and_material(marched.origin(l));
+			hits[l] = Scene::Hit{ marched.origin(l), normal, mat, sphere };
+		});
+		return hit;
+	}
+	Vec3 raycast_scene(const Scene& scene, Ray ray, i32 max_depth, Sampler& sampler) {
+		if (max_depth <= 0)
+			return Vec3{ 0.f, 0.f, 0.f };
+		auto hit_or = trace(scene, ray);
+		PATHTRACER_STAT(
+			thread_render_stats().rays++;
+			thread_render_stats().misses += !hit_or.has_value();
+		)
+		return shade_path(scene, ray, hit_or, max_depth, sampler);
+	}
+	/*
+	Share of an emitter's light a bounce ray brings that the bounce keeps.
+	Lights are also reached by the light samples of lambertian hits, so after
+	a lambertian bounce (bsdf_pdf > 0) the two strategies split it with the
+	power heuristic.
+	*/
+	number_t emission_weight(const LightList& lights, u32 sphere, number_t bsdf_pdf, const Vec3& bsdf_origin) const {
+		if (!light_sampling || bsdf_pdf <= 0.f)
+			return 1.f;
+		u32 light = lights.find(sphere);
+		if (light == ~0u)
+			return 1.f;
+		return mis_weight(bsdf_pdf, lights.pdf(bsdf_origin, light));
+	}
+	/*
+	Whether a path goes on after the bounce at 'depth', 'factor' is its
+	throughput after that bounce. Paths stop once their brightest channel
+	times the brightest emitter times the bounces left is below
+	min_contribution, roughly the most they could still add. After
+	roulette_depth bounces Russian roulette also stops them with a
+	probability that grows as their throughput falls, without bias. Draws
+	a random number only for the roulette, after the bounce's own.
+	*/
+	bool continue_path(Vec3& factor, i32 depth, i32 max_depth, number_t max_emission, Sampler& sampler) const {
+		if (depth + 1 >= max_depth)
+			return true;
+		if (max(factor.x, factor.y, factor.z) * max_emission * (max_depth - depth - 1) < min_contribution) {
+			PATHTRACER_STAT(thread_render_stats().bound_stops++);
+			return false;
+		}
+		if (roulette_depth && depth + 1 >= (i32)roulette_depth && !russian_roulette(factor, sampler)) {
+			PATHTRACER_STAT(thread_render_stats().roulette_stops++);
+			return false;
+		}
+		return true;
+	}
+	// Follows a path whose first intersection is already known
+	Vec3 shade_path(const Scene& scene, Ray ray, std::optional<Scene::Hit> hit_or, i32 max_depth, Sampler& sampler) {
+		Vec3 color{0.f, 0.f, 0.f};
+		Vec3 factor{1.f, 1.f, 1.f};
+		const LightList& lights = scene.get_lights();
+		// Direction density and origin of the last bounce, see emission_weight
+		number_t bsdf_pdf = 0.f;
+		Vec3 bsdf_origin{ 0.f, 0.f, 0.f };
 
-					Vec3 scatter_dir = reflect(ray.direction().normalize(), normal.normalize());
-					if (!cannot_refract)
-						scatter_dir = refract(ray.direction().normalize(), normal.normalize() * (is_front ? -1.f : 1.f), refraction_ratio);
+		number_t max_emission = lights.max_emission();
 
-					scatter_dir = scatter_dir + random_in_unit_sphere() * 0.1f;
+		i32 depth = 0;
+		for (; depth < max_depth; depth++) {
+			// Find the ray scene intersection
+			if (depth > 0) {
+				hit_or = trace(scene, ray);
+				PATHTRACER_STAT(
+					thread_render_stats().rays++;
+					thread_render_stats().misses += !hit_or.has_value();
+				)
+			}
 
-					color = color + factor * mat->d.emissive;
+			// If there is a collision do shading computations
+			if (hit_or.has_value()) {
+				auto [pos, normal, mat, sphere] = *hit_or;
+				PATHTRACER_STAT(thread_render_stats().bounces[(u32)mat->type]++);
 
-					factor = {1.f, 1.f, 1.f},
-					ray = Ray(pos, scatter_dir).advance(REFLECTION_ADVANCE);
+				// Advance the reflection ray a bit to reduce self intersection of the ray
+				// Different scattering if the material is a metal, lambertian or dielectric
+				number_t REFLECTION_ADVANCE = robust_epsilon(pos, EPSILON) * 1.2f;
+				std::optional<Scatter> sc;
+				std::optional<DirectLight> direct;
+				if (mat->type == MaterialType::Metallic)
+					sc = scatter_metallic(mat->m, ray, pos, normal, REFLECTION_ADVANCE, sampler);
+				else if (mat->type == MaterialType::Lambertian) {
+					// The light sample comes first, the wavefront engine draws it in the same order
+					if (light_sampling && depth + 1 < max_depth)
+						direct = sample_direct_lambertian(mat->l, lights, pos, normal, REFLECTION_ADVANCE, sampler);
+					sc = scatter_lambertian(mat->l, ray, pos, normal, REFLECTION_ADVANCE, sampler);
 				}
+				else if (mat->type == MaterialType::Dielectric)
+					sc = scatter_dielectric(mat->d, ray, pos, normal, REFLECTION_ADVANCE, sampler);
 				else {
 					// Unkown mat
 				}
+				if (sc.has_value()) {
+					color = color + factor * sc->emissive * emission_weight(lights, sphere, bsdf_pdf, bsdf_origin);
+					if (direct.has_value()) {
+						auto shadow_hit = trace(scene, direct->shadow_ray);
+						PATHTRACER_STAT(thread_render_stats().shadow_rays++);
+						if (shadow_hit.has_value() && shadow_hit->sphere == direct->sphere)
+							color = color + factor * direct->radiance;
+					}
+					factor = factor * sc->factor;
+					bsdf_pdf = sc->pdf;
+					bsdf_origin = pos;
+					ray = sc->ray;
+					if (!continue_path(factor, depth, max_depth, max_emission, sampler)) {
+						depth++;
+						break;
+					}
+				}
 			}
 			else {
 				break;
 			}
 		}
+		PATHTRACER_STAT(thread_render_stats().add_path_depth(depth));
 		return color;
 	}
 
 	u32 samples = 4;
+	u32 max_samples = 0;
+	number_t noise_threshold = 0.05f;
+	number_t target_noise = 0.f;
+	number_t average_samples = 0.f;
 	u32 bounces = 4;
+	bool light_sampling = true;
+	u32 roulette_depth = 0;
+	number_t min_contribution = 1e-6f;
 	u32 path_step_max = 100;
 	number_t EPSILON = 0.0001f;
 	u32 num_threads = 1;
+	u32 seed = 0;
+	IntersectionMode intersection_mode = IntersectionMode::SphereTracing;
+	u32 packet_size = 0;
+	AccumulationBuffer accumulation;
+	bool accumulate = false;
+	std::string checkpoint_path;
+	u32 checkpoint_interval = 60;
+	RenderEngine engine = RenderEngine::Megakernel;
+	std::unique_ptr<TaskScheduler> task_scheduler;
+	Tracer* tracer = nullptr;
+	std::function<void(const RenderProgress&)> progress_callback;
+	u32 tile_size = 64;
+	TileOrder tile_order = TileOrder::RowMajor;
+	bool split_tail = true;
+	// Milliseconds per grid tile of the last render_mt
+	std::vector<double> tile_costs;
+	double idle_fraction = 0.0;
+#if defined(PATHTRACER_STATS)
+	RenderStats render_stats;
+	std::mutex render_stats_mutex;
+	CostMetric cost_metric = CostMetric::None;
+	Image cost_image{ 0, 0 };
+#endif
 };
\ No newline at end of file
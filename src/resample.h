@@ -0,0 +1,204 @@
+#pragma once
+
+#include "math.h"
+#include "image.h"
+#include "simd.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+enum struct ResampleFilter {
+	// Average of the source pixels under the target pixel
+	Box,
+	// Linear falloff over one target pixel, bilinear when upscaling
+	Tent,
+	// Windowed sinc with three lobes, sharpest but rings at hard edges
+	Lanczos3
+};
+
+number_t resample_filter_radius(ResampleFilter f) {
+	switch (f) {
+	case ResampleFilter::Box: return 0.5f;
+	case ResampleFilter::Tent: return 1.f;
+	default: return 3.f;
+	}
+}
+
+number_t resample_filter_weight(ResampleFilter f, number_t t) {
+	t = std::abs(t);
+	switch (f) {
+	case ResampleFilter::Box:
+		return t <= 0.5f ? 1.f : 0.f;
+	case ResampleFilter::Tent:
+		return t < 1.f ? 1.f - t : 0.f;
+	default: {
+		if (t < 1e-6f)
+			return 1.f;
+		if (t >= 3.f)
+			return 0.f;
+		number_t x = PI * t;
+		return 3.f * std::sin(x) * std::sin(x / 3.f) / (x * x);
+	}
+	}
+}
+
+/*
+Weights of one axis: target pixel i blends the source pixels
+first[i] .. first[i] + count[i] - 1 with weights[offset[i] ..]. Taps
+outside the source are dropped and the rest renormalized, so edges do not
+darken.
+*/
+struct ResampleAxis {
+	std::vector<u32> first, count, offset;
+	std::vector<number_t> weights;
+
+	ResampleAxis(u32 src, u32 dst, ResampleFilter filter) {
+		number_t scale = (number_t)src / dst;
+		// Downscaling widens the filter to cover every source pixel
+		number_t support = std::max<number_t>(scale, 1.f);
+		number_t radius = resample_filter_radius(filter) * support;
+		for (u32 i = 0; i < dst; i++) {
+			number_t center = (i + 0.5f) * scale - 0.5f;
+			i32 lo = std::max<i32>((i32)std::ceil(center - radius), 0);
+			i32 hi = std::min<i32>((i32)std::floor(center + radius), (i32)src - 1);
+			// The box can fall between two source pixels when upscaling, take the nearest
+			if (hi < lo)
+				lo = hi = std::clamp<i32>((i32)std::lround(center), 0, (i32)src - 1);
+			number_t sum = 0.f;
+			size_t start = weights.size();
+			for (i32 s = lo; s <= hi; s++) {
+				number_t w = resample_filter_weight(filter, (s - center) / support);
+				weights.push_back(w);
+				sum += w;
+			}
+			if (sum == 0.f) {
+				weights.resize(start);
+				weights.push_back(1.f);
+				lo = hi = std::clamp<i32>((i32)std::lround(center), 0, (i32)src - 1);
+				sum = 1.f;
+			}
+			for (size_t k = start; k < weights.size(); k++)
+				weights[k] /= sum;
+			first.push_back((u32)lo);
+			count.push_back((u32)(weights.size() - start));
+			offset.push_back((u32)start);
+		}
+	}
+};
+
+static_assert(sizeof(Vec3) == 3 * sizeof(number_t), "resampling treats Vec3 rows as flat arrays");
+
+/*
+Separable resampling of a linear image. Every target row first blends its
+source rows into one row, SIMD over the flat channel array, then blends
+that row horizontally. Bands of target rows run on the scheduler when
+there is one, each band with its own intermediate row.
+*/
+Image resample(const Image& src, u32 w, u32 h, ResampleFilter filter, TaskScheduler* scheduler = nullptr) {
+	Image dst(w, h);
+	if (w == 0 || h == 0 || src.width() == 0 || src.height() == 0)
+		return dst;
+	ResampleAxis ax(src.width(), w, filter), ay(src.height(), h, filter);
+	const u32 n = src.width() * 3;
+	const u32 BAND_ROWS = 16;
+	u32 bands = (h + BAND_ROWS - 1) / BAND_ROWS;
+
+	auto band = [&](u32 b) {
+		using V = VecN<SIMD_WIDTH>;
+		std::vector<number_t> row(n);
+		for (u32 y = b * BAND_ROWS; y < min<u32>((b + 1) * BAND_ROWS, h); y++) {
+			const number_t* wy = &ay.weights[ay.offset[y]];
+			const number_t* first_row = &src.get(0, ay.first[y]).x;
+			u32 i = 0;
+			for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+				V acc = V::load(first_row + i) * wy[0];
+				for (u32 k = 1; k < ay.count[y]; k++)
+					acc = acc + V::load(&src.get(0, ay.first[y] + k).x + i) * wy[k];
+				acc.store(row.data() + i);
+			}
+			for (; i < n; i++) {
+				number_t acc = first_row[i] * wy[0];
+				for (u32 k = 1; k < ay.count[y]; k++)
+					acc += (&src.get(0, ay.first[y] + k).x)[i] * wy[k];
+				row[i] = acc;
+			}
+
+			const Vec3* mid = (const Vec3*)row.data();
+			for (u32 x = 0; x < w; x++) {
+				const number_t* wx = &ax.weights[ax.offset[x]];
+				const Vec3* s = mid + ax.first[x];
+				Vec3 acc = s[0] * wx[0];
+				for (u32 k = 1; k < ax.count[x]; k++)
+					acc = acc + s[k] * wx[k];
+				dst.get(x, y) = acc;
+			}
+		}
+	};
+	if (scheduler && bands > 1)
+		scheduler->parallel_for(bands, band);
+	else
+		for (u32 b = 0; b < bands; b++)
+			band(b);
+	return dst;
+}
+
+/*
+Box filtered mip chain of 'base': level i is base.width() >> (i + 1) by
+base.height() >> (i + 1) (at least 1), down to 1x1. The base is read once:
+every 64x64 tile reduces its whole chain while it is in cache and writes
+its part of each level. Levels smaller than the tile grid are reduced from
+the last tiled level afterwards. Every pixel is the plain average of the
+base pixels it covers, a trailing odd row or column of a level is dropped.
+*/
+std::vector<Image> build_mip_pyramid(const Image& base, TaskScheduler* scheduler = nullptr) {
+	std::vector<Image> levels;
+	u32 w = base.width(), h = base.height();
+	while (w > 1 || h > 1) {
+		w = std::max<u32>(w / 2, 1);
+		h = std::max<u32>(h / 2, 1);
+		levels.emplace_back(w, h);
+	}
+	if (levels.empty())
+		return levels;
+
+	auto reduce = [](const Image& src, Image& dst, u32 x0, u32 y0, u32 x1, u32 y1) {
+		// A source of width or height 1 repeats its only column or row
+		u32 dx = src.width() > 1 ? 1 : 0, dy = src.height() > 1 ? 1 : 0;
+		for (u32 y = y0; y < y1; y++)
+			for (u32 x = x0; x < x1; x++) {
+				u32 sx = x * (dx + 1), sy = y * (dy + 1);
+				dst.get(x, y) = (src.get(sx, sy) + src.get(sx + dx, sy) + src.get(sx, sy + dy) + src.get(sx + dx, sy + dy)) * 0.25f;
+			}
+	};
+
+	// Levels a 64 pixel tile still covers whole pixels of
+	const u32 TILE_LEVELS = 6, TILE = 1 << TILE_LEVELS;
+	u32 tiled = min<u32>(TILE_LEVELS, (u32)levels.size());
+	bool tiles_fit = base.width() >> tiled > 0 && base.height() >> tiled > 0;
+	if (tiles_fit) {
+		u32 tiles_x = (base.width() + TILE - 1) / TILE, tiles_y = (base.height() + TILE - 1) / TILE;
+		auto tile = [&](u32 t) {
+			u32 tx = t % tiles_x * TILE, ty = t / tiles_x * TILE;
+			const Image* src = &base;
+			for (u32 l = 0; l < tiled; l++) {
+				u32 x0 = tx >> (l + 1), y0 = ty >> (l + 1);
+				u32 x1 = min<u32>((tx + TILE) >> (l + 1), levels[l].width());
+				u32 y1 = min<u32>((ty + TILE) >> (l + 1), levels[l].height());
+				reduce(*src, levels[l], x0, y0, x1, y1);
+				src = &levels[l];
+			}
+		};
+		if (scheduler)
+			scheduler->parallel_for(tiles_x * tiles_y, tile);
+		else
+			for (u32 t = 0; t < tiles_x * tiles_y; t++)
+				tile(t);
+	}
+	else
+		tiled = 0;
+	for (u32 l = tiled; l < levels.size(); l++)
+		reduce(l == 0 ? base : levels[l - 1], levels[l], 0, 0, levels[l].width(), levels[l].height());
+	return levels;
+}
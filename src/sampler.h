@@ -0,0 +1,73 @@
+#pragma once
+
+#include "math.h"
+
+/*
+PCG32 random number generator (pcg-random.org).
+
+Every sample of every pixel gets its own generator seeded from the pixel
+coordinates and the sample index, so the random sequence a path sees does
+not depend on which thread renders it or in what order.
+*/
+class Sampler {
+public:
+	Sampler() : Sampler(0) {}
+	Sampler(u64 seed, u64 stream = 0) {
+		state = 0u;
+		inc = (stream << 1u) | 1u;
+		next_u32();
+		state += seed;
+		next_u32();
+	}
+	static Sampler for_pixel(u32 x, u32 y, u32 sample, u32 seed = 0) {
+		u64 pixel = ((u64)y << 32) | x;
+		return Sampler(mix(pixel ^ mix(((u64)seed << 32) | sample)), mix(pixel));
+	}
+
+	u32 next_u32() {
+		u64 old = state;
+		state = old * 6364136223846793005ull + inc;
+		u32 xorshifted = (u32)(((old >> 18u) ^ old) >> 27u);
+		u32 rot = (u32)(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+	// Uniform in [min, max)
+	number_t next(number_t min = 0.f, number_t max = 1.f) {
+		return min + (number_t)(next_u32() >> 8) * (number_t)(1.0 / 16777216.0) * (max - min);
+	}
+private:
+	// splitmix64 finalizer, spreads neighbouring pixels and samples over the whole seed space
+	static u64 mix(u64 z) {
+		z += 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	u64 state;
+	u64 inc;
+};
+
+Vec3 random_vec3(Sampler& sampler, number_t min, number_t max) {
+	number_t x = sampler.next(min, max);
+	number_t y = sampler.next(min, max);
+	number_t z = sampler.next(min, max);
+	return Vec3{ x, y, z };
+}
+
+Vec3 random_in_unit_sphere(Sampler& sampler) {
+	while (true) {
+		Vec3 r = random_vec3(sampler, -1.f, 1.f);
+		if (square_length(r) < 1.f) return r;
+	}
+}
+
+// Uniform on the unit sphere, normal + random_unit_vector is cosine distributed around the normal
+Vec3 random_unit_vector(Sampler& sampler) {
+	while (true) {
+		Vec3 r = random_vec3(sampler, -1.f, 1.f);
+		number_t len2 = square_length(r);
+		if (len2 < 1.f && len2 > 1e-12f)
+			return r * (1.f / std::sqrt(len2));
+	}
+}
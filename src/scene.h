@@ -2,26 +2,159 @@
 
 #include "math.h"
 #include "primitives.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "packet.h"
+#include "lights.h"
+#include "render_stats.h"
 
 #include <optional>
+#include <cfloat>
+#include <memory>
+#include <unordered_map>
+
+enum struct SceneAccelerator {
+	// Reference mode, scans every sphere per query
+	Linear,
+	BVH
+};
+
+/*
+Flat arrays of a built scene, the form the binary scene file stores.
+Sphere arrays hold sphere_count + SphereSoA::PADDING entries, sphere i uses
+materials[material_index[i]]. The emissive spheres are listed in ascending
+order with their cumulative selection weights, see LightList.
+*/
+struct SceneData {
+	u32 sphere_count = 0;
+	const number_t* x = nullptr;
+	const number_t* y = nullptr;
+	const number_t* z = nullptr;
+	const number_t* r = nullptr;
+	const u32* material_index = nullptr;
+	u32 material_count = 0;
+	const Material* materials = nullptr;
+	u32 node_count = 0;
+	const BVH::Node* nodes = nullptr;
+	u32 light_count = 0;
+	const u32* light_spheres = nullptr;
+	const number_t* light_cdf = nullptr;
+	number_t light_max_emission = 0.f;
+};
 
 class Scene {
 public:
 	Scene() = default;
 	~Scene() = default;
+	// Built structures point into each other
+	Scene(const Scene&) = delete;
+	Scene& operator=(const Scene&) = delete;
 
+	// Adds a material unless an equal one is already in the table, returns its index for Sphere::material
+	u32 add_material(const Material& m) {
+		make_owned();
+		auto [it, inserted] = material_lookup.try_emplace(m, (u32)material_storage.size());
+		if (inserted) {
+			material_storage.push_back(m);
+			materials = material_storage.data();
+			material_total = (u32)material_storage.size();
+		}
+		return it->second;
+	}
 	void add_sphere(Sphere s) {
+		make_owned();
 		spheres.push_back(s);
+		bvh = BVH{};
+		built = false;
+	}
+	// Builds the acceleration structures, must be called after the last add_sphere
+	void build() {
+		if (owner) {
+			// Borrowed scenes come built, a missing hierarchy can only be made from owned spheres
+			if (accelerator != SceneAccelerator::BVH || !bvh.empty()) {
+				built = true;
+				return;
+			}
+			make_owned();
+		}
+		if (accelerator == SceneAccelerator::BVH)
+			bvh.build(spheres);
+		geometry.build(spheres);
+		// Material indices in the same (leaf) order as the geometry
+		material_index_storage.resize(spheres.size());
+		for (u32 i = 0; i < (u32)spheres.size(); i++)
+			material_index_storage[i] = spheres[i].material;
+		material_index = material_index_storage.data();
+		lights.build(data());
+		built = true;
+	}
+	// Arrays of a built scene
+	SceneData data() const {
+		SceneData d;
+		d.sphere_count = geometry.size();
+		d.x = geometry.data_x();
+		d.y = geometry.data_y();
+		d.z = geometry.data_z();
+		d.r = geometry.data_r();
+		d.material_index = material_index;
+		d.material_count = material_total;
+		d.materials = materials;
+		d.node_count = bvh.node_count();
+		d.nodes = bvh.data();
+		d.light_count = lights.size();
+		d.light_spheres = lights.sphere_data();
+		d.light_cdf = lights.cdf_data();
+		d.light_max_emission = lights.max_emission();
+		return d;
 	}
+	/*
+	Uses external arrays as the built scene without copying them, 'keep_alive'
+	owns their memory (a mapped file for instance) for as long as the scene does.
+	*/
+	void borrow(const SceneData& d, std::shared_ptr<const void> keep_alive) {
+		spheres.clear();
+		material_storage.clear();
+		material_lookup.clear();
+		material_index_storage.clear();
+		geometry.borrow(d.sphere_count, d.x, d.y, d.z, d.r);
+		bvh = BVH{};
+		if (d.node_count)
+			bvh.borrow(d.nodes, d.node_count);
+		materials = d.materials;
+		material_index = d.material_index;
+		material_total = d.material_count;
+		owner = std::move(keep_alive);
+		lights.borrow(data(), d.light_spheres, d.light_cdf, d.light_count, d.light_max_emission);
+		built = true;
+	}
+	void set_accelerator(SceneAccelerator a) { accelerator = a; }
+	SceneAccelerator get_accelerator() const { return accelerator; }
+	u32 sphere_count() const { return owner ? geometry.size() : (u32)spheres.size(); }
+	u32 bvh_node_count() const { return bvh.node_count(); }
+	u32 material_count() const { return material_total; }
+	// Sphere i of the built scene
+	Sphere sphere(u32 i) const { return Sphere{ geometry.center(i), geometry.radius(i), material_index[i] }; }
+	const Material& get_material(u32 index) const { return materials[index]; }
+	// Emissive spheres of the built scene
+	const LightList& get_lights() const { return lights; }
+
 	struct Result {
 		number_t distance;
 		Vec3 normal;
 		const Material* material;
+		// Index of the nearest sphere, for sphere()
+		u32 sphere;
 	};
 	number_t distance(Vec3 position) const {
+		if (use_bvh())
+			return bvh.nearest(geometry, position);
+		if (built) {
+			u32 i;
+			return geometry.nearest(position, 0, geometry.size(), i);
+		}
 		number_t min_dist = FLT_MAX;
 		for (auto& s : spheres) {
-			number_t sdist = (number_t)abs(::distance(s, position));
+			number_t sdist = std::abs(::distance(s, position));
 			if (sdist < min_dist) {
 				min_dist = sdist;
 			}
@@ -29,29 +162,202 @@ public:
 		return min_dist;
 	}
 	Result distance_and_normal_and_material(Vec3 position) const {
+		if (use_bvh()) {
+			u32 i;
+			number_t dist = bvh.nearest(geometry, position, &i);
+			return { dist, (position - geometry.center(i)).normalize(), material(i), i };
+		}
+		if (built && geometry.size()) {
+			u32 i;
+			number_t dist = geometry.nearest(position, 0, geometry.size(), i);
+			return { dist, (position - geometry.center(i)).normalize(), material(i), i };
+		}
 		number_t min_dist = FLT_MAX;
 		Vec3 norm = Vec3{ 0.f, 1.f, 0.f };
 		const Material* mat{};
-		for (auto& s : spheres) {
-			number_t sdist = abs(::distance(s, position));
+		u32 index = 0;
+		for (u32 i = 0; i < (u32)spheres.size(); i++) {
+			const Sphere& s = spheres[i];
+			number_t sdist = std::abs(::distance(s, position));
 			if (sdist < min_dist) {
 				min_dist = sdist;
 				norm = (position - s.pos).normalize();
-				mat = &s.material;
+				mat = &material_storage[s.material];
+				index = i;
+			}
+		}
+		return { min_dist, norm, mat, index };
+	}
+	struct Hit {
+		Vec3 position;
+		Vec3 normal;
+		const Material* material;
+		u32 sphere;
+	};
+	// Closed form alternative to ray + distance_and_normal_and_material
+	std::optional<Hit> intersect(Ray r, number_t t_min) const {
+		t_min = robust_epsilon(r.origin(), t_min);
+		number_t t = FLT_MAX;
+		u32 index = 0;
+		bool hit = false;
+		if (use_bvh()) {
+			hit = bvh.intersect(geometry, r, t_min, t, index);
+		}
+		else if (built) {
+			for (u32 i = 0; i < geometry.size(); i++) {
+				number_t ti;
+				if (intersect_sphere(geometry.center(i), geometry.radius(i), r.origin(), r.direction(), t_min, ti) && ti < t) {
+					t = ti;
+					index = i;
+					hit = true;
+				}
+			}
+		}
+		else {
+			for (u32 i = 0; i < (u32)spheres.size(); i++) {
+				number_t ti;
+				if (::intersect(spheres[i], r, t_min, ti) && ti < t) {
+					t = ti;
+					index = i;
+					hit = true;
+				}
+			}
+			if (hit) {
+				Vec3 pos = r.origin() + r.direction() * t;
+				return Hit{ pos, (pos - spheres[index].pos).normalize(), &material_storage[spheres[index].material], index };
 			}
 		}
-		return { min_dist, norm, mat };
+		if (!hit)
+			return {};
+		Vec3 pos = r.origin() + r.direction() * t;
+		return Hit{ pos, (pos - geometry.center(index)).normalize(), material(index), index };
+	}
+	/*
+	Packet versions of intersect and ray. Every active lane gets exactly the
+	result the single ray call would give, the lanes just share the traversal.
+	Both return the mask of lanes that hit.
+	*/
+	template<u32 N>
+	u32 intersect_packet(const RayPacket<N>& p, number_t t_min, Hit* hits) const {
+		number_t t[N];
+		number_t lane_t_min[N];
+		u32 index[N];
+		u32 hit = 0;
+		for_each_lane(p.active, [&](u32 l) {
+			lane_t_min[l] = robust_epsilon(p.origin(l), t_min);
+		});
+		if (use_bvh()) {
+			hit = bvh.intersect_packet(geometry, p, p.active, lane_t_min, t, index);
+		}
+		else {
+			// Packets are only traced against built scenes
+			for (u32 l = 0; l < N; l++)
+				t[l] = FLT_MAX;
+			for (u32 i = 0; i < geometry.size(); i++) {
+				for_each_lane(p.active, [&](u32 l) {
+					number_t ti;
+					if (intersect_sphere(geometry.center(i), geometry.radius(i), p.origin(l), p.direction(l), lane_t_min[l], ti) && ti < t[l]) {
+						t[l] = ti;
+						index[l] = i;
+						hit |= 1u << l;
+					}
+				});
+			}
+		}
+		for_each_lane(hit, [&](u32 l) {
+			Vec3 pos = p.origin(l) + p.direction(l) * t[l];
+			hits[l] = Hit{ pos, (pos - geometry.center(index[l])).normalize(), material(index[l]), index[l] };
+		});
+		return hit;
+	}
+	// Marches every lane, lanes that hit are left at their hit position
+	template<u32 N>
+	u32 ray_packet(RayPacket<N>& p, u32 max_steps, number_t EPSILON) const {
+		u32 marching = p.active;
+		u32 hit = 0;
+		for (u32 i = 0; i < max_steps && marching; i++) {
+			PATHTRACER_STAT(thread_render_stats().march_steps += std::popcount(marching));
+			number_t dist[N];
+			distance_packet(p, marching, dist);
+			for_each_lane(marching, [&](u32 l) {
+				if (dist[l] < robust_epsilon(p.origin(l), EPSILON)) {
+					hit |= 1u << l;
+					marching &= ~(1u << l);
+				}
+				else {
+					p.advance(l, dist[l]);
+				}
+			});
+		}
+		PATHTRACER_STAT(thread_render_stats().max_step_misses += std::popcount(marching));
+		return hit;
 	}
 	std::optional<Vec3> ray(Ray r, u32 max_steps, number_t EPSILON) const {
 		for (u32 i = 0; i < max_steps; i++) {
+			PATHTRACER_STAT(thread_render_stats().march_steps++);
 			auto dist = distance(r.origin());
-			if (dist < EPSILON) {
+			if (dist < robust_epsilon(r.origin(), EPSILON)) {
 				return r.origin();
 			}
 			r = r.advance(dist);
 		}
+		PATHTRACER_STAT(thread_render_stats().max_step_misses++);
 		return {};
 	}
 private:
+	template<u32 N>
+	void distance_packet(const RayPacket<N>& p, u32 mask, number_t* dist) const {
+		if (use_bvh()) {
+			bvh.nearest_packet(geometry, p, mask, dist);
+		}
+		else if (built) {
+			for (u32 l = 0; l < N; l++)
+				dist[l] = FLT_MAX;
+			geometry.nearest_packet<N>(p.ox, p.oy, p.oz, 0, geometry.size(), dist);
+		}
+		else {
+			for_each_lane(mask, [&](u32 l) {
+				dist[l] = distance(p.origin(l));
+			});
+		}
+	}
+	bool use_bvh() const {
+		return built && accelerator == SceneAccelerator::BVH && !bvh.empty();
+	}
+	const Material* material(u32 i) const {
+		return &materials[material_index[i]];
+	}
+	// Copies a borrowed scene into owned storage so it can be changed, it has to be built again afterwards
+	void make_owned() {
+		if (!owner)
+			return;
+		spheres.resize(geometry.size());
+		for (u32 i = 0; i < geometry.size(); i++)
+			spheres[i] = sphere(i);
+		material_storage.assign(materials, materials + material_total);
+		materials = material_storage.data();
+		material_lookup.clear();
+		for (u32 i = 0; i < material_total; i++)
+			material_lookup.try_emplace(material_storage[i], i);
+		geometry = SphereSoA{};
+		bvh = BVH{};
+		material_index = nullptr;
+		owner.reset();
+		built = false;
+	}
+
+	// Spheres as added, the built structures below are derived from them or borrowed
 	std::vector<Sphere> spheres;
+	SceneAccelerator accelerator = SceneAccelerator::BVH;
+	BVH bvh;
+	SphereSoA geometry;
+	std::vector<Material> material_storage;
+	std::unordered_map<Material, u32, MaterialHash> material_lookup;
+	std::vector<u32> material_index_storage;
+	const Material* materials = nullptr;
+	const u32* material_index = nullptr;
+	u32 material_total = 0;
+	std::shared_ptr<const void> owner;
+	LightList lights;
+	bool built = false;
 };
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "math.h"
+#include "scene.h"
+#include "scene_io.h"
+#include "scenes.h"
+
+#include <iostream>
+#include <string>
+#include <chrono>
+
+/*
+Converts scene files between the text (.scene) and binary (.sceneb) forms,
+the format of each side comes from its extension.
+
+	pathtracer_scene IN OUT
+	pathtracer_scene --generate=N OUT	writes the random ball demo scene with N balls
+	pathtracer_scene --check IN	loads IN and also checks every sphere's indices, which binary loads trust
+*/
+int main(int argc, const char* argv[]) {
+	if (argc != 3) {
+		std::cerr << "Usage: pathtracer_scene IN OUT" << std::endl;
+		std::cerr << "       pathtracer_scene --generate=N OUT" << std::endl;
+		std::cerr << "       pathtracer_scene --check IN" << std::endl;
+		return -1;
+	}
+	std::string in = argv[1], out = argv[2];
+
+	if (in == "--check") {
+		Scene scene;
+		if (!load_scene(out, scene)) {
+			std::cerr << "Failed to load " << out << std::endl;
+			return -1;
+		}
+		scene.build();
+		if (!check_scene_indices(scene)) {
+			std::cerr << out << " is corrupt" << std::endl;
+			return -1;
+		}
+		std::cerr << out << ": " << scene.sphere_count() << " spheres, " << scene.material_count() << " materials, " << scene.bvh_node_count() << " bvh nodes, all indices valid" << std::endl;
+		return 0;
+	}
+
+	Scene scene;
+	auto t0 = std::chrono::high_resolution_clock::now();
+	if (in.substr(0, 11) == "--generate=") {
+		generate_scene_1(scene, ::atoi(in.substr(11).c_str()));
+	}
+	else if (!load_scene(in, scene)) {
+		std::cerr << "Failed to load " << in << std::endl;
+		return -1;
+	}
+	// Binary files store the hierarchy so loading never has to build it
+	scene.set_accelerator(SceneAccelerator::BVH);
+	scene.build();
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	if (!save_scene(out, scene)) {
+		std::cerr << "Failed to write " << out << std::endl;
+		return -1;
+	}
+	auto t2 = std::chrono::high_resolution_clock::now();
+	std::cerr << scene.sphere_count() << " spheres, " << scene.material_count() << " materials, " << scene.bvh_node_count() << " bvh nodes. "
+		<< "Load and build " << std::chrono::duration<double, std::milli>(t1 - t0).count() << "ms, "
+		<< "write " << std::chrono::duration<double, std::milli>(t2 - t1).count() << "ms" << std::endl;
+	return 0;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "math.h"
+#include "scene.h"
+#include "mapped_file.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <iostream>
+
+/*
+Scene files.
+
+Text (.scene), one record per line, '#' starts a comment:
+	material lambertian REFLECTANCE ALBEDO_R ALBEDO_G ALBEDO_B EMISSIVE_R EMISSIVE_G EMISSIVE_B
+	material metallic SHININESS EMISSIVE_R EMISSIVE_G EMISSIVE_B
+	material dielectric REFRACTIVE_INDEX EMISSIVE_R EMISSIVE_G EMISSIVE_B
+	sphere X Y Z RADIUS MATERIAL
+Materials are numbered from 0 in the order they appear, a sphere can only
+use a material defined before it.
+
+Binary (.sceneb), the arrays of a built Scene as they are in memory, each
+section 64 byte aligned. Loading maps the file and the scene renders
+straight from the mapping, the sphere arrays are not read on load. The
+emissive spheres and their selection weights are saved as sections of
+their own and borrowed like the rest.
+The file is only readable by builds with the same number_t and layouts.
+
+Loading checks the header, that every section lies inside the file, the
+material table and the hierarchy, which is a fraction of the file. The
+per sphere material indices and the light list are trusted,
+check_scene_indices (pathtracer_scene --check) verifies those too.
+*/
+enum struct SceneFormat {
+	Text,
+	Binary,
+	Unknown
+};
+
+SceneFormat scene_format_from_path(const std::string& filepath) {
+	auto dot = filepath.find_last_of('.');
+	if (dot == std::string::npos)
+		return SceneFormat::Unknown;
+	std::string ext = filepath.substr(dot + 1);
+	if (ext == "scene")
+		return SceneFormat::Text;
+	if (ext == "sceneb")
+		return SceneFormat::Binary;
+	return SceneFormat::Unknown;
+}
+
+struct SceneFileHeader {
+	char magic[4] = { 'P', 'T', 'S', 'C' };
+	u32 version = 2;
+	// Rejects files from builds with another byte order, number_t or struct layouts
+	u32 byte_order = 0x01020304;
+	u32 number_size = sizeof(number_t);
+	u32 material_size = sizeof(Material);
+	u32 node_size = sizeof(BVH::Node);
+	u32 sphere_count = 0;
+	u32 material_count = 0;
+	u32 node_count = 0;
+	u32 light_count = 0;
+	u32 padding = SphereSoA::PADDING;
+	// Byte offsets of the sections from the start of the file
+	u64 x = 0, y = 0, z = 0, r = 0;
+	u64 material_index = 0;
+	u64 materials = 0;
+	u64 nodes = 0;
+	u64 light_spheres = 0, light_cdf = 0;
+	// Brightest channel of any light, stored so loading does not visit the lights
+	double light_max_emission = 0.;
+	u64 size = 0;
+};
+
+bool save_scene_binary(const std::string& filepath, const Scene& scene) {
+	SceneData d = scene.data();
+	SceneFileHeader header;
+	header.sphere_count = d.sphere_count;
+	header.material_count = d.material_count;
+	header.node_count = d.node_count;
+	header.light_count = d.light_count;
+	header.light_max_emission = d.light_max_emission;
+
+	struct Section {
+		u64* offset;
+		const void* data;
+		size_t size;
+	};
+	size_t sphere_bytes = ((size_t)d.sphere_count + SphereSoA::PADDING) * sizeof(number_t);
+	Section sections[] = {
+		{ &header.x, d.x, sphere_bytes },
+		{ &header.y, d.y, sphere_bytes },
+		{ &header.z, d.z, sphere_bytes },
+		{ &header.r, d.r, sphere_bytes },
+		{ &header.material_index, d.material_index, (size_t)d.sphere_count * sizeof(u32) },
+		{ &header.materials, d.materials, (size_t)d.material_count * sizeof(Material) },
+		{ &header.nodes, d.nodes, (size_t)d.node_count * sizeof(BVH::Node) },
+		{ &header.light_spheres, d.light_spheres, (size_t)d.light_count * sizeof(u32) },
+		{ &header.light_cdf, d.light_cdf, (size_t)d.light_count * sizeof(number_t) },
+	};
+	auto align = [](u64 v) { return (v + 63) & ~(u64)63; };
+	u64 offset = align(sizeof(header));
+	for (auto& s : sections) {
+		*s.offset = offset;
+		offset = align(offset + s.size);
+	}
+	header.size = offset;
+
+	std::ofstream fs(filepath, std::ios::binary | std::ios::trunc);
+	if (!fs)
+		return false;
+	const char zeros[64]{};
+	u64 written = sizeof(header);
+	fs.write((const char*)&header, sizeof(header));
+	for (auto& s : sections) {
+		fs.write(zeros, *s.offset - written);
+		if (s.size)
+			fs.write((const char*)s.data, s.size);
+		written = *s.offset + s.size;
+	}
+	fs.write(zeros, header.size - written);
+	return (bool)fs;
+}
+
+bool load_scene_binary(const std::string& filepath, Scene& scene) {
+	auto file = MappedFile::open(filepath);
+	if (!file || file->size() < sizeof(SceneFileHeader))
+		return false;
+	SceneFileHeader header, expected;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, expected.magic, 4) != 0 || header.version != expected.version ||
+		header.byte_order != expected.byte_order || header.number_size != expected.number_size ||
+		header.material_size != expected.material_size || header.node_size != expected.node_size ||
+		header.padding != expected.padding || header.size > file->size())
+		return false;
+
+	// Sections have to lie inside the file and be aligned for their type
+	auto section = [&](u64 offset, size_t bytes) -> const u8* {
+		if (offset % 64 != 0 || offset > header.size || bytes > header.size - offset)
+			return nullptr;
+		return file->data() + offset;
+	};
+	size_t sphere_bytes = ((size_t)header.sphere_count + SphereSoA::PADDING) * sizeof(number_t);
+	SceneData d;
+	d.sphere_count = header.sphere_count;
+	d.x = (const number_t*)section(header.x, sphere_bytes);
+	d.y = (const number_t*)section(header.y, sphere_bytes);
+	d.z = (const number_t*)section(header.z, sphere_bytes);
+	d.r = (const number_t*)section(header.r, sphere_bytes);
+	d.material_index = (const u32*)section(header.material_index, (size_t)header.sphere_count * sizeof(u32));
+	d.material_count = header.material_count;
+	d.materials = (const Material*)section(header.materials, (size_t)header.material_count * sizeof(Material));
+	d.node_count = header.node_count;
+	d.nodes = (const BVH::Node*)section(header.nodes, (size_t)header.node_count * sizeof(BVH::Node));
+	d.light_count = header.light_count;
+	d.light_spheres = (const u32*)section(header.light_spheres, (size_t)header.light_count * sizeof(u32));
+	d.light_cdf = (const number_t*)section(header.light_cdf, (size_t)header.light_count * sizeof(number_t));
+	d.light_max_emission = (number_t)header.light_max_emission;
+	if (!d.x || !d.y || !d.z || !d.r || !d.material_index || !d.materials || !d.nodes || !d.light_spheres || !d.light_cdf)
+		return false;
+	if ((d.sphere_count > 0 && d.material_count == 0) || d.light_count > d.sphere_count)
+		return false;
+	for (u32 i = 0; i < d.material_count; i++)
+		if ((u32)d.materials[i].type > (u32)MaterialType::Dielectric)
+			return false;
+	if (!BVH::valid(d.nodes, d.node_count, d.sphere_count))
+		return false;
+	scene.borrow(d, file);
+	return true;
+}
+
+/*
+The checks loading a binary scene leaves out: every sphere's material
+exists and the lights are spheres of the scene in ascending order. Prints
+the first problem found, takes time in proportion to the sphere count.
+*/
+bool check_scene_indices(const Scene& scene) {
+	SceneData d = scene.data();
+	for (u32 i = 0; i < d.sphere_count; i++)
+		if (d.material_index[i] >= d.material_count) {
+			std::cerr << "sphere " << i << ": undefined material " << d.material_index[i] << std::endl;
+			return false;
+		}
+	for (u32 i = 0; i < d.light_count; i++)
+		if (d.light_spheres[i] >= d.sphere_count || (i > 0 && d.light_spheres[i] <= d.light_spheres[i - 1])) {
+			std::cerr << "light " << i << ": bad sphere " << d.light_spheres[i] << std::endl;
+			return false;
+		}
+	return true;
+}
+
+bool load_scene_text(const std::string& filepath, Scene& scene) {
+	auto file = MappedFile::open(filepath);
+	if (!file)
+		return false;
+	// strtod needs a terminated string
+	std::string text((const char*)file->data(), file->size());
+
+	// Scene table index of every material in the file, equal materials share one entry
+	std::vector<u32> materials;
+	const char* c = text.c_str();
+	u32 line = 1;
+	auto fail = [&](const char* what) {
+		std::cerr << filepath << ":" << line << ": " << what << std::endl;
+		return false;
+	};
+	auto number = [&](number_t& v) {
+		// strtod would skip newlines as whitespace, fields of a record have to be on its line
+		while (*c == ' ' || *c == '\t')
+			c++;
+		if (*c == '\n' || *c == '\r')
+			return false;
+		char* end;
+		v = (number_t)strtod(c, &end);
+		if (end == c)
+			return false;
+		c = end;
+		return true;
+	};
+	auto vec3 = [&](Vec3& v) {
+		return number(v.x) && number(v.y) && number(v.z);
+	};
+	auto word = [&]() {
+		while (*c == ' ' || *c == '\t' || *c == '\r')
+			c++;
+		const char* begin = c;
+		while (*c && !isspace((unsigned char)*c))
+			c++;
+		return std::string(begin, c);
+	};
+
+	while (*c) {
+		std::string keyword = word();
+		if (keyword.empty() || keyword[0] == '#') {
+			while (*c && *c != '\n')
+				c++;
+		}
+		else if (keyword == "material") {
+			std::string type = word();
+			Material m;
+			bool ok;
+			if (type == "lambertian") {
+				m.type = MaterialType::Lambertian;
+				ok = number(m.l.reflectance) && vec3(m.l.albedo) && vec3(m.l.emissive);
+			}
+			else if (type == "metallic") {
+				m.type = MaterialType::Metallic;
+				ok = number(m.m.shininess) && vec3(m.m.emissive);
+			}
+			else if (type == "dielectric") {
+				m.type = MaterialType::Dielectric;
+				ok = number(m.d.refractive_index) && vec3(m.d.emissive);
+			}
+			else
+				return fail("unknown material type");
+			if (!ok)
+				return fail("bad material");
+			materials.push_back(scene.add_material(m));
+		}
+		else if (keyword == "sphere") {
+			Sphere s;
+			number_t index;
+			if (!vec3(s.pos) || !number(s.radius) || !number(index))
+				return fail("bad sphere");
+			if (index < 0 || index >= materials.size())
+				return fail("undefined material");
+			s.material = materials[(u32)index];
+			scene.add_sphere(s);
+		}
+		else
+			return fail("unknown record");
+
+		while (*c == ' ' || *c == '\t' || *c == '\r')
+			c++;
+		if (*c == '\n') {
+			c++;
+			line++;
+		}
+		else if (*c)
+			return fail("trailing characters");
+	}
+	return true;
+}
+
+// Writes a built scene, numbers are printed with enough digits to load back exactly
+bool save_scene_text(const std::string& filepath, const Scene& scene) {
+	SceneData d = scene.data();
+	FILE* f = fopen(filepath.c_str(), "wb");
+	if (!f)
+		return false;
+	fprintf(f, "# pathtracer scene, %u spheres, %u materials\n", d.sphere_count, d.material_count);
+	for (u32 i = 0; i < d.material_count; i++) {
+		const Material& m = d.materials[i];
+		switch (m.type) {
+		case MaterialType::Lambertian:
+			fprintf(f, "material lambertian %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n", m.l.reflectance,
+				m.l.albedo.x, m.l.albedo.y, m.l.albedo.z, m.l.emissive.x, m.l.emissive.y, m.l.emissive.z);
+			break;
+		case MaterialType::Metallic:
+			fprintf(f, "material metallic %.17g %.17g %.17g %.17g\n", m.m.shininess, m.m.emissive.x, m.m.emissive.y, m.m.emissive.z);
+			break;
+		case MaterialType::Dielectric:
+			fprintf(f, "material dielectric %.17g %.17g %.17g %.17g\n", m.d.refractive_index, m.d.emissive.x, m.d.emissive.y, m.d.emissive.z);
+			break;
+		}
+	}
+	for (u32 i = 0; i < d.sphere_count; i++)
+		fprintf(f, "sphere %.17g %.17g %.17g %.17g %u\n", d.x[i], d.y[i], d.z[i], d.r[i], d.material_index[i]);
+	bool ok = !ferror(f);
+	return fclose(f) == 0 && ok;
+}
+
+bool load_scene(const std::string& filepath, Scene& scene) {
+	switch (scene_format_from_path(filepath)) {
+	case SceneFormat::Text: return load_scene_text(filepath, scene);
+	case SceneFormat::Binary: return load_scene_binary(filepath, scene);
+	default: return false;
+	}
+}
+
+// The scene has to be built, binary files only carry a hierarchy if it was built with one
+bool save_scene(const std::string& filepath, const Scene& scene) {
+	switch (scene_format_from_path(filepath)) {
+	case SceneFormat::Text: return save_scene_text(filepath, scene);
+	case SceneFormat::Binary: return save_scene_binary(filepath, scene);
+	default: return false;
+	}
+}
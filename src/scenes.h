@@ -0,0 +1,135 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+#include "primitives.h"
+#include "scene.h"
+#include "camera.h"
+
+void generate_scene_1(Scene& scene, u32 ball_count) {
+	Material red_mat{
+		.type = MaterialType::Lambertian,
+		.l = {
+			.reflectance = .3f,
+			.albedo = {.7f, .4f, .4f}
+		}
+	};
+
+	Material reflective_mat{
+		.type = MaterialType::Metallic,
+		.m = {
+			.shininess = 1.f
+		}
+	};
+
+	Material glass_mat{
+		.type = MaterialType::Dielectric,
+		.d = {
+			.refractive_index = 1.3f
+		}
+	};
+
+	Material blue_mat{
+		.type = MaterialType::Lambertian,
+		.l = {
+			.reflectance = .5f,
+			.albedo = {0.f, 0.f, 1.f}
+		}
+	};
+	// Ground sphere
+	scene.add_sphere(Sphere{
+		.pos = {0.f, -100.f, 0.f},
+		.radius = 100.f,
+		.material = scene.add_material(red_mat)
+					 });
+	/*scene.add_sphere(Sphere{
+		.pos = {-.5f, 0.5f, 0.f},
+		.radius = .5f,
+		.material = scene.add_material(reflective_mat)
+					 });
+	scene.add_sphere(Sphere{
+		.pos = {.75f, 0.75f, 0.f},
+		.radius = .75f,
+		.material = scene.add_material(blue_mat)
+					 });
+	scene.add_sphere(Sphere{
+		.pos = {0.f, 0.7f, -3.f},
+		.radius = 0.7f,
+		.material = scene.add_material(glass_mat)
+	});*/
+	// Sky sphere
+	scene.add_sphere(Sphere{
+		.pos = {0.f, 5000.f, 0.f},
+		.radius = 4000.f,
+		.material = scene.add_material({
+			.type = MaterialType::Lambertian,
+			.l = {
+				.reflectance = 0.f,
+				.albedo = {1.f, 1.f, 1.f},
+				.emissive = {.7f, .7f, .7f},
+			}
+		})
+	});
+
+	RandomDevice rd(5000);
+
+	auto random_ball = [rd = &rd, scene = &scene]() -> Sphere {
+		auto random_mat = [rd = rd]() -> Material {
+			MaterialType mats[]{MaterialType::Lambertian, MaterialType::Dielectric, MaterialType::Metallic};
+			MaterialType selected_mat = (MaterialType)((u32)(rd->random_num() * 2.999));
+			if (selected_mat == MaterialType::Lambertian) {
+				return Material{
+					.type = MaterialType::Lambertian,
+					.l = {
+						.reflectance = rd->random_num(),
+						.albedo = {rd->random_num(), rd->random_num(), rd->random_num()},
+						.emissive = {rd->random_num() * 0.2f, rd->random_num() * 0.2f, rd->random_num() * 0.2f}
+					}
+				};
+			}
+			else if (selected_mat == MaterialType::Metallic) {
+				return Material{
+					.type = MaterialType::Metallic,
+					.m = {
+						.shininess = 0.5f + 0.5f * rd->random_num(),
+						.emissive = {0.f, 0.f, 0.f}
+					}
+				};
+			}
+			else if(selected_mat == MaterialType::Dielectric) {
+				return Material{
+					.type = MaterialType::Dielectric,
+					.d = {
+						.refractive_index = 1.3f,
+						.emissive = {0.f, 0.f, 0.f}
+					}
+				};
+			}
+			else {
+				throw;
+			}
+		};
+		number_t rad = .1f + rd->random_num() * .5f;
+
+		return Sphere{
+			.pos = Vec3{rd->random_num(-.1f, .1f), 1.f, rd->random_num(-.1f, .1f)}.normalize() * (100.f + rad) + Vec3{0.f, -100.f, 0.f},
+			.radius = rad,
+			.material = scene->add_material(random_mat())
+		};
+	};
+	number_t cur_dist = 0.f;
+	for (u32 i = 0; i < ball_count; i++) {
+		auto ball = random_ball();
+		number_t ang = rd.random_num() * 3.14145f * 2.f;
+		cur_dist += rd.random_num() * 0.01;
+		ball.pos = Vec3{std::sin(ang) * cur_dist, 1.f, std::cos(ang) * cur_dist}.normalize() * (100.f + ball.radius) + Vec3{0.f, -100.f, 0.f};
+		scene.add_sphere(ball);
+	}
+
+}
+
+void setup_camera_1(Camera& cam) {
+	cam.set_focal_distance(50.f);
+	cam.set_position({ 0.f, 50.f, -150.f });
+	cam.set_rotation(3.1415 / 10, 0.f, 0.f);
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "math.h"
+#include "trace.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+struct TileRange {
+	u32 x, y, w, h;
+};
+
+/*
+Handle for one batch of work submitted to a TaskScheduler.
+The destructor waits, so a group can not go out of scope while workers still
+reference it. The last index is counted down under done_mutex and every
+way of seeing the group done takes that mutex afterwards, so a group may
+be destroyed as soon as it reports done: the worker that finished it is no
+longer touching it.
+*/
+class TaskGroup {
+public:
+	TaskGroup() = default;
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+	~TaskGroup() {
+		wait();
+	}
+
+	void wait() {
+		std::unique_lock l(done_mutex);
+		done_cv.wait(l, [this]() { return remaining.load() == 0; });
+	}
+	// Returns true if the group finished within the timeout
+	template<typename Rep, typename Period>
+	bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+		std::unique_lock l(done_mutex);
+		return done_cv.wait_for(l, timeout, [this]() { return remaining.load() == 0; });
+	}
+	bool is_done() const {
+		if (remaining.load() != 0)
+			return false;
+		// Waits out the worker that is still notifying
+		std::lock_guard l(done_mutex);
+		return true;
+	}
+	u32 total() const { return total_count; }
+	u32 completed() const { return total_count - remaining.load(); }
+private:
+	friend class TaskScheduler;
+
+	void run(u32 index) {
+		fn(index);
+		// Only the count down to zero needs the lock
+		u32 r = remaining.load();
+		while (r > 1)
+			if (remaining.compare_exchange_weak(r, r - 1))
+				return;
+		std::lock_guard l(done_mutex);
+		if (remaining.fetch_sub(1) == 1)
+			done_cv.notify_all();
+	}
+
+	std::function<void(u32)> fn;
+	u32 total_count = 0;
+	std::atomic<u32> remaining = 0;
+	mutable std::mutex done_mutex;
+	std::condition_variable done_cv;
+};
+
+/*
+Work stealing scheduler.
+
+Each worker owns a deque of index ranges. A worker takes single indices from
+the back of its own deque and, once that runs dry, steals half of the front
+range of another worker. Workers that find nothing to steal park on a
+condition variable instead of spinning. With a Tracer set, workers record
+the time they spend looking for work ("idle") and parked ("park").
+*/
+class TaskScheduler {
+public:
+	TaskScheduler(u32 n = 7) {
+		n = std::max<u32>(n, 1);
+		workers.reserve(n);
+		for (u32 i = 0; i < n; i++)
+			workers.push_back(std::make_unique<Worker>());
+		for (u32 i = 0; i < n; i++)
+			workers[i]->thread = std::thread([this, i]() { worker_loop(i); });
+	}
+	~TaskScheduler() {
+		{
+			std::lock_guard l(park_mutex);
+			terminate = true;
+		}
+		park_cv.notify_all();
+		for (auto& w : workers)
+			w->thread.join();
+	}
+
+	// Runs fn(i) for i in [0, count) on the workers, returns without waiting
+	void parallel_for(TaskGroup& group, u32 count, std::function<void(u32)> fn) {
+		group.wait();
+		group.fn = std::move(fn);
+		group.total_count = count;
+		group.remaining = count;
+		if (count == 0)
+			return;
+
+		// Hand every worker a contiguous block, stealing balances the rest
+		u32 n = (u32)workers.size();
+		for (u32 i = 0; i < n; i++) {
+			u32 begin = (u32)((u64)count * i / n);
+			u32 end = (u32)((u64)count * (i + 1) / n);
+			if (begin == end)
+				continue;
+			std::lock_guard l(workers[i]->mutex);
+			workers[i]->deque.push_back(WorkItem{ &group, begin, end });
+		}
+		queued.fetch_add(count);
+		{
+			std::lock_guard l(park_mutex);
+		}
+		park_cv.notify_all();
+	}
+	// Splits w x h into tiles of at most tile_w x tile_h in row major order
+	void parallel_for_2d(TaskGroup& group, u32 w, u32 h, u32 tile_w, u32 tile_h, std::function<void(TileRange)> fn) {
+		u32 tiles_x = (w + tile_w - 1) / tile_w;
+		u32 tiles_y = (h + tile_h - 1) / tile_h;
+		parallel_for(group, tiles_x * tiles_y, [=, fn = std::move(fn)](u32 i) {
+			u32 x = (i % tiles_x) * tile_w;
+			u32 y = (i / tiles_x) * tile_h;
+			fn(TileRange{ x, y, min<u32>(tile_w, w - x), min<u32>(tile_h, h - y) });
+		});
+	}
+	// Blocking variants
+	void parallel_for(u32 count, std::function<void(u32)> fn) {
+		TaskGroup group;
+		parallel_for(group, count, std::move(fn));
+		group.wait();
+	}
+	void parallel_for_2d(u32 w, u32 h, u32 tile_w, u32 tile_h, std::function<void(TileRange)> fn) {
+		TaskGroup group;
+		parallel_for_2d(group, w, h, tile_w, tile_h, std::move(fn));
+		group.wait();
+	}
+
+	/*
+	Waits for a group submitted from inside a task. A worker runs other
+	queued work meanwhile instead of blocking, so nested groups can not
+	starve the pool. Other threads simply wait.
+	*/
+	void wait_helping(TaskGroup& group) {
+		u32 self = worker_thread_index();
+		if (self >= workers.size()) {
+			group.wait();
+			return;
+		}
+		while (!group.is_done()) {
+			TaskGroup* next;
+			u32 index;
+			if (pop_local(self, next, index))
+				next->run(index);
+			else if (!steal(self))
+				std::this_thread::yield();
+		}
+	}
+
+	u32 thread_count() const { return (u32)workers.size(); }
+	// Indices submitted but not started yet
+	u32 pending() const { return queued.load(); }
+	// The tracer has to outlive the scheduler or be unset first, nullptr stops tracing
+	void set_tracer(Tracer* t) { tracer.store(t, std::memory_order_relaxed); }
+	Tracer* get_tracer() const { return tracer.load(std::memory_order_relaxed); }
+private:
+	struct WorkItem {
+		TaskGroup* group;
+		u32 begin, end;
+	};
+	struct Worker {
+		std::mutex mutex;
+		std::deque<WorkItem> deque;
+		std::thread thread;
+	};
+
+	bool pop_local(u32 self, TaskGroup*& group, u32& index) {
+		Worker& w = *workers[self];
+		std::lock_guard l(w.mutex);
+		if (w.deque.empty())
+			return false;
+		WorkItem& item = w.deque.back();
+		group = item.group;
+		index = item.begin++;
+		if (item.begin == item.end)
+			w.deque.pop_back();
+		queued.fetch_sub(1);
+		return true;
+	}
+	bool steal(u32 self) {
+		u32 n = (u32)workers.size();
+		for (u32 k = 1; k < n; k++) {
+			Worker& victim = *workers[(self + k) % n];
+			WorkItem stolen;
+			{
+				std::lock_guard l(victim.mutex);
+				if (victim.deque.empty())
+					continue;
+				WorkItem& item = victim.deque.front();
+				u32 take = (item.end - item.begin + 1) / 2;
+				stolen = WorkItem{ item.group, item.end - take, item.end };
+				item.end -= take;
+				if (item.begin == item.end)
+					victim.deque.pop_front();
+			}
+			std::lock_guard l(workers[self]->mutex);
+			workers[self]->deque.push_back(stolen);
+			return true;
+		}
+		return false;
+	}
+	void worker_loop(u32 self) {
+		const u32 SPIN_ROUNDS = 64;
+		u32 idle_rounds = 0;
+		worker_thread_index() = self;
+		// Tracer and start of the current idle stretch, only set while tracing
+		Tracer* idle_tracer = nullptr;
+		u64 idle_start = 0;
+		auto end_idle = [&]() {
+			if (idle_tracer)
+				idle_tracer->record("idle", idle_start);
+			idle_tracer = nullptr;
+		};
+		while (true) {
+			TaskGroup* group;
+			u32 index;
+			if (pop_local(self, group, index)) {
+				end_idle();
+				group->run(index);
+				idle_rounds = 0;
+				continue;
+			}
+			if (steal(self)) {
+				idle_rounds = 0;
+				continue;
+			}
+			if (idle_rounds == 0 && !idle_tracer && (idle_tracer = get_tracer()))
+				idle_start = idle_tracer->now();
+			if (++idle_rounds < SPIN_ROUNDS) {
+				std::this_thread::yield();
+				continue;
+			}
+			idle_rounds = 0;
+			end_idle();
+			Tracer* park_tracer = get_tracer();
+			u64 park_start = park_tracer ? park_tracer->now() : 0;
+			std::unique_lock l(park_mutex);
+			park_cv.wait(l, [this]() { return terminate || queued.load() > 0; });
+			if (terminate)
+				return;
+			l.unlock();
+			// Parked since before tracing started if the tracer was set meanwhile
+			if (Tracer* t = get_tracer())
+				t->record("park", t == park_tracer ? park_start : 0);
+		}
+	}
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::atomic<Tracer*> tracer = nullptr;
+	// Indices submitted but not yet started, workers park while this is zero
+	std::atomic<u32> queued = 0;
+	std::mutex park_mutex;
+	std::condition_variable park_cv;
+	bool terminate = false;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+#include "sampler.h"
+#include "lights.h"
+
+#include <optional>
+
+/*
+What a surface hit does to a path: light emitted towards it, what it
+multiplies the throughput by and the continuation ray. 'pdf' is the solid
+angle density of the ray's direction for multiple importance sampling
+against light sampling, 0 for materials that are not light sampled.
+*/
+struct Scatter {
+	Vec3 emissive;
+	Vec3 factor;
+	Ray ray;
+	number_t pdf;
+};
+
+/*
+Per material scattering. The megakernel dispatches on the material type per
+hit, the wavefront engine calls these on whole queues of one material.
+'advance' moves the new ray off the surface to reduce self intersection.
+*/
+Scatter scatter_metallic(const Metallic& m, const Ray& ray, const Vec3& pos, const Vec3& normal, number_t advance, Sampler& sampler) {
+	Vec3 scatter_dir = reflect(ray.direction(), normal) + random_in_unit_sphere(sampler) * (1.f - m.shininess);
+	return Scatter{ m.emissive, Vec3{ 1.f, 1.f, 1.f }, Ray(pos, scatter_dir).advance(advance), 0.f };
+}
+
+// Cosine distributed around the normal, so the throughput only picks up the albedo
+Scatter scatter_lambertian(const Lambertian& l, const Ray&, const Vec3& pos, const Vec3& normal, number_t advance, Sampler& sampler) {
+	Vec3 target = pos + normal + random_unit_vector(sampler);
+	Vec3 scatter_dir = target - pos;
+	Ray scattered = Ray(pos, scatter_dir).advance(advance);
+	number_t pdf = std::max<number_t>(dot(normal, scattered.direction()), 0.f) / PI;
+	return Scatter{ l.emissive, l.albedo * l.reflectance, scattered, pdf };
+}
+
+/*
+Russian roulette: a path survives with the probability of its brightest
+throughput channel (up to 1) and survivors are divided by it, so the
+expected contribution stays the same. Returns false for paths that stop.
+*/
+bool russian_roulette(Vec3& factor, Sampler& sampler) {
+	number_t survive = std::min<number_t>(max(factor.x, factor.y, factor.z), 1.f);
+	if (survive >= 1.f)
+		return true;
+	if (survive <= 0.f || sampler.next() >= survive)
+		return false;
+	factor = factor * (1.f / survive);
+	return true;
+}
+
+// Light a shadow ray may bring to a lambertian hit, to be added times the path throughput if the ray's first hit is 'sphere'
+struct DirectLight {
+	Ray shadow_ray;
+	u32 sphere;
+	Vec3 radiance;
+};
+
+/*
+Next event estimation at a lambertian hit: a light sample from 'lights',
+weighted against the cosine sampling of scatter_lambertian with the power
+heuristic. Draws the light sample's random numbers even when it returns
+nothing, so the scatter after it sees the same sequence either way.
+*/
+std::optional<DirectLight> sample_direct_lambertian(const Lambertian& l, const LightList& lights, const Vec3& pos, const Vec3& normal, number_t advance, Sampler& sampler) {
+	LightSample ls;
+	if (!lights.sample(pos, sampler, ls))
+		return {};
+	number_t cos_theta = dot(normal, ls.direction);
+	Vec3 reflectance = l.albedo * l.reflectance;
+	if (cos_theta <= 0.f || ls.pdf <= 0.f || max(reflectance.x, reflectance.y, reflectance.z) <= 0.f)
+		return {};
+	number_t weight = mis_weight(ls.pdf, cos_theta / PI);
+	Vec3 radiance = reflectance * lights.emissive(ls.light) * (cos_theta / PI * weight / ls.pdf);
+	return DirectLight{ Ray(pos, ls.direction).advance(advance), lights.sphere(ls.light), radiance };
+}
+
+Scatter scatter_dielectric(const Dielectric& d, const Ray& ray, const Vec3& pos, Vec3 normal, number_t advance, Sampler& sampler) {
+	bool is_front = dot(ray.direction(), -normal.normalize()) < 0.f;
+	number_t refraction_ratio = is_front ? d.refractive_index : 1.f / d.refractive_index;
+	// Check if internal or external refraction
+
+	double cos_theta = fmin(dot(-ray.direction(), normal), 1.0);
+	double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+
+	bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+
+	Vec3 scatter_dir = reflect(ray.direction().normalize(), normal.normalize());
+	if (!cannot_refract)
+		scatter_dir = refract(ray.direction().normalize(), normal.normalize() * (is_front ? -1.f : 1.f), refraction_ratio);
+
+	scatter_dir = scatter_dir + random_in_unit_sphere(sampler) * 0.1f;
+
+	return Scatter{ d.emissive, Vec3{ 1.f, 1.f, 1.f }, Ray(pos, scatter_dir).advance(advance), 0.f };
+}
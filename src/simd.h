@@ -0,0 +1,313 @@
+#pragma once
+
+#include "math.h"
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PATHTRACER_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define PATHTRACER_X86_DISPATCH 0
+#endif
+
+// gcc fuses the mul/add intrinsics into fma once a target implies it, which changes rounding
+#if PATHTRACER_X86_DISPATCH && !defined(__clang__)
+#define PATHTRACER_SIMD_KERNEL(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#elif PATHTRACER_X86_DISPATCH
+#define PATHTRACER_SIMD_KERNEL(isa) __attribute__((target(isa)))
+#endif
+
+enum struct SimdLevel {
+	Scalar,
+	SSE2,
+	AVX2,
+	AVX512
+};
+
+const char* simd_level_name(SimdLevel l) {
+	switch (l) {
+	case SimdLevel::SSE2: return "sse2";
+	case SimdLevel::AVX2: return "avx2";
+	case SimdLevel::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+// Widest instruction set the cpu running the process supports
+SimdLevel detect_simd_level() {
+#if PATHTRACER_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SimdLevel::AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::AVX2;
+	return SimdLevel::SSE2;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel& simd_level_storage() {
+	static SimdLevel level = detect_simd_level();
+	return level;
+}
+
+SimdLevel simd_level() {
+	return simd_level_storage();
+}
+
+// Lowers the kernel level used by the dispatchers, requests above what the cpu supports are clamped
+void set_simd_level(SimdLevel l) {
+	simd_level_storage() = (u32)l < (u32)detect_simd_level() ? l : detect_simd_level();
+}
+
+// Allocator for arrays that wide loads read from, aligned to a cache line
+template<typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+	using value_type = T;
+
+	AlignedAllocator() = default;
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+	}
+	void deallocate(T* p, size_t) {
+		::operator delete(p, std::align_val_t(Alignment));
+	}
+	template<typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, Alignment>;
+	};
+	bool operator==(const AlignedAllocator&) const { return true; }
+	bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+/*
+Portable wide math. VecN<W> holds W number_t lanes, Vec3N<W> holds W vectors
+lane by lane like RayPacket does. With gcc and clang the lanes are vector
+extension types, lowered to whatever the target has (sse2 by default, avx
+with -mavx2 ...), other compilers get plain arrays and per lane loops.
+Every lane gets exactly the result the scalar Vec3 function gives.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define PATHTRACER_VECTOR_EXT 1
+#else
+#define PATHTRACER_VECTOR_EXT 0
+#endif
+
+// Lanes of the widest register the build targets, the default width of the wide types
+#if defined(__AVX__)
+constexpr u32 SIMD_WIDTH = 32 / sizeof(number_t);
+#else
+constexpr u32 SIMD_WIDTH = 16 / sizeof(number_t);
+#endif
+
+#if PATHTRACER_VECTOR_EXT
+// Declared outside VecN, gcc does not see a dependent vector_size typedef as a vector inside the template
+template<typename T, u32 Bytes>
+struct VectorExt {
+	typedef T type __attribute__((vector_size(Bytes)));
+};
+#else
+// Fallback for the vector extension types, same operators lane by lane
+template<typename T, u32 W>
+struct LaneArray {
+	T l[W];
+
+	T& operator[](u32 i) { return l[i]; }
+	T operator[](u32 i) const { return l[i]; }
+#define PATHTRACER_LANE_OP(op) \
+	LaneArray operator op(const LaneArray& b) const { LaneArray r; for (u32 i = 0; i < W; i++) r.l[i] = l[i] op b.l[i]; return r; }
+	PATHTRACER_LANE_OP(+)
+	PATHTRACER_LANE_OP(-)
+	PATHTRACER_LANE_OP(*)
+	PATHTRACER_LANE_OP(/)
+#undef PATHTRACER_LANE_OP
+	LaneArray operator-() const { LaneArray r; for (u32 i = 0; i < W; i++) r.l[i] = -l[i]; return r; }
+	LaneArray<bool, W> operator<(const LaneArray& b) const { LaneArray<bool, W> r; for (u32 i = 0; i < W; i++) r.l[i] = l[i] < b.l[i]; return r; }
+};
+#endif
+
+template<u32 W = SIMD_WIDTH>
+struct VecN {
+	static_assert(W > 0 && (W & (W - 1)) == 0, "vector extensions need a power of two lane count");
+#if PATHTRACER_VECTOR_EXT
+	using type = typename VectorExt<number_t, W * sizeof(number_t)>::type;
+#else
+	using type = LaneArray<number_t, W>;
+#endif
+	// Result of a lane wise comparison, wrapped so it is passed like VecN and not as a bare vector
+	struct mask {
+		decltype(type{} < type{}) m;
+	};
+	type v;
+
+	static VecN broadcast(number_t s) {
+		VecN r;
+		for (u32 l = 0; l < W; l++)
+			r.v[l] = s;
+		return r;
+	}
+	static VecN load(const number_t* p) {
+		VecN r;
+		memcpy(&r.v, p, sizeof(r.v));
+		return r;
+	}
+	void store(number_t* p) const {
+		memcpy(p, &v, sizeof(v));
+	}
+	number_t operator[](u32 l) const { return v[l]; }
+	void set(u32 l, number_t s) { v[l] = s; }
+};
+
+template<u32 W> VecN<W> operator+(VecN<W> a, VecN<W> b) { return { a.v + b.v }; }
+template<u32 W> VecN<W> operator-(VecN<W> a, VecN<W> b) { return { a.v - b.v }; }
+template<u32 W> VecN<W> operator*(VecN<W> a, VecN<W> b) { return { a.v * b.v }; }
+template<u32 W> VecN<W> operator/(VecN<W> a, VecN<W> b) { return { a.v / b.v }; }
+template<u32 W> VecN<W> operator-(VecN<W> a) { return { -a.v }; }
+template<u32 W> VecN<W> operator*(VecN<W> a, number_t b) { return a * VecN<W>::broadcast(b); }
+template<u32 W> VecN<W> operator-(number_t a, VecN<W> b) { return VecN<W>::broadcast(a) - b; }
+template<u32 W> typename VecN<W>::mask operator<(VecN<W> a, VecN<W> b) { return { a.v < b.v }; }
+
+// Lanes of 'a' where the mask is set, lanes of 'b' elsewhere
+template<u32 W>
+VecN<W> select(typename VecN<W>::mask m, VecN<W> a, VecN<W> b) {
+#if PATHTRACER_VECTOR_EXT
+	return { m.m ? a.v : b.v };
+#else
+	VecN<W> r;
+	for (u32 l = 0; l < W; l++)
+		r.v[l] = m.m[l] ? a.v[l] : b.v[l];
+	return r;
+#endif
+}
+
+// Vector extensions have no sqrt, x86 takes it a register at a time, elsewhere lane by lane
+#if PATHTRACER_X86_DISPATCH && defined(__AVX__)
+void sqrt_register(const double* in, double* out) { _mm256_storeu_pd(out, _mm256_sqrt_pd(_mm256_loadu_pd(in))); }
+void sqrt_register(const float* in, float* out) { _mm256_storeu_ps(out, _mm256_sqrt_ps(_mm256_loadu_ps(in))); }
+constexpr u32 SQRT_REGISTER_BYTES = 32;
+#elif PATHTRACER_X86_DISPATCH && defined(__SSE2__)
+void sqrt_register(const double* in, double* out) { _mm_storeu_pd(out, _mm_sqrt_pd(_mm_loadu_pd(in))); }
+void sqrt_register(const float* in, float* out) { _mm_storeu_ps(out, _mm_sqrt_ps(_mm_loadu_ps(in))); }
+constexpr u32 SQRT_REGISTER_BYTES = 16;
+#else
+constexpr u32 SQRT_REGISTER_BYTES = 0;
+#endif
+
+template<u32 W>
+VecN<W> sqrt(VecN<W> a) {
+	VecN<W> r;
+	const number_t* in = (const number_t*)&a.v;
+	number_t* out = (number_t*)&r.v;
+	if constexpr (SQRT_REGISTER_BYTES != 0 && sizeof(a.v) % SQRT_REGISTER_BYTES == 0) {
+		for (u32 l = 0; l < W; l += SQRT_REGISTER_BYTES / sizeof(number_t))
+			sqrt_register(in + l, out + l);
+	}
+	else {
+		for (u32 l = 0; l < W; l++)
+			out[l] = std::sqrt(in[l]);
+	}
+	return r;
+}
+
+template<u32 W = SIMD_WIDTH>
+struct Vec3N {
+	VecN<W> x, y, z;
+
+	static Vec3N broadcast(const Vec3& v) {
+		return { VecN<W>::broadcast(v.x), VecN<W>::broadcast(v.y), VecN<W>::broadcast(v.z) };
+	}
+	// W vectors from structure of arrays storage
+	static Vec3N load(const number_t* px, const number_t* py, const number_t* pz) {
+		return { VecN<W>::load(px), VecN<W>::load(py), VecN<W>::load(pz) };
+	}
+	void store(number_t* px, number_t* py, number_t* pz) const {
+		x.store(px);
+		y.store(py);
+		z.store(pz);
+	}
+	Vec3 get(u32 l) const { return Vec3{ x[l], y[l], z[l] }; }
+	void set(u32 l, const Vec3& v) {
+		x.set(l, v.x);
+		y.set(l, v.y);
+		z.set(l, v.z);
+	}
+
+	Vec3N normalize() const {
+		VecN<W> len = sqrt(x * x + y * y + z * z);
+		return { x / len, y / len, z / len };
+	}
+	Vec3N operator-() const {
+		return { -x, -y, -z };
+	}
+};
+
+template<u32 W> Vec3N<W> operator+(const Vec3N<W>& a, const Vec3N<W>& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+template<u32 W> Vec3N<W> operator-(const Vec3N<W>& a, const Vec3N<W>& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+template<u32 W> Vec3N<W> operator*(const Vec3N<W>& a, const Vec3N<W>& b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+template<u32 W> Vec3N<W> operator*(const Vec3N<W>& a, VecN<W> s) { return { a.x * s, a.y * s, a.z * s }; }
+template<u32 W> Vec3N<W> operator*(const Vec3N<W>& a, number_t s) { return a * VecN<W>::broadcast(s); }
+
+template<u32 W>
+Vec3N<W> select(typename VecN<W>::mask m, const Vec3N<W>& a, const Vec3N<W>& b) {
+	return { select<W>(m, a.x, b.x), select<W>(m, a.y, b.y), select<W>(m, a.z, b.z) };
+}
+
+template<u32 W>
+VecN<W> dot(const Vec3N<W>& a, const Vec3N<W>& b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+template<u32 W>
+VecN<W> square_length(const Vec3N<W>& v) {
+	return v.x * v.x + v.y * v.y + v.z * v.z;
+}
+
+template<u32 W>
+VecN<W> distance(const Vec3N<W>& a, const Vec3N<W>& b) {
+	Vec3N<W> ab = a - b;
+	return sqrt(square_length(ab));
+}
+
+template<u32 W>
+Vec3N<W> reflect(const Vec3N<W>& v, const Vec3N<W>& n) {
+	return v - n * 2 * dot(v, n);
+}
+
+// Lanes with total internal reflection get a zero vector, like the scalar version
+template<u32 W>
+Vec3N<W> refract(const Vec3N<W>& v, const Vec3N<W>& n, number_t eta) {
+	VecN<W> d = dot(n, v);
+	VecN<W> k = 1.f - VecN<W>::broadcast(eta * eta) * (1.f - d * d);
+	VecN<W> zero = VecN<W>::broadcast(0.f);
+	typename VecN<W>::mask tir = k < zero;
+	// Keeps sqrt from seeing negative lanes
+	k = select<W>(tir, zero, k);
+	Vec3N<W> r = v * eta - n * (VecN<W>::broadcast(eta) * d + sqrt(k));
+	return select<W>(tir, Vec3N<W>::broadcast(Vec3{ 0.f, 0.f, 0.f }), r);
+}
+
+// Rotations by the same angle for every lane, sin and cos are computed once
+template<u32 W>
+Vec3N<W> rotate_z(const Vec3N<W>& p, number_t ang) {
+	number_t c = std::cos(ang), s = std::sin(ang);
+	return { p.x * c - p.y * s, p.x * s + p.y * c, p.z };
+}
+
+template<u32 W>
+Vec3N<W> rotate_y(const Vec3N<W>& p, number_t ang) {
+	number_t c = std::cos(ang), s = std::sin(ang);
+	return { p.x * c + p.z * s, p.y, -p.x * s + p.z * c };
+}
+
+template<u32 W>
+Vec3N<W> rotate_x(const Vec3N<W>& p, number_t ang) {
+	number_t c = std::cos(ang), s = std::sin(ang);
+	return { p.x, p.y * c - p.z * s, p.y * s + p.z * c };
+}
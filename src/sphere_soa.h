@@ -0,0 +1,415 @@
+#pragma once
+
+#include "math.h"
+#include "simd.h"
+#include "primitives.h"
+
+#include <vector>
+#include <cfloat>
+
+/*
+Sphere geometry as separate x/y/z/radius arrays.
+
+Distance queries only touch the four arrays they need instead of whole Sphere
+records. Arrays are cache line aligned and padded past the last sphere so
+the wide kernels can load a full register at any index.
+
+The arrays are either built and owned here or borrowed from memory that
+outlives this object, such as a mapped scene file.
+*/
+class SphereSoA {
+public:
+	// Lanes of a 256 and a 512 bit register, double or float depending on number_t
+	static constexpr u32 LANES_256 = 32 / sizeof(number_t);
+	static constexpr u32 LANES_512 = 64 / sizeof(number_t);
+	// Widest kernel reads this many lanes at a time
+	static constexpr u32 PADDING = LANES_512;
+
+	void build(const std::vector<Sphere>& spheres) {
+		count = (u32)spheres.size();
+		u32 padded = count + PADDING;
+		x_storage.assign(padded, 0.f);
+		y_storage.assign(padded, 0.f);
+		z_storage.assign(padded, 0.f);
+		r_storage.assign(padded, 0.f);
+		for (u32 i = 0; i < count; i++) {
+			x_storage[i] = spheres[i].pos.x;
+			y_storage[i] = spheres[i].pos.y;
+			z_storage[i] = spheres[i].pos.z;
+			r_storage[i] = spheres[i].radius;
+		}
+		x = x_storage.data();
+		y = y_storage.data();
+		z = z_storage.data();
+		r = r_storage.data();
+	}
+	// Uses external arrays of n + PADDING entries each without copying them
+	void borrow(u32 n, const number_t* bx, const number_t* by, const number_t* bz, const number_t* br) {
+		for (auto* a : { &x_storage, &y_storage, &z_storage, &r_storage })
+			*a = Array{};
+		count = n;
+		x = bx;
+		y = by;
+		z = bz;
+		r = br;
+	}
+	u32 size() const { return count; }
+	Vec3 center(u32 i) const { return Vec3{ x[i], y[i], z[i] }; }
+	number_t radius(u32 i) const { return r[i]; }
+	// Padded arrays, for writing them out
+	const number_t* data_x() const { return x; }
+	const number_t* data_y() const { return y; }
+	const number_t* data_z() const { return z; }
+	const number_t* data_r() const { return r; }
+
+	/*
+	Packet version of nearest, each sphere is loaded once and tested against
+	every lane. Lanes keep the smaller of their current best and the new
+	distance.
+	*/
+	template<u32 N>
+	void nearest_packet(const number_t* px, const number_t* py, const number_t* pz, u32 begin, u32 end, number_t* best) const {
+		switch (simd_level()) {
+#if PATHTRACER_X86_DISPATCH
+		case SimdLevel::AVX512:
+			if constexpr (N % LANES_512 == 0)
+				return nearest_packet_avx512<N>(px, py, pz, begin, end, best);
+			[[fallthrough]];
+		case SimdLevel::AVX2:
+			if constexpr (N % LANES_256 == 0)
+				return nearest_packet_avx2<N>(px, py, pz, begin, end, best);
+			[[fallthrough]];
+#endif
+		default:
+			for (u32 i = begin; i < end; i++) {
+				number_t sx = x[i], sy = y[i], sz = z[i], sr = r[i];
+				for (u32 l = 0; l < N; l++) {
+					number_t dx = px[l] - sx;
+					number_t dy = py[l] - sy;
+					number_t dz = pz[l] - sz;
+					number_t d = std::abs(std::sqrt(dx * dx + dy * dy + dz * dz) - sr);
+					best[l] = d < best[l] ? d : best[l];
+				}
+			}
+		}
+	}
+#if PATHTRACER_X86_DISPATCH && !defined(PATHTRACER_FLOAT)
+	template<u32 N>
+	PATHTRACER_SIMD_KERNEL("avx2")
+	void nearest_packet_avx2(const number_t* px, const number_t* py, const number_t* pz, u32 begin, u32 end, number_t* best) const {
+		constexpr u32 V = N / 4;
+		__m256d sign = _mm256_set1_pd(-0.0);
+		__m256d vx[V], vy[V], vz[V], vb[V];
+		for (u32 v = 0; v < V; v++) {
+			vx[v] = _mm256_loadu_pd(px + v * 4);
+			vy[v] = _mm256_loadu_pd(py + v * 4);
+			vz[v] = _mm256_loadu_pd(pz + v * 4);
+			vb[v] = _mm256_loadu_pd(best + v * 4);
+		}
+		for (u32 i = begin; i < end; i++) {
+			__m256d sx = _mm256_set1_pd(x[i]), sy = _mm256_set1_pd(y[i]), sz = _mm256_set1_pd(z[i]), sr = _mm256_set1_pd(r[i]);
+			for (u32 v = 0; v < V; v++) {
+				__m256d dx = _mm256_sub_pd(vx[v], sx);
+				__m256d dy = _mm256_sub_pd(vy[v], sy);
+				__m256d dz = _mm256_sub_pd(vz[v], sz);
+				__m256d len = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)));
+				__m256d d = _mm256_andnot_pd(sign, _mm256_sub_pd(len, sr));
+				vb[v] = _mm256_min_pd(d, vb[v]);
+			}
+		}
+		for (u32 v = 0; v < V; v++)
+			_mm256_storeu_pd(best + v * 4, vb[v]);
+	}
+	template<u32 N>
+	PATHTRACER_SIMD_KERNEL("avx512f")
+	void nearest_packet_avx512(const number_t* px, const number_t* py, const number_t* pz, u32 begin, u32 end, number_t* best) const {
+		constexpr u32 V = N / 8;
+		__m512i abs_mask = _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFll);
+		__m512d vx[V], vy[V], vz[V], vb[V];
+		for (u32 v = 0; v < V; v++) {
+			vx[v] = _mm512_loadu_pd(px + v * 8);
+			vy[v] = _mm512_loadu_pd(py + v * 8);
+			vz[v] = _mm512_loadu_pd(pz + v * 8);
+			vb[v] = _mm512_loadu_pd(best + v * 8);
+		}
+		for (u32 i = begin; i < end; i++) {
+			__m512d sx = _mm512_set1_pd(x[i]), sy = _mm512_set1_pd(y[i]), sz = _mm512_set1_pd(z[i]), sr = _mm512_set1_pd(r[i]);
+			for (u32 v = 0; v < V; v++) {
+				__m512d dx = _mm512_sub_pd(vx[v], sx);
+				__m512d dy = _mm512_sub_pd(vy[v], sy);
+				__m512d dz = _mm512_sub_pd(vz[v], sz);
+				__m512d len = _mm512_sqrt_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz)));
+				__m512d d = _mm512_castsi512_pd(_mm512_and_epi64(_mm512_castpd_si512(_mm512_sub_pd(len, sr)), abs_mask));
+				vb[v] = _mm512_min_pd(d, vb[v]);
+			}
+		}
+		for (u32 v = 0; v < V; v++)
+			_mm512_storeu_pd(best + v * 8, vb[v]);
+	}
+#endif
+
+	// Smallest unsigned surface distance from p over spheres [begin, end), ties go to the lowest index
+	number_t nearest(Vec3 p, u32 begin, u32 end, u32& index) const {
+#if defined(PATHTRACER_FLOAT)
+		// Float kernels track indices in float lanes, which are exact up to 2^24
+		if (end > (1u << 24))
+			return nearest_scalar(p, begin, end, index);
+#endif
+		switch (simd_level()) {
+#if PATHTRACER_X86_DISPATCH
+		case SimdLevel::AVX512: return nearest_avx512(p, begin, end, index);
+		case SimdLevel::AVX2: return nearest_avx2(p, begin, end, index);
+		case SimdLevel::SSE2: return nearest_sse2(p, begin, end, index);
+#endif
+		default: return nearest_scalar(p, begin, end, index);
+		}
+	}
+	number_t nearest_scalar(Vec3 p, u32 begin, u32 end, u32& index) const {
+		number_t best = FLT_MAX;
+		index = 0;
+		for (u32 i = begin; i < end; i++) {
+			number_t dx = p.x - x[i];
+			number_t dy = p.y - y[i];
+			number_t dz = p.z - z[i];
+			number_t d = std::abs(std::sqrt(dx * dx + dy * dy + dz * dz) - r[i]);
+			if (d < best) {
+				best = d;
+				index = i;
+			}
+		}
+		return best;
+	}
+#if PATHTRACER_X86_DISPATCH && !defined(PATHTRACER_FLOAT)
+	/*
+	The wide kernels keep a best distance and index per lane and reduce at the end.
+	They evaluate the same expression as the scalar loop without fma contraction
+	so every path returns bit identical distances.
+	*/
+	PATHTRACER_SIMD_KERNEL("sse2")
+	number_t nearest_sse2(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m128d px = _mm_set1_pd(p.x), py = _mm_set1_pd(p.y), pz = _mm_set1_pd(p.z);
+		__m128d sign = _mm_set1_pd(-0.0);
+		__m128d best = _mm_set1_pd(FLT_MAX);
+		__m128d best_index = _mm_setzero_pd();
+		__m128d lane = _mm_set_pd((double)begin + 1.0, (double)begin);
+		__m128d last = _mm_set1_pd((double)end);
+		__m128d step = _mm_set1_pd(2.0);
+		for (u32 i = begin; i < end; i += 2) {
+			__m128d dx = _mm_sub_pd(px, _mm_loadu_pd(&x[i]));
+			__m128d dy = _mm_sub_pd(py, _mm_loadu_pd(&y[i]));
+			__m128d dz = _mm_sub_pd(pz, _mm_loadu_pd(&z[i]));
+			__m128d len = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz)));
+			__m128d d = _mm_andnot_pd(sign, _mm_sub_pd(len, _mm_loadu_pd(&r[i])));
+			__m128d closer = _mm_and_pd(_mm_cmplt_pd(d, best), _mm_cmplt_pd(lane, last));
+			best = _mm_or_pd(_mm_and_pd(closer, d), _mm_andnot_pd(closer, best));
+			best_index = _mm_or_pd(_mm_and_pd(closer, lane), _mm_andnot_pd(closer, best_index));
+			lane = _mm_add_pd(lane, step);
+		}
+		alignas(16) double dists[2], indices[2];
+		_mm_store_pd(dists, best);
+		_mm_store_pd(indices, best_index);
+		return reduce_lanes(dists, indices, 2, index);
+	}
+	PATHTRACER_SIMD_KERNEL("avx2")
+	number_t nearest_avx2(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m256d px = _mm256_set1_pd(p.x), py = _mm256_set1_pd(p.y), pz = _mm256_set1_pd(p.z);
+		__m256d sign = _mm256_set1_pd(-0.0);
+		__m256d best = _mm256_set1_pd(FLT_MAX);
+		__m256d best_index = _mm256_setzero_pd();
+		__m256d lane = _mm256_add_pd(_mm256_set1_pd((double)begin), _mm256_set_pd(3.0, 2.0, 1.0, 0.0));
+		__m256d last = _mm256_set1_pd((double)end);
+		__m256d step = _mm256_set1_pd(4.0);
+		for (u32 i = begin; i < end; i += 4) {
+			__m256d dx = _mm256_sub_pd(px, _mm256_loadu_pd(&x[i]));
+			__m256d dy = _mm256_sub_pd(py, _mm256_loadu_pd(&y[i]));
+			__m256d dz = _mm256_sub_pd(pz, _mm256_loadu_pd(&z[i]));
+			__m256d len = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)));
+			__m256d d = _mm256_andnot_pd(sign, _mm256_sub_pd(len, _mm256_loadu_pd(&r[i])));
+			__m256d closer = _mm256_and_pd(_mm256_cmp_pd(d, best, _CMP_LT_OQ), _mm256_cmp_pd(lane, last, _CMP_LT_OQ));
+			best = _mm256_blendv_pd(best, d, closer);
+			best_index = _mm256_blendv_pd(best_index, lane, closer);
+			lane = _mm256_add_pd(lane, step);
+		}
+		alignas(32) double dists[4], indices[4];
+		_mm256_store_pd(dists, best);
+		_mm256_store_pd(indices, best_index);
+		return reduce_lanes(dists, indices, 4, index);
+	}
+	PATHTRACER_SIMD_KERNEL("avx512f")
+	number_t nearest_avx512(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m512d px = _mm512_set1_pd(p.x), py = _mm512_set1_pd(p.y), pz = _mm512_set1_pd(p.z);
+		__m512i abs_mask = _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFll);
+		__m512d best = _mm512_set1_pd(FLT_MAX);
+		__m512d best_index = _mm512_setzero_pd();
+		__m512d lane = _mm512_add_pd(_mm512_set1_pd((double)begin), _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0));
+		__m512d step = _mm512_set1_pd(8.0);
+		for (u32 i = begin; i < end; i += 8) {
+			__mmask8 valid = end - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (end - i)) - 1);
+			__m512d dx = _mm512_sub_pd(px, _mm512_loadu_pd(&x[i]));
+			__m512d dy = _mm512_sub_pd(py, _mm512_loadu_pd(&y[i]));
+			__m512d dz = _mm512_sub_pd(pz, _mm512_loadu_pd(&z[i]));
+			__m512d len = _mm512_sqrt_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz)));
+			__m512d d = _mm512_castsi512_pd(_mm512_and_epi64(_mm512_castpd_si512(_mm512_sub_pd(len, _mm512_loadu_pd(&r[i]))), abs_mask));
+			__mmask8 closer = _mm512_mask_cmp_pd_mask(valid, d, best, _CMP_LT_OQ);
+			best = _mm512_mask_blend_pd(closer, best, d);
+			best_index = _mm512_mask_blend_pd(closer, best_index, lane);
+			lane = _mm512_add_pd(lane, step);
+		}
+		alignas(64) double dists[8], indices[8];
+		_mm512_store_pd(dists, best);
+		_mm512_store_pd(indices, best_index);
+		return reduce_lanes(dists, indices, 8, index);
+	}
+#endif
+#if PATHTRACER_X86_DISPATCH && defined(PATHTRACER_FLOAT)
+	// Float versions of the kernels above, twice the lanes per register
+	template<u32 N>
+	PATHTRACER_SIMD_KERNEL("avx2")
+	void nearest_packet_avx2(const number_t* px, const number_t* py, const number_t* pz, u32 begin, u32 end, number_t* best) const {
+		constexpr u32 V = N / 8;
+		__m256 sign = _mm256_set1_ps(-0.0f);
+		__m256 vx[V], vy[V], vz[V], vb[V];
+		for (u32 v = 0; v < V; v++) {
+			vx[v] = _mm256_loadu_ps(px + v * 8);
+			vy[v] = _mm256_loadu_ps(py + v * 8);
+			vz[v] = _mm256_loadu_ps(pz + v * 8);
+			vb[v] = _mm256_loadu_ps(best + v * 8);
+		}
+		for (u32 i = begin; i < end; i++) {
+			__m256 sx = _mm256_set1_ps(x[i]), sy = _mm256_set1_ps(y[i]), sz = _mm256_set1_ps(z[i]), sr = _mm256_set1_ps(r[i]);
+			for (u32 v = 0; v < V; v++) {
+				__m256 dx = _mm256_sub_ps(vx[v], sx);
+				__m256 dy = _mm256_sub_ps(vy[v], sy);
+				__m256 dz = _mm256_sub_ps(vz[v], sz);
+				__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+				__m256 d = _mm256_andnot_ps(sign, _mm256_sub_ps(len, sr));
+				vb[v] = _mm256_min_ps(d, vb[v]);
+			}
+		}
+		for (u32 v = 0; v < V; v++)
+			_mm256_storeu_ps(best + v * 8, vb[v]);
+	}
+	template<u32 N>
+	PATHTRACER_SIMD_KERNEL("avx512f")
+	void nearest_packet_avx512(const number_t* px, const number_t* py, const number_t* pz, u32 begin, u32 end, number_t* best) const {
+		constexpr u32 V = N / 16;
+		__m512i abs_mask = _mm512_set1_epi32(0x7FFFFFFF);
+		__m512 vx[V], vy[V], vz[V], vb[V];
+		for (u32 v = 0; v < V; v++) {
+			vx[v] = _mm512_loadu_ps(px + v * 16);
+			vy[v] = _mm512_loadu_ps(py + v * 16);
+			vz[v] = _mm512_loadu_ps(pz + v * 16);
+			vb[v] = _mm512_loadu_ps(best + v * 16);
+		}
+		for (u32 i = begin; i < end; i++) {
+			__m512 sx = _mm512_set1_ps(x[i]), sy = _mm512_set1_ps(y[i]), sz = _mm512_set1_ps(z[i]), sr = _mm512_set1_ps(r[i]);
+			for (u32 v = 0; v < V; v++) {
+				__m512 dx = _mm512_sub_ps(vx[v], sx);
+				__m512 dy = _mm512_sub_ps(vy[v], sy);
+				__m512 dz = _mm512_sub_ps(vz[v], sz);
+				__m512 len = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz)));
+				__m512 d = _mm512_castsi512_ps(_mm512_and_epi32(_mm512_castps_si512(_mm512_sub_ps(len, sr)), abs_mask));
+				vb[v] = _mm512_min_ps(d, vb[v]);
+			}
+		}
+		for (u32 v = 0; v < V; v++)
+			_mm512_storeu_ps(best + v * 16, vb[v]);
+	}
+	PATHTRACER_SIMD_KERNEL("sse2")
+	number_t nearest_sse2(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+		__m128 sign = _mm_set1_ps(-0.0f);
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		__m128 best_index = _mm_setzero_ps();
+		__m128 lane = _mm_add_ps(_mm_set1_ps((float)begin), _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+		__m128 last = _mm_set1_ps((float)end);
+		__m128 step = _mm_set1_ps(4.f);
+		for (u32 i = begin; i < end; i += 4) {
+			__m128 dx = _mm_sub_ps(px, _mm_loadu_ps(&x[i]));
+			__m128 dy = _mm_sub_ps(py, _mm_loadu_ps(&y[i]));
+			__m128 dz = _mm_sub_ps(pz, _mm_loadu_ps(&z[i]));
+			__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+			__m128 d = _mm_andnot_ps(sign, _mm_sub_ps(len, _mm_loadu_ps(&r[i])));
+			__m128 closer = _mm_and_ps(_mm_cmplt_ps(d, best), _mm_cmplt_ps(lane, last));
+			best = _mm_or_ps(_mm_and_ps(closer, d), _mm_andnot_ps(closer, best));
+			best_index = _mm_or_ps(_mm_and_ps(closer, lane), _mm_andnot_ps(closer, best_index));
+			lane = _mm_add_ps(lane, step);
+		}
+		alignas(16) float dists[4], indices[4];
+		_mm_store_ps(dists, best);
+		_mm_store_ps(indices, best_index);
+		return reduce_lanes(dists, indices, 4, index);
+	}
+	PATHTRACER_SIMD_KERNEL("avx2")
+	number_t nearest_avx2(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m256 px = _mm256_set1_ps(p.x), py = _mm256_set1_ps(p.y), pz = _mm256_set1_ps(p.z);
+		__m256 sign = _mm256_set1_ps(-0.0f);
+		__m256 best = _mm256_set1_ps(FLT_MAX);
+		__m256 best_index = _mm256_setzero_ps();
+		__m256 lane = _mm256_add_ps(_mm256_set1_ps((float)begin), _mm256_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f));
+		__m256 last = _mm256_set1_ps((float)end);
+		__m256 step = _mm256_set1_ps(8.f);
+		for (u32 i = begin; i < end; i += 8) {
+			__m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(&x[i]));
+			__m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(&y[i]));
+			__m256 dz = _mm256_sub_ps(pz, _mm256_loadu_ps(&z[i]));
+			__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+			__m256 d = _mm256_andnot_ps(sign, _mm256_sub_ps(len, _mm256_loadu_ps(&r[i])));
+			__m256 closer = _mm256_and_ps(_mm256_cmp_ps(d, best, _CMP_LT_OQ), _mm256_cmp_ps(lane, last, _CMP_LT_OQ));
+			best = _mm256_blendv_ps(best, d, closer);
+			best_index = _mm256_blendv_ps(best_index, lane, closer);
+			lane = _mm256_add_ps(lane, step);
+		}
+		alignas(32) float dists[8], indices[8];
+		_mm256_store_ps(dists, best);
+		_mm256_store_ps(indices, best_index);
+		return reduce_lanes(dists, indices, 8, index);
+	}
+	PATHTRACER_SIMD_KERNEL("avx512f")
+	number_t nearest_avx512(Vec3 p, u32 begin, u32 end, u32& index) const {
+		__m512 px = _mm512_set1_ps(p.x), py = _mm512_set1_ps(p.y), pz = _mm512_set1_ps(p.z);
+		__m512i abs_mask = _mm512_set1_epi32(0x7FFFFFFF);
+		__m512 best = _mm512_set1_ps(FLT_MAX);
+		__m512 best_index = _mm512_setzero_ps();
+		__m512 lane = _mm512_add_ps(_mm512_set1_ps((float)begin), _mm512_set_ps(15.f, 14.f, 13.f, 12.f, 11.f, 10.f, 9.f, 8.f, 7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f));
+		__m512 step = _mm512_set1_ps(16.f);
+		for (u32 i = begin; i < end; i += 16) {
+			__mmask16 valid = end - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (end - i)) - 1);
+			__m512 dx = _mm512_sub_ps(px, _mm512_loadu_ps(&x[i]));
+			__m512 dy = _mm512_sub_ps(py, _mm512_loadu_ps(&y[i]));
+			__m512 dz = _mm512_sub_ps(pz, _mm512_loadu_ps(&z[i]));
+			__m512 len = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz)));
+			__m512 d = _mm512_castsi512_ps(_mm512_and_epi32(_mm512_castps_si512(_mm512_sub_ps(len, _mm512_loadu_ps(&r[i]))), abs_mask));
+			__mmask16 closer = _mm512_mask_cmp_ps_mask(valid, d, best, _CMP_LT_OQ);
+			best = _mm512_mask_blend_ps(closer, best, d);
+			best_index = _mm512_mask_blend_ps(closer, best_index, lane);
+			lane = _mm512_add_ps(lane, step);
+		}
+		alignas(64) float dists[16], indices[16];
+		_mm512_store_ps(dists, best);
+		_mm512_store_ps(indices, best_index);
+		return reduce_lanes(dists, indices, 16, index);
+	}
+#endif
+private:
+	template<typename T>
+	static number_t reduce_lanes(const T* dists, const T* indices, u32 lanes, u32& index) {
+		number_t best = dists[0];
+		index = (u32)indices[0];
+		for (u32 l = 1; l < lanes; l++) {
+			if (dists[l] < best || (dists[l] == best && (u32)indices[l] < index)) {
+				best = dists[l];
+				index = (u32)indices[l];
+			}
+		}
+		return best;
+	}
+
+	using Array = std::vector<number_t, AlignedAllocator<number_t>>;
+	Array x_storage, y_storage, z_storage, r_storage;
+	const number_t* x = nullptr;
+	const number_t* y = nullptr;
+	const number_t* z = nullptr;
+	const number_t* r = nullptr;
+	u32 count = 0;
+};
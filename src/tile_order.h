@@ -0,0 +1,90 @@
+#pragma once
+
+#include "math.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+// Order in which render_mt dispatches its tiles
+enum struct TileOrder {
+	RowMajor,
+	// Most expensive first, from last frame's tile timings or a sparse pre-pass
+	Cost,
+	// Along a Hilbert curve, neighbouring tiles share scene data in the caches
+	Hilbert,
+	// Outwards from the center of the image
+	Spiral
+};
+
+// Position of (x, y) along the Hilbert curve filling a size x size grid, size a power of two
+u32 hilbert_index(u32 size, u32 x, u32 y) {
+	u32 d = 0;
+	for (u32 s = size / 2; s > 0; s /= 2) {
+		u32 rx = (x & s) > 0;
+		u32 ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so the sub curve connects
+		if (ry == 0) {
+			if (rx == 1) {
+				x = size - 1 - x;
+				y = size - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/*
+Grid indices (x + y * tiles_x) of the tiles in dispatch order.
+
+The scheduler hands every worker a contiguous block of the list. Row major
+and Hilbert keep those blocks compact, so a worker stays in one part of the
+image. Cost and spiral are priority orders, they are dealt round robin over
+the blocks instead so every worker starts on its share of the most
+expensive (or most central) tiles. 'cost' has one entry per grid tile,
+without it the cost order falls back to row major.
+*/
+std::vector<u32> order_tiles(u32 tiles_x, u32 tiles_y, TileOrder order, const std::vector<double>& cost, u32 workers) {
+	u32 count = tiles_x * tiles_y;
+	std::vector<u32> tiles(count);
+	std::iota(tiles.begin(), tiles.end(), 0);
+	if (order == TileOrder::Cost && cost.size() == count) {
+		std::stable_sort(tiles.begin(), tiles.end(), [&](u32 a, u32 b) { return cost[a] > cost[b]; });
+	}
+	else if (order == TileOrder::Hilbert) {
+		u32 size = std::bit_ceil(std::max(tiles_x, tiles_y));
+		std::vector<u32> d(count);
+		for (u32 t = 0; t < count; t++)
+			d[t] = hilbert_index(size, t % tiles_x, t / tiles_x);
+		std::sort(tiles.begin(), tiles.end(), [&](u32 a, u32 b) { return d[a] < d[b]; });
+		return tiles;
+	}
+	else if (order == TileOrder::Spiral) {
+		// Square rings around the center, each ring walked by angle
+		double cx = (tiles_x - 1) * 0.5, cy = (tiles_y - 1) * 0.5;
+		std::vector<std::pair<double, double>> key(count);
+		for (u32 t = 0; t < count; t++) {
+			double dx = t % tiles_x - cx, dy = t / tiles_x - cy;
+			key[t] = { std::round(std::max(std::abs(dx), std::abs(dy))), std::atan2(dy, dx) };
+		}
+		std::sort(tiles.begin(), tiles.end(), [&](u32 a, u32 b) { return key[a] < key[b]; });
+	}
+	else
+		return tiles;
+
+	// Deal the priority list over the same blocks TaskScheduler::parallel_for cuts
+	workers = std::max<u32>(workers, 1);
+	std::vector<u32> dealt(count), filled(workers, 0);
+	auto block_begin = [&](u32 j) { return (u32)((u64)count * j / workers); };
+	for (u32 k = 0; k < count; k++) {
+		u32 j = k % workers;
+		while (filled[j] == block_begin(j + 1) - block_begin(j))
+			j = (j + 1) % workers;
+		dealt[block_begin(j) + filled[j]++] = tiles[k];
+	}
+	return dealt;
+}
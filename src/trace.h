@@ -0,0 +1,173 @@
+#pragma once
+
+#include "math.h"
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Timeline of what the scheduler workers did, written as Chrome trace event
+JSON (chrome://tracing, ui.perfetto.dev).
+
+Every thread records into its own ring buffer, so recording takes no locks:
+the owner writes a slot and then publishes it by advancing the head. Once a
+ring is full the oldest events are overwritten. Rings are only read after
+the work that records into them has finished.
+
+Worker rings exist up front. Any other thread gets a ring of its own the
+first time it records, which is the only time it takes the tracer's lock.
+*/
+struct TraceEvent {
+	// Static string, names are not copied
+	const char* name;
+	u64 begin_ns, end_ns;
+	// Tile position, or ~0u for events without a tile
+	u32 x, y;
+};
+
+class TraceRing {
+public:
+	// Capacity is rounded up to a power of two
+	TraceRing(u32 capacity) : events(std::bit_ceil(std::max<u32>(capacity, 1))) {}
+
+	void push(const TraceEvent& e) {
+		u64 h = head.load(std::memory_order_relaxed);
+		events[h & (events.size() - 1)] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+	u64 size() const { return std::min<u64>(head.load(std::memory_order_acquire), events.size()); }
+	u64 dropped() const { return head.load(std::memory_order_acquire) - size(); }
+	// Oldest first
+	const TraceEvent& get(u64 i) const {
+		u64 first = head.load(std::memory_order_acquire) - size();
+		return events[(first + i) & (events.size() - 1)];
+	}
+private:
+	std::vector<TraceEvent> events;
+	std::atomic<u64> head = 0;
+};
+
+// Index of the TaskScheduler worker running on this thread, ~0u on other threads
+u32& worker_thread_index() {
+	thread_local u32 index = ~0u;
+	return index;
+}
+
+class Tracer {
+public:
+	// One ring per worker, threads that are not workers add theirs when they first record
+	Tracer(u32 thread_count, u32 events_per_thread = 1 << 16)
+		: epoch(std::chrono::steady_clock::now()), ring_capacity(events_per_thread) {
+		for (u32 i = 0; i < thread_count; i++)
+			rings.push_back(std::make_unique<TraceRing>(events_per_thread));
+	}
+
+	// Nanoseconds since the tracer was created
+	u64 now() const {
+		return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+	void record(const char* name, u64 begin_ns, u32 x = ~0u, u32 y = ~0u) {
+		u32 worker = worker_thread_index();
+		TraceRing& ring = worker < rings.size() ? *rings[worker] : other_ring();
+		ring.push(TraceEvent{ name, begin_ns, now(), x, y });
+	}
+
+	u64 event_count() const {
+		std::lock_guard l(others_mutex);
+		u64 n = 0;
+		for (auto& r : rings)
+			n += r->size();
+		for (auto& o : others)
+			n += o.ring->size();
+		return n;
+	}
+	u64 dropped() const {
+		std::lock_guard l(others_mutex);
+		u64 n = 0;
+		for (auto& r : rings)
+			n += r->dropped();
+		for (auto& o : others)
+			n += o.ring->dropped();
+		return n;
+	}
+
+	bool write_json(const std::string& filepath) const {
+		FILE* f = fopen(filepath.c_str(), "wb");
+		if (!f)
+			return false;
+		std::lock_guard l(others_mutex);
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		const char* sep = "";
+		u32 workers = (u32)rings.size();
+		for (u32 t = 0; t < workers + others.size(); t++) {
+			bool other = t >= workers;
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s%u\"}}",
+				sep, t, other ? "other " : "worker ", other ? t - workers : t);
+			sep = ",\n";
+			const TraceRing& r = other ? *others[t - workers].ring : *rings[t];
+			for (u64 i = 0; i < r.size(); i++) {
+				const TraceEvent& e = r.get(i);
+				// Chrome wants microseconds
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", e.name, t,
+					e.begin_ns / 1000.0, (e.end_ns - std::min(e.begin_ns, e.end_ns)) / 1000.0);
+				if (e.x != ~0u)
+					fprintf(f, ",\"args\":{\"x\":%u,\"y\":%u}", e.x, e.y);
+				fprintf(f, "}");
+			}
+		}
+		fprintf(f, "\n]}\n");
+		bool ok = !ferror(f);
+		return fclose(f) == 0 && ok;
+	}
+private:
+	// Ring of the calling thread that is not a worker, found again through a thread_local cache
+	TraceRing& other_ring() {
+		struct Cached {
+			const Tracer* tracer = nullptr;
+			u64 id = 0;
+			TraceRing* ring = nullptr;
+		};
+		thread_local Cached cached;
+		// The id tells a tracer apart from an earlier one at the same address
+		if (cached.tracer == this && cached.id == id)
+			return *cached.ring;
+		std::lock_guard l(others_mutex);
+		std::thread::id self = std::this_thread::get_id();
+		TraceRing* ring = nullptr;
+		for (auto& o : others)
+			if (o.thread == self)
+				ring = o.ring.get();
+		if (!ring) {
+			others.push_back(OtherThread{ self, std::make_unique<TraceRing>(ring_capacity) });
+			ring = others.back().ring.get();
+		}
+		cached = Cached{ this, id, ring };
+		return *ring;
+	}
+
+	static u64 next_id() {
+		static std::atomic<u64> last = 0;
+		return ++last;
+	}
+
+	struct OtherThread {
+		std::thread::id thread;
+		std::unique_ptr<TraceRing> ring;
+	};
+
+	std::chrono::steady_clock::time_point epoch;
+	u32 ring_capacity;
+	u64 id = next_id();
+	// Indexed by worker, never resized after construction so workers need no lock
+	std::vector<std::unique_ptr<TraceRing>> rings;
+	// Rings of other threads in the order they first recorded
+	mutable std::mutex others_mutex;
+	std::vector<OtherThread> others;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+#include "sampler.h"
+#include "shading.h"
+
+#include <vector>
+
+/*
+In flight path states of the wavefront engine, one entry per path in
+structure of arrays form. Each stage streams over the arrays it needs
+instead of carrying a whole path through every branch.
+*/
+struct PathPool {
+	// Current ray
+	std::vector<number_t> ox, oy, oz;
+	std::vector<number_t> dx, dy, dz;
+	// Accumulated light and throughput
+	std::vector<Vec3> color;
+	std::vector<Vec3> factor;
+	std::vector<Sampler> samplers;
+	// Direction density and origin of the last bounce, to weight the emitter the ray hits against light sampling
+	std::vector<number_t> bsdf_pdf;
+	std::vector<Vec3> bsdf_origin;
+	// Set by the shading stage for paths that end at this bounce
+	std::vector<u8> stopped;
+	// Intersection stage output
+	std::vector<Vec3> hit_pos;
+	std::vector<Vec3> hit_normal;
+	std::vector<const Material*> hit_material;
+	std::vector<u32> hit_sphere;
+
+	// Path indices still bouncing, and the per material shading queues they are sorted into
+	std::vector<u32> active;
+	std::vector<u32> lambertian_queue;
+	std::vector<u32> metallic_queue;
+	std::vector<u32> dielectric_queue;
+	// Shadow rays of the lambertian queue, radiance already scaled by the path's throughput
+	std::vector<std::pair<u32, DirectLight>> shadow_queue;
+
+	void resize(u32 n) {
+		for (auto* v : { &ox, &oy, &oz, &dx, &dy, &dz })
+			v->resize(n);
+		color.resize(n);
+		factor.resize(n);
+		samplers.resize(n);
+		bsdf_pdf.resize(n);
+		bsdf_origin.resize(n);
+		stopped.resize(n);
+		hit_pos.resize(n);
+		hit_normal.resize(n);
+		hit_material.resize(n);
+		hit_sphere.resize(n);
+		active.reserve(n);
+		lambertian_queue.reserve(n);
+		metallic_queue.reserve(n);
+		dielectric_queue.reserve(n);
+		shadow_queue.reserve(n);
+	}
+	u32 size() const { return (u32)color.size(); }
+
+	void set_ray(u32 i, const Ray& r) {
+		Vec3 o = r.origin(), d = r.direction();
+		ox[i] = o.x; oy[i] = o.y; oz[i] = o.z;
+		dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+	}
+	// Rebuilds the stored ray without normalizing the direction again
+	Ray ray(u32 i) const {
+		Vec3 d{ dx[i], dy[i], dz[i] };
+		Ray r(Vec3{ ox[i], oy[i], oz[i] }, d);
+		r.set_direction(d);
+		return r;
+	}
+};